@@ -0,0 +1,34 @@
+#include "alloccount.h"
+#include <stdlib.h>
+
+#ifdef __GLIBC__
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static long alloc_calls = 0;
+
+void *malloc(size_t size) {
+  __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size) {
+  __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+  return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size) {
+  __atomic_fetch_add(&alloc_calls, 1, __ATOMIC_RELAXED);
+  return __libc_realloc(ptr, size);
+}
+
+void free(void *ptr) { __libc_free(ptr); }
+
+long alloc_count(void) {
+  return __atomic_load_n(&alloc_calls, __ATOMIC_RELAXED);
+}
+#else
+long alloc_count(void) { return -1; }
+#endif
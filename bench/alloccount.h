@@ -0,0 +1,6 @@
+#ifndef ALLOCCOUNT_H
+#define ALLOCCOUNT_H
+
+long alloc_count(void);
+
+#endif
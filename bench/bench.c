@@ -0,0 +1,500 @@
+#include "alloccount.h"
+#include "batch.h"
+#include "closure.h"
+#include "fetch.h"
+#include "localstore.h"
+#include "mockcache.h"
+#include "narfetch.h"
+#include "narinfo.h"
+#include <getopt.h>
+#include <signal.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define BENCH_NARS 8
+
+typedef struct {
+  const char *name;
+  long version;
+} Protocol;
+
+typedef struct {
+  int count;
+  int jobs;
+  int hedge;
+} BenchOptions;
+
+typedef struct {
+  const char *scenario;
+  const char *protocol;
+  int requests;
+  int errors;
+  double seconds;
+  double *latencies;
+  long allocs;
+  long peak_kib;
+  uint64_t bytes;
+} BenchResult;
+
+typedef struct {
+  FetchRequest req;
+  double submitted;
+  int busy;
+} Slot;
+
+static char cache_url[64];
+static char store_db[64];
+static double *samples = NULL;
+static int sample_count = 0;
+static int error_count = 0;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static long peak_rss_kib(void) {
+  char line[256];
+  long kib = -1;
+  FILE *f = fopen("/proc/self/status", "r");
+
+  if (f) {
+    while (fgets(line, sizeof(line), f)) {
+      if (sscanf(line, "VmHWM: %ld kB", &kib) == 1)
+        break;
+    }
+    fclose(f);
+  }
+  if (kib < 0) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    kib = usage.ru_maxrss;
+  }
+  return kib;
+}
+
+static void lookup_done(FetchRequest *req) {
+  Slot *slot = req->data;
+  samples[sample_count++] = (now_seconds() - slot->submitted) * 1000.0;
+
+  if (req->result == CURLE_OK) {
+    Narinfo info;
+    if (narinfo_parse(req->response.ptr, req->response.len, &info,
+                      req->arena) == 0)
+      narinfo_free(&info);
+    else
+      error_count++;
+  } else {
+    error_count++;
+  }
+  slot->busy = 0;
+}
+
+static void run_lookups(BenchResult *result, int count, int jobs) {
+  Slot *slots = calloc(jobs, sizeof(*slots));
+  int next = 0;
+
+  samples = calloc(count, sizeof(*samples));
+  sample_count = 0;
+  error_count = 0;
+  if (!slots || !samples) {
+    fprintf(stderr, "bench: out of memory\n");
+    exit(1);
+  }
+
+  double start = now_seconds();
+  while (sample_count < count) {
+    for (int i = 0; i < jobs && next < count; ++i) {
+      if (slots[i].busy)
+        continue;
+
+      char hash[MOCK_HASH_LEN + 1];
+      mock_hash(next++, hash);
+      fetch_request_free(&slots[i].req);
+      fetch_narinfo_init(&slots[i].req, cache_url, hash);
+      slots[i].req.on_done = lookup_done;
+      slots[i].req.data = &slots[i];
+      slots[i].submitted = now_seconds();
+      slots[i].busy = 1;
+      if (fetch_add(&slots[i].req) != 0) {
+        slots[i].req.result = CURLE_FAILED_INIT;
+        lookup_done(&slots[i].req);
+      }
+    }
+    fetch_perform(100);
+  }
+  result->seconds = now_seconds() - start;
+
+  for (int i = 0; i < jobs; ++i)
+    fetch_request_free(&slots[i].req);
+  free(slots);
+
+  result->requests = count;
+  result->errors = error_count;
+  result->latencies = samples;
+  samples = NULL;
+}
+
+static void run_batch(BenchResult *result, int count, int jobs, int exists) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    perror("pipe");
+    exit(1);
+  }
+
+  pid_t writer = fork();
+  if (writer == 0) {
+    close(fds[0]);
+    FILE *in = fdopen(fds[1], "w");
+    for (int i = 0; i < count; ++i) {
+      char hash[MOCK_HASH_LEN + 1];
+      mock_hash(i, hash);
+      fprintf(in, "%s\n", hash);
+    }
+    fclose(in);
+    _exit(0);
+  }
+  close(fds[1]);
+
+  FILE *out = fopen("/dev/null", "w");
+  char *urls[] = {cache_url};
+  BatchOptions opts = {OUTPUT_JSON, jobs, exists};
+
+  double start = now_seconds();
+  result->errors = batch_run(fds[0], out, urls, 1, &opts);
+  result->seconds = now_seconds() - start;
+  result->requests = count;
+
+  fclose(out);
+  close(fds[0]);
+  waitpid(writer, NULL, 0);
+}
+
+static void run_closure(BenchResult *result, int paths, int jobs) {
+  char root[MOCK_HASH_LEN + 1];
+  FILE *out = fopen("/dev/null", "w");
+  char *urls[] = {cache_url};
+  BatchOptions opts = {OUTPUT_JSON, jobs, 0};
+
+  mock_hash(0, root);
+  double start = now_seconds();
+  result->errors = closure_run(root, out, urls, 1, &opts);
+  result->seconds = now_seconds() - start;
+  result->requests = paths;
+  fclose(out);
+}
+
+static void run_local_closure(BenchResult *result, int paths, int jobs) {
+  char root[MOCK_HASH_LEN + 1];
+  FILE *out = fopen("/dev/null", "w");
+  char *urls[] = {cache_url};
+  BatchOptions opts = {OUTPUT_JSON, jobs, 0};
+
+  mock_hash(0, root);
+  double start = now_seconds();
+  if (localstore_open(store_db) == 0) {
+    result->errors = closure_run_local(root, out, urls, 1, &opts);
+    localstore_close();
+  } else {
+    result->errors = paths;
+  }
+  result->seconds = now_seconds() - start;
+  result->requests = paths;
+  fclose(out);
+}
+
+static int make_store_db(const MockOptions *mock) {
+  sqlite3 *db;
+  sqlite3_stmt *path_stmt, *ref_stmt;
+
+  snprintf(store_db, sizeof(store_db), "/tmp/narnia-bench-XXXXXX");
+  int fd = mkstemp(store_db);
+  if (fd < 0)
+    return -1;
+  close(fd);
+
+  if (sqlite3_open(store_db, &db) != SQLITE_OK ||
+      sqlite3_exec(db,
+                   "CREATE TABLE ValidPaths (id INTEGER PRIMARY KEY, path "
+                   "TEXT UNIQUE NOT NULL, narSize INTEGER);"
+                   "CREATE TABLE Refs (referrer INTEGER NOT NULL, reference "
+                   "INTEGER NOT NULL, PRIMARY KEY (referrer, reference));"
+                   "CREATE INDEX IndexReferrer ON Refs(referrer);"
+                   "BEGIN;",
+                   NULL, NULL, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO ValidPaths VALUES (?, ?, ?)", -1,
+                         &path_stmt, NULL) != SQLITE_OK ||
+      sqlite3_prepare_v2(db, "INSERT INTO Refs VALUES (?, ?)", -1, &ref_stmt,
+                         NULL) != SQLITE_OK) {
+    sqlite3_close(db);
+    unlink(store_db);
+    return -1;
+  }
+
+  for (int i = 0; i < mock->paths; ++i) {
+    char hash[MOCK_HASH_LEN + 1];
+    char path[128];
+    mock_hash(i, hash);
+    snprintf(path, sizeof(path), "/nix/store/%s-bench-path-%d", hash, i);
+    sqlite3_bind_int(path_stmt, 1, i + 1);
+    sqlite3_bind_text(path_stmt, 2, path, -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(path_stmt, 3, 4096);
+    sqlite3_step(path_stmt);
+    sqlite3_reset(path_stmt);
+
+    for (int j = i * mock->fanout + 1;
+         j <= i * mock->fanout + mock->fanout && j < mock->paths; ++j) {
+      sqlite3_bind_int(ref_stmt, 1, i + 1);
+      sqlite3_bind_int(ref_stmt, 2, j + 1);
+      sqlite3_step(ref_stmt);
+      sqlite3_reset(ref_stmt);
+    }
+  }
+
+  sqlite3_finalize(path_stmt);
+  sqlite3_finalize(ref_stmt);
+  sqlite3_exec(db, "COMMIT", NULL, NULL, NULL);
+  sqlite3_close(db);
+  return 0;
+}
+
+static void run_nar(BenchResult *result, int paths, int jobs) {
+  FILE *out = fopen("/dev/null", "w");
+  char *urls[] = {cache_url};
+  BatchOptions opts = {OUTPUT_JSON, jobs, 0};
+  int count = paths < BENCH_NARS ? paths : BENCH_NARS;
+
+  for (int i = 0; i < count; ++i) {
+    char hash[MOCK_HASH_LEN + 1];
+    NarStats stats = {0};
+
+    mock_hash(i, hash);
+    if (narfetch_run(hash, out, urls, 1, &opts, NULL, &stats) != 0)
+      result->errors++;
+    result->seconds += stats.seconds;
+    result->bytes += stats.file_bytes;
+  }
+  result->requests = count;
+  fclose(out);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void print_header(void) {
+  printf("%-10s %-9s %8s %7s %8s %8s %11s %8s %10s %10s\n", "scenario",
+         "protocol", "requests", "errors", "p50 ms", "p99 ms", "lookups/s",
+         "MB/s", "allocs/req", "peak RSS");
+}
+
+static void print_result(const BenchResult *r) {
+  char p50[16] = "-", p99[16] = "-", allocs[16] = "-", rate[16] = "-";
+
+  if (r->latencies && r->requests > 0) {
+    qsort(r->latencies, r->requests, sizeof(double), compare_double);
+    snprintf(p50, sizeof(p50), "%.2f", r->latencies[r->requests / 2]);
+    snprintf(p99, sizeof(p99), "%.2f",
+             r->latencies[(r->requests * 99) / 100 < r->requests
+                              ? (r->requests * 99) / 100
+                              : r->requests - 1]);
+  }
+
+  if (r->allocs >= 0 && r->requests > 0)
+    snprintf(allocs, sizeof(allocs), "%.1f", (double)r->allocs / r->requests);
+  if (r->bytes > 0 && r->seconds > 0)
+    snprintf(rate, sizeof(rate), "%.1f", r->bytes / r->seconds / 1e6);
+
+  printf("%-10s %-9s %8d %7d %8s %8s %11.1f %8s %10s %6.1f MiB\n",
+         r->scenario, r->protocol, r->requests, r->errors, p50, p99,
+         r->seconds > 0 ? r->requests / r->seconds : 0.0, rate, allocs,
+         r->peak_kib / 1024.0);
+  fflush(stdout);
+}
+
+static void run_scenario(const char *scenario, const Protocol *proto,
+                         const BenchOptions *bench, const MockOptions *mock) {
+  BenchResult result = {scenario, proto->name, 0, 0, 0, NULL, 0, 0, 0};
+
+  fflush(stdout);
+  pid_t child = fork();
+  if (child != 0) {
+    if (child > 0)
+      waitpid(child, NULL, 0);
+    return;
+  }
+
+  fetch_init();
+  fetch_set_http_version(proto->version);
+  fetch_set_hedging(bench->hedge);
+  long allocs = alloc_count();
+
+  if (strcmp(scenario, "single") == 0)
+    run_lookups(&result, bench->count, 1);
+  else if (strcmp(scenario, "parallel") == 0)
+    run_lookups(&result, bench->count, bench->jobs);
+  else if (strcmp(scenario, "batch") == 0)
+    run_batch(&result, bench->count, bench->jobs, 0);
+  else if (strcmp(scenario, "exists") == 0)
+    run_batch(&result, bench->count, bench->jobs, 1);
+  else if (strcmp(scenario, "closure") == 0)
+    run_closure(&result, mock->paths, bench->jobs);
+  else if (strcmp(scenario, "nar") == 0)
+    run_nar(&result, bench->count, bench->jobs);
+  else
+    run_local_closure(&result, mock->paths, bench->jobs);
+
+  result.peak_kib = peak_rss_kib();
+  result.allocs = allocs < 0 ? -1 : alloc_count() - allocs;
+  fetch_cleanup();
+  print_result(&result);
+  free(result.latencies);
+  _exit(0);
+}
+
+static void print_usage(const char *name) {
+  printf("Usage: %s [options]\n\n", name);
+  printf("Runs narnia's fetch and parse pipeline against a local mock binary "
+         "cache.\n\n");
+  printf("Options:\n");
+  printf("  --latency MS     Server latency per response (default: 5)\n");
+  printf("  --jitter MS      Random extra latency up to MS (default: 0)\n");
+  printf("  --errors RATE    Fraction of responses that fail with 500 "
+         "(default: 0)\n");
+  printf("  --size BYTES     Minimum narinfo body size (default: 0)\n");
+  printf("  --count N        Lookups per scenario (default: 1000)\n");
+  printf("  --jobs N         Concurrent lookups (default: 64)\n");
+  printf("  --paths N        Store paths in the mock cache (default: "
+         "10000)\n");
+  printf("  --fanout N       References per path (default: 3)\n");
+  printf("  --nar-size BYTES Uncompressed size of each mock NAR (default: "
+         "4194304)\n");
+  printf("  --hedge          Hedge requests that pass the observed p95 "
+         "latency\n");
+  printf("  -h, --help       Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  MockOptions mock = {0, 5, 0, 0.0, 0, 10000, 3, 4 << 20};
+  BenchOptions bench = {1000, 64, 0};
+
+  static struct option long_options[] = {
+      {"latency", required_argument, 0, 'l'},
+      {"jitter", required_argument, 0, 'J'},
+      {"errors", required_argument, 0, 'e'},
+      {"size", required_argument, 0, 's'},
+      {"count", required_argument, 0, 'n'},
+      {"jobs", required_argument, 0, 'j'},
+      {"paths", required_argument, 0, 'p'},
+      {"fanout", required_argument, 0, 'F'},
+      {"nar-size", required_argument, 0, 'S'},
+      {"hedge", no_argument, 0, 'H'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "j:n:h", long_options, NULL)) != -1) {
+    switch (opt) {
+    case 'l':
+      mock.latency_ms = atoi(optarg);
+      break;
+    case 'J':
+      mock.jitter_ms = atoi(optarg);
+      break;
+    case 'e':
+      mock.error_rate = atof(optarg);
+      break;
+    case 's':
+      mock.body_size = atoi(optarg);
+      break;
+    case 'n':
+      bench.count = atoi(optarg);
+      break;
+    case 'j':
+      bench.jobs = atoi(optarg);
+      break;
+    case 'p':
+      mock.paths = atoi(optarg);
+      break;
+    case 'F':
+      mock.fanout = atoi(optarg);
+      break;
+    case 'S':
+      mock.nar_size = atoi(optarg);
+      break;
+    case 'H':
+      bench.hedge = 1;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return 0;
+    default:
+      print_usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (bench.count < 1 || bench.jobs < 1 || mock.paths < 1 || mock.fanout < 0 ||
+      mock.nar_size < 1) {
+    fprintf(stderr, "bench: counts must be positive\n");
+    return 1;
+  }
+  if (bench.count > mock.paths)
+    mock.paths = bench.count;
+
+  int lfd = mock_listen(&mock);
+  if (lfd < 0) {
+    perror("mock_listen");
+    return 1;
+  }
+
+  pid_t server = fork();
+  if (server == 0) {
+    mock_serve(lfd, &mock);
+    _exit(0);
+  }
+  close(lfd);
+  snprintf(cache_url, sizeof(cache_url), "http://127.0.0.1:%d", mock.port);
+
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+
+  Protocol protocols[] = {
+      {"http/1.1", CURL_HTTP_VERSION_1_1},
+#ifdef HAVE_NGHTTP2
+      {"h2", CURL_HTTP_VERSION_2_PRIOR_KNOWLEDGE},
+#endif
+  };
+  const char *scenarios[] = {"single", "parallel", "batch", "exists",
+                             "closure", "nar",      "local"};
+  size_t scenario_count = sizeof(scenarios) / sizeof(scenarios[0]);
+  if (make_store_db(&mock) != 0) {
+    fprintf(stderr, "bench: could not create the local store database\n");
+    scenario_count--;
+  }
+
+  printf("mock cache %s: latency %d ms, jitter %d ms, errors %.1f%%, "
+         "%d paths, fanout %d\n\n",
+         cache_url, mock.latency_ms, mock.jitter_ms, mock.error_rate * 100,
+         mock.paths, mock.fanout);
+  print_header();
+
+  for (size_t p = 0; p < sizeof(protocols) / sizeof(protocols[0]); ++p) {
+    for (size_t s = 0; s < scenario_count; ++s)
+      run_scenario(scenarios[s], &protocols[p], &bench, &mock);
+  }
+
+  curl_global_cleanup();
+  if (scenario_count == sizeof(scenarios) / sizeof(scenarios[0]))
+    unlink(store_db);
+  kill(server, SIGTERM);
+  waitpid(server, NULL, 0);
+  return 0;
+}
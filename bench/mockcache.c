@@ -0,0 +1,701 @@
+#include "mockcache.h"
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <openssl/evp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_NGHTTP2
+#include <nghttp2/nghttp2.h>
+#endif
+
+#define MAX_CONNS 1024
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+static const char base32[] = "0123456789abcdfghijklmnpqrsvwxyz";
+static const char base64[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+typedef struct Response {
+  long long ready_at;
+  int status;
+  int head;
+  int shared;
+  char *body;
+  size_t len;
+  size_t sent;
+  int32_t stream_id;
+  struct Response *next;
+} Response;
+
+typedef struct {
+  int fd;
+  int http2;
+  char *in;
+  size_t in_len;
+  size_t in_cap;
+  char *out;
+  size_t out_len;
+  size_t out_cap;
+  size_t out_off;
+  Response *pending_head;
+  Response *pending_tail;
+  int closing;
+#ifdef HAVE_NGHTTP2
+  nghttp2_session *session;
+#endif
+} Conn;
+
+static const MockOptions *mock = NULL;
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+static char *nar_body = NULL;
+static size_t nar_len = 0;
+static char nar_hash[53];
+static char file_hash[53];
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t splitmix64(uint64_t *s) {
+  uint64_t z = (*s += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+static double random_unit(void) {
+  return (splitmix64(&rng_state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+void mock_hash(int index, char out[MOCK_HASH_LEN + 1]) {
+  uint64_t seed = (uint64_t)index;
+
+  for (int k = 0; k < 7; ++k)
+    out[k] = base32[((uint64_t)index >> (5 * (6 - k))) & 31];
+  for (int k = 7; k < MOCK_HASH_LEN; ++k)
+    out[k] = base32[splitmix64(&seed) >> 59];
+  out[MOCK_HASH_LEN] = '\0';
+}
+
+int mock_index(const char *hash) {
+  char expect[MOCK_HASH_LEN + 1];
+  int index = 0;
+
+  for (int k = 0; k < 7; ++k) {
+    const char *c = strchr(base32, hash[k]);
+    if (!hash[k] || !c)
+      return -1;
+    index = index * 32 + (c - base32);
+  }
+
+  mock_hash(index, expect);
+  if (strncmp(expect, hash, MOCK_HASH_LEN) != 0)
+    return -1;
+  return index;
+}
+
+static void sha256_base32(const void *data, size_t len, char out[53]) {
+  unsigned char digest[EVP_MAX_MD_SIZE];
+  unsigned int n = 0;
+
+  EVP_Digest(data, len, digest, &n, EVP_sha256(), NULL);
+  for (int i = 51; i >= 0; --i) {
+    int b = i * 5, j = b / 8, k = b % 8;
+    unsigned c = digest[j] >> k;
+    if (j + 1 < 32)
+      c |= digest[j + 1] << (8 - k);
+    out[51 - i] = base32[c & 31];
+  }
+  out[52] = '\0';
+}
+
+static void make_nar(void) {
+  size_t size = mock->nar_size > 0 ? (size_t)mock->nar_size : 1;
+  uint64_t seed = 42;
+  char *nar = malloc(size);
+  size_t cap = lzma_stream_buffer_bound(size);
+
+  nar_body = malloc(cap);
+  if (!nar || !nar_body) {
+    free(nar);
+    return;
+  }
+  for (size_t i = 0; i < size; ++i)
+    nar[i] = base32[splitmix64(&seed) >> 59];
+
+  nar_len = 0;
+  if (lzma_easy_buffer_encode(0, LZMA_CHECK_CRC64, NULL, (uint8_t *)nar, size,
+                              (uint8_t *)nar_body, &nar_len,
+                              cap) != LZMA_OK) {
+    free(nar_body);
+    nar_body = NULL;
+    nar_len = 0;
+  }
+  sha256_base32(nar, size, nar_hash);
+  sha256_base32(nar_body, nar_len, file_hash);
+  free(nar);
+}
+
+static void random_chars(FILE *f, const char *alphabet, int n, uint64_t seed) {
+  size_t size = strlen(alphabet);
+  for (int i = 0; i < n; ++i)
+    fputc(alphabet[splitmix64(&seed) % size], f);
+}
+
+static char *narinfo_body(int index, size_t *len) {
+  char hash[MOCK_HASH_LEN + 1];
+  char *buf = NULL;
+  FILE *f = open_memstream(&buf, len);
+  if (!f)
+    return NULL;
+
+  mock_hash(index, hash);
+  fprintf(f, "StorePath: /nix/store/%s-bench-path-%d\n", hash, index);
+  fprintf(f, "URL: nar/%s.nar.xz\n", hash);
+  fprintf(f, "Compression: xz\n");
+  fprintf(f, "FileHash: sha256:%s\n", file_hash);
+  fprintf(f, "FileSize: %zu\n", nar_len);
+  fprintf(f, "NarHash: sha256:%s\n", nar_hash);
+  fprintf(f, "NarSize: %d\n", mock->nar_size);
+
+  fprintf(f, "References:");
+  for (int j = index * mock->fanout + 1;
+       j <= index * mock->fanout + mock->fanout && j < mock->paths; ++j) {
+    char ref[MOCK_HASH_LEN + 1];
+    mock_hash(j, ref);
+    fprintf(f, " %s-bench-path-%d", ref, j);
+  }
+
+  fprintf(f, "\nDeriver: %s-bench-path-%d.drv\n", hash, index);
+  fprintf(f, "Sig: bench.example.org-1:");
+  random_chars(f, base64, 86, index * 3 + 3);
+  fprintf(f, "==\n");
+
+  fflush(f);
+  while ((long)*len < mock->body_size) {
+    long pad = mock->body_size - (long)*len - 10;
+    fprintf(f, "Padding: ");
+    random_chars(f, base32, pad > 0 ? (pad < 120 ? pad : 120) : 1, *len);
+    fputc('\n', f);
+    fflush(f);
+  }
+
+  fclose(f);
+  return buf;
+}
+
+static Response *make_response(const char *method, const char *path) {
+  Response *res = calloc(1, sizeof(*res));
+  if (!res)
+    return NULL;
+
+  res->head = strcmp(method, "HEAD") == 0;
+  res->ready_at = now_ms() + mock->latency_ms;
+  if (mock->jitter_ms > 0)
+    res->ready_at += (long long)(random_unit() * mock->jitter_ms);
+
+  if (mock->error_rate > 0 && random_unit() < mock->error_rate) {
+    res->status = 500;
+    res->body = strdup("internal error\n");
+    res->len = strlen(res->body);
+    return res;
+  }
+
+  size_t path_len = strlen(path);
+  if (strcmp(path, "/nix-cache-info") == 0) {
+    res->status = 200;
+    res->body =
+        strdup("StoreDir: /nix/store\nWantMassQuery: 1\nPriority: 30\n");
+    res->len = strlen(res->body);
+  } else if (path_len == 1 + MOCK_HASH_LEN + 8 &&
+             strcmp(path + 1 + MOCK_HASH_LEN, ".narinfo") == 0) {
+    int index = mock_index(path + 1);
+    if (index >= 0 && index < mock->paths) {
+      res->status = 200;
+      res->body = narinfo_body(index, &res->len);
+    }
+  } else if (nar_body && path_len == 5 + MOCK_HASH_LEN + 7 &&
+             strncmp(path, "/nar/", 5) == 0 &&
+             strcmp(path + 5 + MOCK_HASH_LEN, ".nar.xz") == 0) {
+    int index = mock_index(path + 5);
+    if (index >= 0 && index < mock->paths) {
+      res->status = 200;
+      res->shared = 1;
+      res->body = nar_body;
+      res->len = nar_len;
+    }
+  }
+
+  if (!res->body) {
+    res->status = 404;
+    res->body = strdup("404 not found\n");
+    res->len = strlen(res->body);
+  }
+  return res;
+}
+
+static void free_response(Response *res) {
+  if (!res)
+    return;
+  if (!res->shared)
+    free(res->body);
+  free(res);
+}
+
+static void conn_write(Conn *c, const void *data, size_t len) {
+  if (c->out_len + len > c->out_cap) {
+    size_t cap = c->out_cap ? c->out_cap : 16384;
+    while (cap < c->out_len + len)
+      cap *= 2;
+    char *p = realloc(c->out, cap);
+    if (!p) {
+      c->closing = 1;
+      return;
+    }
+    c->out = p;
+    c->out_cap = cap;
+  }
+  memcpy(c->out + c->out_len, data, len);
+  c->out_len += len;
+}
+
+static void conn_enqueue(Conn *c, Response *res) {
+  if (!res)
+    return;
+  res->next = NULL;
+  if (c->pending_tail)
+    c->pending_tail->next = res;
+  else
+    c->pending_head = res;
+  c->pending_tail = res;
+}
+
+static const char *status_text(int status) {
+  switch (status) {
+  case 200:
+    return "OK";
+  case 404:
+    return "Not Found";
+  default:
+    return "Internal Server Error";
+  }
+}
+
+#ifdef HAVE_NGHTTP2
+typedef struct {
+  char method[8];
+  char path[256];
+  Response *res;
+} Stream;
+
+static ssize_t h2_send(nghttp2_session *session, const uint8_t *data,
+                       size_t length, int flags, void *user_data) {
+  (void)session;
+  (void)flags;
+  conn_write(user_data, data, length);
+  return length;
+}
+
+static int h2_on_begin_headers(nghttp2_session *session,
+                               const nghttp2_frame *frame, void *user_data) {
+  (void)user_data;
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+    return 0;
+
+  Stream *stream = calloc(1, sizeof(*stream));
+  if (!stream)
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  nghttp2_session_set_stream_user_data(session, frame->hd.stream_id, stream);
+  return 0;
+}
+
+static int h2_on_header(nghttp2_session *session, const nghttp2_frame *frame,
+                        const uint8_t *name, size_t namelen,
+                        const uint8_t *value, size_t valuelen, uint8_t flags,
+                        void *user_data) {
+  (void)flags;
+  (void)user_data;
+  if (frame->hd.type != NGHTTP2_HEADERS ||
+      frame->headers.cat != NGHTTP2_HCAT_REQUEST)
+    return 0;
+
+  Stream *stream =
+      nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!stream)
+    return 0;
+
+  if (namelen == 5 && memcmp(name, ":path", 5) == 0 &&
+      valuelen < sizeof(stream->path)) {
+    memcpy(stream->path, value, valuelen);
+    stream->path[valuelen] = '\0';
+  } else if (namelen == 7 && memcmp(name, ":method", 7) == 0 &&
+             valuelen < sizeof(stream->method)) {
+    memcpy(stream->method, value, valuelen);
+    stream->method[valuelen] = '\0';
+  }
+  return 0;
+}
+
+static int h2_on_frame_recv(nghttp2_session *session,
+                            const nghttp2_frame *frame, void *user_data) {
+  if ((frame->hd.type != NGHTTP2_HEADERS && frame->hd.type != NGHTTP2_DATA) ||
+      !(frame->hd.flags & NGHTTP2_FLAG_END_STREAM))
+    return 0;
+
+  Stream *stream =
+      nghttp2_session_get_stream_user_data(session, frame->hd.stream_id);
+  if (!stream || stream->res)
+    return 0;
+
+  Response *res = make_response(stream->method, stream->path);
+  if (!res)
+    return NGHTTP2_ERR_CALLBACK_FAILURE;
+  res->stream_id = frame->hd.stream_id;
+  stream->res = res;
+  conn_enqueue(user_data, res);
+  return 0;
+}
+
+static int h2_on_stream_close(nghttp2_session *session, int32_t stream_id,
+                              uint32_t error_code, void *user_data) {
+  (void)error_code;
+  Conn *c = user_data;
+  Stream *stream = nghttp2_session_get_stream_user_data(session, stream_id);
+  if (!stream)
+    return 0;
+
+  Response *prev = NULL;
+  for (Response *r = c->pending_head; r; prev = r, r = r->next) {
+    if (r != stream->res)
+      continue;
+    if (prev)
+      prev->next = r->next;
+    else
+      c->pending_head = r->next;
+    if (c->pending_tail == r)
+      c->pending_tail = prev;
+    break;
+  }
+
+  free_response(stream->res);
+  free(stream);
+  nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+  return 0;
+}
+
+static ssize_t h2_read_body(nghttp2_session *session, int32_t stream_id,
+                            uint8_t *buf, size_t length, uint32_t *data_flags,
+                            nghttp2_data_source *source, void *user_data) {
+  (void)session;
+  (void)stream_id;
+  (void)user_data;
+  Response *res = source->ptr;
+  size_t n = res->len - res->sent;
+  if (n > length)
+    n = length;
+  memcpy(buf, res->body + res->sent, n);
+  res->sent += n;
+  if (res->sent == res->len)
+    *data_flags |= NGHTTP2_DATA_FLAG_EOF;
+  return n;
+}
+
+static int h2_start(Conn *c) {
+  nghttp2_session_callbacks *cbs;
+  if (nghttp2_session_callbacks_new(&cbs) != 0)
+    return -1;
+
+  nghttp2_session_callbacks_set_send_callback(cbs, h2_send);
+  nghttp2_session_callbacks_set_on_begin_headers_callback(cbs,
+                                                          h2_on_begin_headers);
+  nghttp2_session_callbacks_set_on_header_callback(cbs, h2_on_header);
+  nghttp2_session_callbacks_set_on_frame_recv_callback(cbs, h2_on_frame_recv);
+  nghttp2_session_callbacks_set_on_stream_close_callback(cbs,
+                                                         h2_on_stream_close);
+
+  int rv = nghttp2_session_server_new(&c->session, cbs, c);
+  nghttp2_session_callbacks_del(cbs);
+  if (rv != 0)
+    return -1;
+
+  nghttp2_settings_entry iv[] = {
+      {NGHTTP2_SETTINGS_MAX_CONCURRENT_STREAMS, 1000}};
+  nghttp2_submit_settings(c->session, NGHTTP2_FLAG_NONE, iv, 1);
+  return 0;
+}
+
+static void h2_submit(Conn *c, Response *res) {
+  char status[4];
+  char length[24];
+  snprintf(status, sizeof(status), "%d", res->status);
+  snprintf(length, sizeof(length), "%zu", res->len);
+
+  nghttp2_nv hdrs[] = {
+      {(uint8_t *)":status", (uint8_t *)status, 7, strlen(status),
+       NGHTTP2_NV_FLAG_NONE},
+      {(uint8_t *)"content-length", (uint8_t *)length, 14, strlen(length),
+       NGHTTP2_NV_FLAG_NONE},
+  };
+
+  if (res->head) {
+    nghttp2_submit_response(c->session, res->stream_id, hdrs, 2, NULL);
+  } else {
+    nghttp2_data_provider prd;
+    prd.source.ptr = res;
+    prd.read_callback = h2_read_body;
+    nghttp2_submit_response(c->session, res->stream_id, hdrs, 2, &prd);
+  }
+}
+#endif
+
+static void h1_process(Conn *c) {
+  while (c->in_len > 0) {
+    char *end = strstr(c->in, "\r\n\r\n");
+    if (!end)
+      return;
+
+    char method[8] = {0};
+    char path[512] = {0};
+    *end = '\0';
+    if (sscanf(c->in, "%7s %511s", method, path) != 2) {
+      c->closing = 1;
+      return;
+    }
+    conn_enqueue(c, make_response(method, path));
+
+    size_t used = end + 4 - c->in;
+    memmove(c->in, c->in + used, c->in_len - used);
+    c->in_len -= used;
+    c->in[c->in_len] = '\0';
+  }
+}
+
+static void conn_flush_ready(Conn *c, long long now) {
+  if (c->http2 == 1) {
+#ifdef HAVE_NGHTTP2
+    for (Response *r = c->pending_head; r; r = r->next) {
+      if (r->ready_at <= now && r->ready_at >= 0) {
+        h2_submit(c, r);
+        r->ready_at = -1;
+      }
+    }
+    nghttp2_session_send(c->session);
+#endif
+    return;
+  }
+
+  while (c->pending_head && c->pending_head->ready_at <= now) {
+    Response *r = c->pending_head;
+    char hdr[256];
+    int n = snprintf(hdr, sizeof(hdr),
+                     "HTTP/1.1 %d %s\r\nContent-Length: %zu\r\n"
+                     "Content-Type: text/x-nix-narinfo\r\n\r\n",
+                     r->status, status_text(r->status), r->len);
+    conn_write(c, hdr, n);
+    if (!r->head)
+      conn_write(c, r->body, r->len);
+
+    c->pending_head = r->next;
+    if (!c->pending_head)
+      c->pending_tail = NULL;
+    free_response(r);
+  }
+}
+
+static long long conn_next_ready(const Conn *c) {
+  long long next = -1;
+  for (const Response *r = c->pending_head; r; r = r->next) {
+    if (r->ready_at >= 0 && (next < 0 || r->ready_at < next))
+      next = r->ready_at;
+    if (c->http2 != 1)
+      break;
+  }
+  return next;
+}
+
+static int conn_read(Conn *c) {
+  if (c->in_cap - c->in_len < 4096) {
+    size_t cap = c->in_cap ? c->in_cap * 2 : 16384;
+    char *p = realloc(c->in, cap);
+    if (!p)
+      return -1;
+    c->in = p;
+    c->in_cap = cap;
+  }
+
+  ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len - 1);
+  if (n <= 0)
+    return -1;
+  c->in_len += n;
+  c->in[c->in_len] = '\0';
+
+  if (c->http2 < 0) {
+    size_t cmp = c->in_len < H2_PREFACE_LEN ? c->in_len : H2_PREFACE_LEN;
+    if (memcmp(c->in, H2_PREFACE, cmp) != 0)
+      c->http2 = 0;
+    else if (c->in_len >= H2_PREFACE_LEN)
+      c->http2 = 1;
+    else
+      return 0;
+
+#ifdef HAVE_NGHTTP2
+    if (c->http2 == 1 && h2_start(c) != 0)
+      return -1;
+#else
+    if (c->http2 == 1)
+      return -1;
+#endif
+  }
+
+  if (c->http2 == 0) {
+    h1_process(c);
+    return 0;
+  }
+
+#ifdef HAVE_NGHTTP2
+  ssize_t used = nghttp2_session_mem_recv(c->session, (uint8_t *)c->in,
+                                          c->in_len);
+  if (used < 0)
+    return -1;
+  c->in_len = 0;
+  nghttp2_session_send(c->session);
+#endif
+  return 0;
+}
+
+static void conn_free(Conn *c) {
+#ifdef HAVE_NGHTTP2
+  if (c->session)
+    nghttp2_session_del(c->session);
+#endif
+  if (c->http2 != 1) {
+    while (c->pending_head) {
+      Response *r = c->pending_head;
+      c->pending_head = r->next;
+      free_response(r);
+    }
+  }
+  close(c->fd);
+  free(c->in);
+  free(c->out);
+  free(c);
+}
+
+int mock_listen(MockOptions *opts) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0)
+    return -1;
+
+  int one = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  addr.sin_port = htons(opts->port);
+
+  socklen_t len = sizeof(addr);
+  if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 512) != 0 ||
+      getsockname(fd, (struct sockaddr *)&addr, &len) != 0) {
+    close(fd);
+    return -1;
+  }
+
+  opts->port = ntohs(addr.sin_port);
+  return fd;
+}
+
+void mock_serve(int lfd, const MockOptions *opts) {
+  static Conn *conns[MAX_CONNS];
+  static struct pollfd fds[MAX_CONNS + 1];
+  int nconns = 0;
+
+  mock = opts;
+  make_nar();
+  signal(SIGPIPE, SIG_IGN);
+  fcntl(lfd, F_SETFL, fcntl(lfd, F_GETFL) | O_NONBLOCK);
+
+  while (1) {
+    long long now = now_ms();
+    long long next = -1;
+
+    for (int i = 0; i < nconns; ++i) {
+      conn_flush_ready(conns[i], now);
+      long long ready = conn_next_ready(conns[i]);
+      if (ready >= 0 && (next < 0 || ready < next))
+        next = ready;
+    }
+
+    fds[0].fd = lfd;
+    fds[0].events = nconns < MAX_CONNS ? POLLIN : 0;
+    for (int i = 0; i < nconns; ++i) {
+      Conn *c = conns[i];
+      fds[i + 1].fd = c->fd;
+      fds[i + 1].events = POLLIN;
+      if (c->out_len > c->out_off)
+        fds[i + 1].events |= POLLOUT;
+    }
+
+    int timeout = next < 0 ? -1 : (int)(next > now ? next - now : 0);
+    if (poll(fds, nconns + 1, timeout) < 0)
+      continue;
+
+    for (int i = nconns - 1; i >= 0; --i) {
+      Conn *c = conns[i];
+      short rev = fds[i + 1].revents;
+
+      if (rev & (POLLIN | POLLHUP | POLLERR)) {
+        if (conn_read(c) != 0)
+          c->closing = 1;
+      }
+
+      if (c->out_len > c->out_off) {
+        ssize_t n = write(c->fd, c->out + c->out_off, c->out_len - c->out_off);
+        if (n > 0)
+          c->out_off += n;
+        if (c->out_off == c->out_len)
+          c->out_off = c->out_len = 0;
+      }
+
+      if (c->closing) {
+        conn_free(c);
+        conns[i] = conns[--nconns];
+      }
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int cfd;
+      while (nconns < MAX_CONNS && (cfd = accept(lfd, NULL, NULL)) >= 0) {
+        Conn *c = calloc(1, sizeof(*c));
+        if (!c) {
+          close(cfd);
+          continue;
+        }
+        int one = 1;
+        setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(cfd, F_SETFL, fcntl(cfd, F_GETFL) | O_NONBLOCK);
+        c->fd = cfd;
+        c->http2 = -1;
+        conns[nconns++] = c;
+      }
+    }
+  }
+}
@@ -0,0 +1,22 @@
+#ifndef MOCKCACHE_H
+#define MOCKCACHE_H
+
+#define MOCK_HASH_LEN 32
+
+typedef struct {
+  int port;
+  int latency_ms;
+  int jitter_ms;
+  double error_rate;
+  int body_size;
+  int paths;
+  int fanout;
+  int nar_size;
+} MockOptions;
+
+int mock_listen(MockOptions *opts);
+void mock_serve(int fd, const MockOptions *opts);
+void mock_hash(int index, char out[MOCK_HASH_LEN + 1]);
+int mock_index(const char *hash);
+
+#endif
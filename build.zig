@@ -29,6 +29,81 @@ pub fn build(b: *std.Build) void {
         .flags = &[_][]const u8{ "-Wall", "-Wextra" },
     });
 
+    module.addCSourceFile(.{
+        .file = b.path("include/fetch.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/store.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/batch.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/narcache.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/narinfo.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/closure.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/cacheinfo.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/arena.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/pathindex.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/search.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/localstore.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/sigverify.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/narfetch.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/narlisting.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    module.addCSourceFile(.{
+        .file = b.path("include/serve.c"),
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
     const exe = b.addExecutable(.{
         .name = "narnia",
         .root_module = module,
@@ -36,6 +111,10 @@ pub fn build(b: *std.Build) void {
 
     exe.linkSystemLibrary("curl");
     exe.linkSystemLibrary("ncurses");
+    exe.linkSystemLibrary("sqlite3");
+    exe.linkSystemLibrary("crypto");
+    exe.linkSystemLibrary("lzma");
+    exe.linkSystemLibrary("bz2");
 
     const pkg_config_result = std.process.Child.run(.{
         .allocator = b.allocator,
@@ -57,6 +136,17 @@ pub fn build(b: *std.Build) void {
         exe.linkSystemLibrary("wayland-client");
     }
 
+    const zstd_result = std.process.Child.run(.{
+        .allocator = b.allocator,
+        .argv = &[_][]const u8{ "pkg-config", "--exists", "libzstd" },
+    }) catch null;
+    const have_zstd = zstd_result != null and zstd_result.?.term.Exited == 0;
+
+    if (have_zstd) {
+        module.addCMacro("HAVE_ZSTD", "1");
+        exe.linkSystemLibrary("zstd");
+    }
+
     b.installArtifact(exe);
 
     const run_cmd = b.addRunArtifact(exe);
@@ -68,4 +158,68 @@ pub fn build(b: *std.Build) void {
 
     const run_step = b.step("run", "Run the app");
     run_step.dependOn(&run_cmd.step);
+
+    const bench_module = b.createModule(.{
+        .target = target,
+        .optimize = .ReleaseFast,
+        .link_libc = true,
+    });
+
+    bench_module.addIncludePath(b.path("include"));
+    bench_module.addIncludePath(b.path("bench"));
+
+    bench_module.addCSourceFiles(.{
+        .files = &[_][]const u8{
+            "bench/bench.c",
+            "bench/mockcache.c",
+            "bench/alloccount.c",
+            "include/arena.c",
+            "include/fetch.c",
+            "include/store.c",
+            "include/pathindex.c",
+            "include/batch.c",
+            "include/narcache.c",
+            "include/narinfo.c",
+            "include/closure.c",
+            "include/localstore.c",
+            "include/sigverify.c",
+            "include/narfetch.c",
+        },
+        .flags = &[_][]const u8{ "-Wall", "-Wextra" },
+    });
+
+    const bench_exe = b.addExecutable(.{
+        .name = "narnia-bench",
+        .root_module = bench_module,
+    });
+
+    bench_exe.linkSystemLibrary("curl");
+    bench_exe.linkSystemLibrary("sqlite3");
+    bench_exe.linkSystemLibrary("crypto");
+    bench_exe.linkSystemLibrary("lzma");
+    bench_exe.linkSystemLibrary("bz2");
+
+    if (have_zstd) {
+        bench_module.addCMacro("HAVE_ZSTD", "1");
+        bench_exe.linkSystemLibrary("zstd");
+    }
+
+    const nghttp2_result = std.process.Child.run(.{
+        .allocator = b.allocator,
+        .argv = &[_][]const u8{ "pkg-config", "--exists", "libnghttp2" },
+    }) catch null;
+
+    if (nghttp2_result != null and nghttp2_result.?.term.Exited == 0) {
+        bench_module.addCMacro("HAVE_NGHTTP2", "1");
+        bench_exe.linkSystemLibrary("nghttp2");
+    }
+
+    const bench_cmd = b.addRunArtifact(bench_exe);
+
+    if (b.args) |args| {
+        bench_cmd.addArgs(args);
+    }
+
+    const bench_step = b.step("bench", "Run the benchmarks against a mock cache");
+    bench_step.dependOn(&bench_cmd.step);
 }
@@ -0,0 +1,122 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_RETAIN_MAX (32 * 1024)
+
+struct ArenaBlock {
+  ArenaBlock *prev;
+  size_t size;
+  size_t used;
+  size_t last;
+};
+
+static size_t align_up(size_t n) {
+  return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static unsigned char *block_data(ArenaBlock *block) {
+  return (unsigned char *)block + align_up(sizeof(ArenaBlock));
+}
+
+void arena_init(Arena *arena, size_t initial_size) {
+  arena->block = NULL;
+  arena->next_size =
+      initial_size > ARENA_MIN_BLOCK ? initial_size : ARENA_MIN_BLOCK;
+}
+
+static ArenaBlock *arena_grow(Arena *arena, size_t size) {
+  size_t cap = arena->next_size ? arena->next_size : ARENA_MIN_BLOCK;
+  if (cap < size)
+    cap = size;
+
+  ArenaBlock *block = malloc(align_up(sizeof(ArenaBlock)) + cap);
+  if (!block)
+    return NULL;
+  block->prev = arena->block;
+  block->size = cap;
+  block->used = 0;
+  block->last = 0;
+
+  arena->block = block;
+  arena->next_size = cap * 2;
+  return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+  ArenaBlock *block = arena->block;
+  size_t offset = block ? align_up(block->used) : 0;
+
+  if (!block || offset + size > block->size) {
+    block = arena_grow(arena, size);
+    if (!block)
+      return NULL;
+    offset = 0;
+  }
+
+  block->last = offset;
+  block->used = offset + size;
+  return block_data(block) + offset;
+}
+
+void *arena_resize(Arena *arena, void *ptr, size_t old_size, size_t new_size) {
+  ArenaBlock *block = arena->block;
+
+  if (ptr && block && (unsigned char *)ptr == block_data(block) + block->last &&
+      block->last + new_size <= block->size) {
+    block->used = block->last + new_size;
+    return ptr;
+  }
+
+  void *p = arena_alloc(arena, new_size);
+  if (p && ptr)
+    memcpy(p, ptr, old_size < new_size ? old_size : new_size);
+  return p;
+}
+
+char *arena_strndup(Arena *arena, const char *s, size_t len) {
+  char *p = arena_alloc(arena, len + 1);
+  if (!p)
+    return NULL;
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+void arena_free(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  while (block) {
+    ArenaBlock *prev = block->prev;
+    free(block);
+    block = prev;
+  }
+  arena->block = NULL;
+}
+
+void arena_reset(Arena *arena) {
+  ArenaBlock *block = arena->block;
+  if (!block)
+    return;
+
+  size_t total = 0;
+  for (ArenaBlock *b = block; b; b = b->prev)
+    total += b->size;
+
+  if (total > ARENA_RETAIN_MAX) {
+    arena_free(arena);
+    arena->next_size = ARENA_MIN_BLOCK;
+    return;
+  }
+
+  if (block->prev) {
+    arena_free(arena);
+    arena->next_size = total;
+    arena_grow(arena, total);
+    return;
+  }
+
+  block->used = 0;
+  block->last = 0;
+}
@@ -0,0 +1,20 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+typedef struct ArenaBlock ArenaBlock;
+
+typedef struct {
+  ArenaBlock *block;
+  size_t next_size;
+} Arena;
+
+void arena_init(Arena *arena, size_t initial_size);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_resize(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+char *arena_strndup(Arena *arena, const char *s, size_t len);
+void arena_reset(Arena *arena);
+void arena_free(Arena *arena);
+
+#endif
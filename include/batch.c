@@ -0,0 +1,640 @@
+#include "batch.h"
+#include "fetch.h"
+#include "narinfo.h"
+#include "sigverify.h"
+#include "store.h"
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define READ_BUF_SIZE 65536
+#define OVERLONG_ECHO 128
+
+typedef struct BatchEntry {
+  BatchSession *session;
+  char *input;
+  char *path;
+  char hash[HASH_LEN + 1];
+  const char *error;
+  int pending;
+  int found;
+  Arena arena;
+  struct BatchEntry *next_free;
+  struct BatchEntry *next_all;
+  FetchGroup group;
+  FetchRequest reqs[];
+} BatchEntry;
+
+typedef struct {
+  int fd;
+  char buf[READ_BUF_SIZE];
+  size_t start;
+  size_t len;
+  int eof;
+  int overlong;
+  int discard;
+} LineReader;
+
+typedef struct {
+  long present;
+  long missing;
+  long error;
+} ExistsCounts;
+
+struct BatchSession {
+  LineReader reader;
+  FILE *out;
+  char *const *urls;
+  int url_count;
+  OutputFormat format;
+  int jobs;
+  int inflight;
+  int missing;
+  int verify;
+  int exists;
+  int aborted;
+  ExistsCounts *exists_counts;
+  long exists_inputs;
+  long exists_everywhere;
+  long exists_nowhere;
+
+  Arena entry_slab;
+  size_t entry_size;
+  BatchEntry *free_entries;
+  BatchEntry *all_entries;
+};
+
+void json_write_string(FILE *out, const char *s, size_t len) {
+  fputc('"', out);
+  for (size_t i = 0; i < len; ++i) {
+    unsigned char c = s[i];
+    if (c == '"' || c == '\\') {
+      fputc('\\', out);
+      fputc(c, out);
+    } else if (c == '\n') {
+      fputs("\\n", out);
+    } else if (c == '\t') {
+      fputs("\\t", out);
+    } else if (c < 0x20) {
+      fprintf(out, "\\u%04x", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fputc('"', out);
+}
+
+static void json_write_cstr(FILE *out, const char *s) {
+  json_write_string(out, s, strlen(s));
+}
+
+static void tsv_write_field(FILE *out, const char *s, size_t len) {
+  for (size_t i = 0; i < len; ++i)
+    fputc(s[i] == '\t' || s[i] == '\n' ? ' ' : s[i], out);
+}
+
+static void json_write_view(FILE *out, const char *key, StrView v) {
+  if (!v.len)
+    return;
+  fprintf(out, ",\"%s\":", key);
+  json_write_string(out, v.ptr, v.len);
+}
+
+static void write_json_narinfo(FILE *out, const Narinfo *info) {
+  fputs(",\"narinfo\":{\"StorePath\":", out);
+  json_write_string(out, info->store_path.ptr, info->store_path.len);
+  json_write_view(out, "URL", info->url);
+  json_write_view(out, "Compression", info->compression);
+  json_write_view(out, "FileHash", info->file_hash);
+  fprintf(out, ",\"FileSize\":%llu", (unsigned long long)info->file_size);
+  json_write_view(out, "NarHash", info->nar_hash);
+  fprintf(out, ",\"NarSize\":%llu", (unsigned long long)info->nar_size);
+
+  fputs(",\"References\":[", out);
+  for (int i = 0; i < info->reference_count; ++i) {
+    if (i > 0)
+      fputc(',', out);
+    json_write_string(out, info->references[i].ptr, info->references[i].len);
+  }
+  fputc(']', out);
+
+  json_write_view(out, "Deriver", info->deriver);
+
+  if (info->sig_count > 0) {
+    fputs(",\"Sig\":[", out);
+    for (int i = 0; i < info->sig_count; ++i) {
+      if (i > 0)
+        fputc(',', out);
+      json_write_string(out, info->sigs[i].ptr, info->sigs[i].len);
+    }
+    fputc(']', out);
+  }
+
+  json_write_view(out, "CA", info->ca);
+  fputc('}', out);
+}
+
+static int has_timing(const FetchRequest *req) {
+  return req && !req->cached && req->timing.http_version != 0;
+}
+
+static void write_json_timing(FILE *out, const FetchTiming *t) {
+  fputs(",\"timing\":{\"http_version\":", out);
+  json_write_cstr(out, fetch_http_version_name(t->http_version));
+  fprintf(out,
+          ",\"namelookup_ms\":%.3f,\"connect_ms\":%.3f"
+          ",\"appconnect_ms\":%.3f,\"starttransfer_ms\":%.3f"
+          ",\"total_ms\":%.3f,\"bytes\":%lld}",
+          t->namelookup_ms, t->connect_ms, t->appconnect_ms,
+          t->starttransfer_ms, t->total_ms, (long long)t->bytes);
+}
+
+static const char *request_status(const FetchRequest *req) {
+  if (req->result == CURLE_OK)
+    return "hit";
+  if (req->http_code == 404 || req->http_code == 403)
+    return "miss";
+  return "error";
+}
+
+static const char *request_error(const FetchRequest *req) {
+  if (req->result == CURLE_OK || req->http_code == 404 ||
+      req->http_code == 403)
+    return "";
+  return req->errbuf[0] ? req->errbuf : curl_easy_strerror(req->result);
+}
+
+static void write_record(const BatchEntry *entry, int cache,
+                         const FetchRequest *req, SigStatus sig) {
+  const BatchSession *s = entry->session;
+  FILE *out = s->out;
+  const char *status = req ? request_status(req) : "unresolved";
+  const char *error = req           ? request_error(req)
+                      : entry->error ? entry->error
+                                     : "executable not found";
+  const char *cache_url = cache >= 0 ? s->urls[cache] : "";
+
+  Narinfo info;
+  int parsed = req && req->result == CURLE_OK &&
+               narinfo_parse(req->response.ptr, req->response.len, &info,
+                             req->arena) == 0;
+
+  if (s->format == OUTPUT_TSV) {
+    fprintf(out, "%s\t%s\t%s\t%s\t", entry->input, entry->hash, cache_url,
+            status);
+    if (parsed) {
+      tsv_write_field(out, info.store_path.ptr, info.store_path.len);
+      fputc('\t', out);
+      tsv_write_field(out, info.url.ptr, info.url.len);
+      fputc('\t', out);
+      tsv_write_field(out, info.compression.ptr, info.compression.len);
+      fprintf(out, "\t%llu\t%llu\t", (unsigned long long)info.file_size,
+              (unsigned long long)info.nar_size);
+    } else {
+      fputs("\t\t\t\t\t", out);
+    }
+    if (has_timing(req)) {
+      const FetchTiming *t = &req->timing;
+      fprintf(out, "%s\t%.3f\t%.3f\t%.3f\t%.3f\t%.3f\t%lld\t",
+              fetch_http_version_name(t->http_version), t->namelookup_ms,
+              t->connect_ms, t->appconnect_ms, t->starttransfer_ms,
+              t->total_ms, (long long)t->bytes);
+    } else {
+      fputs("\t\t\t\t\t\t\t", out);
+    }
+    if (sig != SIG_UNCHECKED)
+      fputs(sigverify_status_name(sig), out);
+    fputc('\t', out);
+    tsv_write_field(out, error, strlen(error));
+    fputc('\n', out);
+    if (parsed)
+      narinfo_free(&info);
+    return;
+  }
+
+  fputs("{\"input\":", out);
+  json_write_cstr(out, entry->input);
+  if (entry->hash[0]) {
+    fputs(",\"hash\":", out);
+    json_write_cstr(out, entry->hash);
+    fputs(",\"path\":", out);
+    json_write_cstr(out, entry->path);
+  }
+  if (cache >= 0) {
+    fputs(",\"cache\":", out);
+    json_write_cstr(out, cache_url);
+  }
+  fputs(",\"status\":", out);
+  json_write_cstr(out, status);
+  if (req)
+    fprintf(out, ",\"http_code\":%ld", req->http_code);
+  if (req && req->cached)
+    fputs(",\"cached\":true", out);
+  if (has_timing(req))
+    write_json_timing(out, &req->timing);
+  if (sig != SIG_UNCHECKED) {
+    fputs(",\"signature\":", out);
+    json_write_cstr(out, sigverify_status_name(sig));
+  }
+  if (error[0]) {
+    fputs(",\"error\":", out);
+    json_write_cstr(out, error);
+  }
+  if (parsed) {
+    write_json_narinfo(out, &info);
+    narinfo_free(&info);
+  }
+  fputs("}\n", out);
+}
+
+static char exists_mark(const FetchRequest *req) {
+  if (req->result == CURLE_OK)
+    return '+';
+  if (req->http_code == 404 || req->http_code == 403)
+    return '-';
+  return '?';
+}
+
+static void write_exists_row(const BatchEntry *entry) {
+  BatchSession *s = entry->session;
+  FILE *out = s->out;
+
+  s->exists_inputs++;
+  if (entry->hash[0] && entry->found == s->url_count)
+    s->exists_everywhere++;
+  if (!entry->found)
+    s->exists_nowhere++;
+
+  if (s->format == OUTPUT_TSV) {
+    fprintf(out, "%s\t", entry->input);
+    for (int i = 0; i < s->url_count; ++i)
+      fputc(entry->hash[0] ? exists_mark(&entry->reqs[i]) : '!', out);
+    fputc('\n', out);
+    return;
+  }
+
+  fputs("{\"input\":", out);
+  json_write_cstr(out, entry->input);
+  if (!entry->hash[0]) {
+    fputs(",\"status\":\"unresolved\"", out);
+    if (entry->error) {
+      fputs(",\"error\":", out);
+      json_write_cstr(out, entry->error);
+    }
+    fputs("}\n", out);
+    return;
+  }
+  fputs(",\"hash\":", out);
+  json_write_cstr(out, entry->hash);
+  fputs(",\"present\":[", out);
+  for (int i = 0; i < s->url_count; ++i) {
+    char mark = exists_mark(&entry->reqs[i]);
+    if (i > 0)
+      fputc(',', out);
+    fputs(mark == '+' ? "true" : mark == '-' ? "false" : "null", out);
+  }
+  fputs("]}\n", out);
+}
+
+static void write_exists_summary(const BatchSession *s) {
+  const ExistsCounts *counts = s->exists_counts;
+  FILE *out = s->out;
+
+  if (s->format == OUTPUT_TSV) {
+    for (int i = 0; i < s->url_count; ++i)
+      fprintf(out, "# %s\tpresent=%ld\tmissing=%ld\terror=%ld\n",
+              s->urls[i], counts[i].present, counts[i].missing,
+              counts[i].error);
+    fprintf(out, "# inputs=%ld\teverywhere=%ld\tnowhere=%ld\n",
+            s->exists_inputs, s->exists_everywhere, s->exists_nowhere);
+    return;
+  }
+
+  fprintf(out,
+          "{\"summary\":{\"inputs\":%ld,\"everywhere\":%ld,"
+          "\"nowhere\":%ld,\"caches\":[",
+          s->exists_inputs, s->exists_everywhere, s->exists_nowhere);
+  for (int i = 0; i < s->url_count; ++i) {
+    if (i > 0)
+      fputc(',', out);
+    fputs("{\"cache\":", out);
+    json_write_cstr(out, s->urls[i]);
+    fprintf(out, ",\"present\":%ld,\"missing\":%ld,\"error\":%ld}",
+            counts[i].present, counts[i].missing, counts[i].error);
+  }
+  fputs("]}}\n", out);
+}
+
+static void count_exists(BatchSession *s, int cache, const FetchRequest *req) {
+  char mark = exists_mark(req);
+  if (mark == '+')
+    s->exists_counts[cache].present++;
+  else if (mark == '-')
+    s->exists_counts[cache].missing++;
+  else
+    s->exists_counts[cache].error++;
+}
+
+static BatchEntry *entry_get(BatchSession *s) {
+  BatchEntry *entry = s->free_entries;
+
+  if (entry) {
+    s->free_entries = entry->next_free;
+  } else {
+    entry = arena_alloc(&s->entry_slab, s->entry_size);
+    if (!entry)
+      return NULL;
+    arena_init(&entry->arena, 0);
+    entry->next_all = s->all_entries;
+    s->all_entries = entry;
+  }
+
+  Arena arena = entry->arena;
+  BatchEntry *next_all = entry->next_all;
+  memset(entry, 0, s->entry_size);
+  entry->session = s;
+  entry->arena = arena;
+  entry->next_all = next_all;
+  return entry;
+}
+
+static void entry_put(BatchEntry *entry) {
+  BatchSession *s = entry->session;
+  arena_reset(&entry->arena);
+  entry->next_free = s->free_entries;
+  s->free_entries = entry;
+}
+
+static void entries_free(BatchSession *s) {
+  for (BatchEntry *entry = s->all_entries; entry; entry = entry->next_all)
+    arena_free(&entry->arena);
+  arena_free(&s->entry_slab);
+  s->free_entries = NULL;
+  s->all_entries = NULL;
+}
+
+static void batch_finish(FetchRequest *req, SigStatus sig) {
+  BatchEntry *entry = req->data;
+  BatchSession *s = entry->session;
+  int cache = req - entry->reqs;
+
+  if (req->result == CURLE_OK)
+    entry->found++;
+  if (s->exists)
+    count_exists(s, cache, req);
+  else if (!req->cancelled)
+    write_record(entry, cache, req, sig);
+
+  string_free(&req->response);
+  s->inflight--;
+
+  if (--entry->pending == 0) {
+    if (!entry->found)
+      s->missing++;
+    if (s->exists)
+      write_exists_row(entry);
+    entry_put(entry);
+  }
+}
+
+static void batch_verified(SigJob *job) {
+  batch_finish(job->data, job->status);
+}
+
+static void batch_done(FetchRequest *req) {
+  BatchEntry *entry = req->data;
+  Narinfo info;
+
+  if (!entry->session->verify || req->result != CURLE_OK || req->cancelled) {
+    batch_finish(req, SIG_UNCHECKED);
+    return;
+  }
+
+  SigJob *job = arena_alloc(&entry->arena, sizeof(*job));
+  if (!job ||
+      narinfo_parse(req->response.ptr, req->response.len, &info,
+                    req->arena) != 0) {
+    batch_finish(req, SIG_INVALID);
+    return;
+  }
+
+  int prepared = sigverify_prepare(job, &info, &entry->arena);
+  narinfo_free(&info);
+  if (prepared != 0) {
+    batch_finish(req, SIG_INVALID);
+    return;
+  }
+  job->on_done = batch_verified;
+  job->data = req;
+  sigverify_submit(job);
+}
+
+static void batch_submit(BatchSession *s, const char *input,
+                         const char *error) {
+  char path[PATH_MAX];
+  BatchEntry *entry = entry_get(s);
+  if (!entry)
+    return;
+
+  entry->input = arena_strndup(&entry->arena, input, strlen(input));
+  if (!entry->input) {
+    entry_put(entry);
+    return;
+  }
+
+  if (error || resolve_store_input(input, path, sizeof(path), entry->hash) !=
+                   RESOLVE_OK) {
+    entry->hash[0] = '\0';
+    entry->error = error;
+    if (s->exists)
+      write_exists_row(entry);
+    else
+      write_record(entry, -1, NULL, SIG_UNCHECKED);
+    s->missing++;
+    entry_put(entry);
+    return;
+  }
+
+  entry->path = arena_strndup(&entry->arena, path, strlen(path));
+  if (!entry->path) {
+    entry_put(entry);
+    return;
+  }
+
+  entry->pending = s->url_count;
+  fetch_group_init(&entry->group);
+  for (int i = 0; i < s->url_count; ++i) {
+    fetch_narinfo_init(&entry->reqs[i], s->urls[i], entry->hash);
+    entry->reqs[i].on_done = batch_done;
+    entry->reqs[i].data = entry;
+    entry->reqs[i].arena = &entry->arena;
+    entry->reqs[i].head = s->exists;
+  }
+
+  for (int i = 0; i < s->url_count; ++i) {
+    s->inflight++;
+    int rc = s->exists ? fetch_add(&entry->reqs[i])
+                       : fetch_group_add(&entry->group, &entry->reqs[i]);
+    if (rc != 0) {
+      entry->reqs[i].result = CURLE_FAILED_INIT;
+      batch_done(&entry->reqs[i]);
+    }
+  }
+}
+
+static ssize_t reader_fill(LineReader *r) {
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->len - r->start);
+    r->len -= r->start;
+    r->start = 0;
+  }
+  if (r->len == sizeof(r->buf))
+    return 0;
+
+  ssize_t n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return 0;
+  if (n <= 0) {
+    r->eof = 1;
+    return -1;
+  }
+  r->len += n;
+  return n;
+}
+
+static char *reader_next_line(LineReader *r) {
+  char *line = r->buf + r->start;
+  size_t avail = r->len - r->start;
+  char *nl = memchr(line, '\n', avail);
+
+  r->overlong = 0;
+  if (r->discard) {
+    r->start = nl ? (size_t)(nl - r->buf + 1) : r->len;
+    r->discard = !nl && !r->eof;
+    if (r->discard)
+      return NULL;
+    line = r->buf + r->start;
+    avail = r->len - r->start;
+    nl = memchr(line, '\n', avail);
+  }
+
+  if (!nl) {
+    if (avail == 0 || (!r->eof && avail < sizeof(r->buf)))
+      return NULL;
+    if (avail == sizeof(r->buf)) {
+      line[OVERLONG_ECHO] = '\0';
+      r->start = r->len;
+      r->overlong = 1;
+      r->discard = !r->eof;
+      return line;
+    }
+    nl = line + avail;
+  }
+
+  *nl = '\0';
+  r->start = nl - r->buf + 1;
+  if (r->start > r->len)
+    r->start = r->len;
+  return line;
+}
+
+static char *trim(char *s) {
+  while (*s == ' ' || *s == '\t')
+    s++;
+  size_t len = strlen(s);
+  while (len > 0 && (s[len - 1] == ' ' || s[len - 1] == '\t' ||
+                     s[len - 1] == '\r'))
+    s[--len] = '\0';
+  return s;
+}
+
+static int batch_has_room(const BatchSession *s) {
+  return s->inflight == 0 || s->inflight + s->url_count <= s->jobs;
+}
+
+BatchSession *batch_open(int fd, FILE *out, char *const urls[], int url_count,
+                         const BatchOptions *opts) {
+  BatchSession *s = calloc(1, sizeof(*s));
+  if (!s)
+    return NULL;
+
+  s->reader.fd = fd;
+  s->out = out;
+  s->urls = urls;
+  s->url_count = url_count;
+  s->format = opts->format;
+  s->jobs = opts->jobs > 0 ? opts->jobs : 64;
+  s->exists = opts->exists;
+  s->verify = !s->exists && sigverify_key_count() > 0;
+  if (s->exists) {
+    s->exists_counts = calloc(url_count, sizeof(*s->exists_counts));
+    if (!s->exists_counts) {
+      free(s);
+      return NULL;
+    }
+  }
+  s->entry_size = sizeof(BatchEntry) + url_count * sizeof(FetchRequest);
+  arena_init(&s->entry_slab, s->entry_size * (s->jobs / url_count + 1));
+  return s;
+}
+
+int batch_want_input(const BatchSession *s) {
+  return !s->reader.eof && batch_has_room(s);
+}
+
+ssize_t batch_read(BatchSession *s) { return reader_fill(&s->reader); }
+
+int batch_step(BatchSession *s) {
+  LineReader *r = &s->reader;
+  char *line;
+
+  while (batch_has_room(s) && (line = reader_next_line(r))) {
+    line = trim(line);
+    if (r->overlong)
+      batch_submit(s, line, "input line too long");
+    else if (*line && *line != '#')
+      batch_submit(s, line, NULL);
+  }
+  return r->eof && r->start >= r->len && s->inflight == 0;
+}
+
+void batch_abort(BatchSession *s) {
+  s->reader.eof = 1;
+  s->reader.start = s->reader.len;
+  s->aborted = 1;
+}
+
+int batch_close(BatchSession *s) {
+  int result = s->aborted ? -1 : s->missing;
+
+  if (s->exists && !s->aborted)
+    write_exists_summary(s);
+  fflush(s->out);
+  entries_free(s);
+  free(s->exists_counts);
+  free(s);
+  return result;
+}
+
+int batch_run(int fd, FILE *out, char *const urls[], int url_count,
+              const BatchOptions *opts) {
+  BatchSession *s = batch_open(fd, out, urls, url_count, opts);
+  if (!s)
+    return -1;
+
+  while (!batch_step(s)) {
+    int want_input = batch_want_input(s);
+    struct curl_waitfd wfd = {fd, CURL_WAIT_POLLIN, 0};
+    fetch_poll(want_input ? &wfd : NULL, want_input, 1000);
+    if (want_input && (wfd.revents & CURL_WAIT_POLLIN))
+      batch_read(s);
+
+    fflush(out);
+    if (ferror(out) && !s->aborted)
+      batch_abort(s);
+  }
+  return batch_close(s);
+}
@@ -0,0 +1,28 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+typedef enum { OUTPUT_JSON, OUTPUT_TSV } OutputFormat;
+
+typedef struct {
+  OutputFormat format;
+  int jobs;
+  int exists;
+} BatchOptions;
+
+typedef struct BatchSession BatchSession;
+
+void json_write_string(FILE *out, const char *s, size_t len);
+BatchSession *batch_open(int fd, FILE *out, char *const urls[], int url_count,
+                         const BatchOptions *opts);
+int batch_want_input(const BatchSession *s);
+ssize_t batch_read(BatchSession *s);
+int batch_step(BatchSession *s);
+void batch_abort(BatchSession *s);
+int batch_close(BatchSession *s);
+int batch_run(int fd, FILE *out, char *const urls[], int url_count,
+              const BatchOptions *opts);
+
+#endif
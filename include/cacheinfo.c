@@ -0,0 +1,229 @@
+#include "cacheinfo.h"
+#include "fetch.h"
+#include "narcache.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static char **load_urls = NULL;
+static CacheInfo *load_infos = NULL;
+static FetchRequest *load_reqs = NULL;
+static int load_count = 0;
+static int load_pending = 0;
+static int load_apply = 0;
+static char load_path[PATH_MAX];
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void cacheinfo_defaults(CacheInfo *info) {
+  memset(info, 0, sizeof(*info));
+  strcpy(info->store_dir, DEFAULT_STORE_DIR);
+  info->priority = CACHEINFO_DEFAULT_PRIORITY;
+}
+
+static void cacheinfo_parse(const char *text, CacheInfo *info) {
+  for (const char *p = text; p && *p;) {
+    const char *eol = strchr(p, '\n');
+    size_t len = eol ? (size_t)(eol - p) : strlen(p);
+
+    if (strncmp(p, "StoreDir: ", 10) == 0 &&
+        len - 10 < sizeof(info->store_dir)) {
+      memcpy(info->store_dir, p + 10, len - 10);
+      info->store_dir[len - 10] = '\0';
+    } else if (strncmp(p, "Priority: ", 10) == 0) {
+      info->priority = atoi(p + 10);
+    } else if (strncmp(p, "WantMassQuery: ", 15) == 0) {
+      info->want_mass_query = atoi(p + 15) != 0;
+    }
+
+    p = eol ? eol + 1 : NULL;
+  }
+  info->known = 1;
+}
+
+static int cacheinfo_expired(long long stored, int failed, time_t now) {
+  return now - stored > (failed ? CACHEINFO_FAILED_TTL : CACHEINFO_TTL);
+}
+
+static void cacheinfo_read(const char *path, char *const urls[], int count,
+                           CacheInfo infos[]) {
+  FILE *f = fopen(path, "r");
+  if (!f)
+    return;
+
+  char line[1024];
+  time_t now = time(NULL);
+  while (fgets(line, sizeof(line), f)) {
+    char url[512], store_dir[256];
+    long long stored;
+    int priority, mass, failed = 0;
+
+    if (sscanf(line, "%511s %lld %d %d %255s %d", url, &stored, &priority,
+               &mass, store_dir, &failed) < 5 ||
+        cacheinfo_expired(stored, failed, now))
+      continue;
+
+    for (int i = 0; i < count; ++i) {
+      if (strcmp(urls[i], url) != 0)
+        continue;
+      snprintf(infos[i].store_dir, sizeof(infos[i].store_dir), "%s",
+               store_dir);
+      infos[i].priority = priority;
+      infos[i].want_mass_query = mass;
+      infos[i].known = 1;
+      infos[i].failed = failed;
+    }
+  }
+  fclose(f);
+}
+
+static void cacheinfo_write(const char *path, char *const urls[], int count,
+                            const CacheInfo infos[],
+                            const FetchRequest reqs[]) {
+  char tmp[PATH_MAX + 16];
+  char line[1024];
+  time_t now = time(NULL);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  narcache_make_parents(path);
+  FILE *out = fopen(tmp, "w");
+  if (!out)
+    return;
+
+  FILE *in = fopen(path, "r");
+  if (in) {
+    while (fgets(line, sizeof(line), in)) {
+      char url[512];
+      long long stored;
+      int failed = 0;
+      int keep = sscanf(line, "%511s %lld %*d %*d %*s %d", url, &stored,
+                        &failed) >= 2 &&
+                 !cacheinfo_expired(stored, failed, now);
+      for (int i = 0; keep && i < count; ++i) {
+        if (reqs[i].done && strcmp(urls[i], url) == 0)
+          keep = 0;
+      }
+      if (keep)
+        fputs(line, out);
+    }
+    fclose(in);
+  }
+
+  for (int i = 0; i < count; ++i) {
+    if (reqs[i].done)
+      fprintf(out, "%s %lld %d %d %s %d\n", urls[i], (long long)now,
+              infos[i].priority, infos[i].want_mass_query, infos[i].store_dir,
+              infos[i].failed);
+  }
+
+  if (fclose(out) != 0 || rename(tmp, path) != 0)
+    remove(tmp);
+}
+
+static void cacheinfo_finish(void) {
+  if (load_path[0])
+    cacheinfo_write(load_path, load_urls, load_count, load_infos, load_reqs);
+  for (int i = 0; i < load_count; ++i)
+    fetch_request_free(&load_reqs[i]);
+  if (load_apply)
+    free(load_infos);
+  free(load_urls);
+  free(load_reqs);
+  load_urls = NULL;
+  load_infos = NULL;
+  load_reqs = NULL;
+  load_count = 0;
+}
+
+static void cacheinfo_done(FetchRequest *req) {
+  int i = req - load_reqs;
+
+  if (req->result == CURLE_OK) {
+    cacheinfo_parse(req->response.ptr, &load_infos[i]);
+  } else {
+    load_infos[i].known = 1;
+    load_infos[i].failed = 1;
+  }
+  if (load_apply)
+    cacheinfo_apply(&load_urls[i], &load_infos[i], 1);
+  if (--load_pending == 0)
+    cacheinfo_finish();
+}
+
+void cacheinfo_load(char *const urls[], int count, CacheInfo infos[],
+                    int persist, int wait) {
+  for (int i = 0; i < count; ++i)
+    cacheinfo_defaults(&infos[i]);
+  load_path[0] = '\0';
+  if (persist &&
+      narcache_file_path("cache-info", load_path, sizeof(load_path)) == 0)
+    cacheinfo_read(load_path, urls, count, infos);
+  else
+    load_path[0] = '\0';
+
+  load_reqs = calloc(count, sizeof(*load_reqs));
+  load_urls = malloc(count * sizeof(*load_urls));
+  load_infos = wait ? infos : malloc(count * sizeof(*load_infos));
+  load_count = count;
+  load_apply = !wait;
+  if (!load_reqs || !load_urls || !load_infos) {
+    load_path[0] = '\0';
+    load_count = 0;
+    cacheinfo_finish();
+    return;
+  }
+  memcpy(load_urls, urls, count * sizeof(*load_urls));
+  if (!wait)
+    memcpy(load_infos, infos, count * sizeof(*load_infos));
+
+  long long deadline = now_ms() + CACHEINFO_TIMEOUT_MS;
+  load_pending = 1;
+  for (int i = 0; i < count; ++i) {
+    if (infos[i].known)
+      continue;
+    char url[512];
+    snprintf(url, sizeof(url), "%s/nix-cache-info", urls[i]);
+    fetch_request_init(&load_reqs[i], url);
+    load_reqs[i].deadline = deadline;
+    load_reqs[i].on_done = cacheinfo_done;
+    if (fetch_add(&load_reqs[i]) == 0)
+      load_pending++;
+  }
+  if (--load_pending == 0) {
+    load_path[0] = '\0';
+    cacheinfo_finish();
+    return;
+  }
+
+  if (wait)
+    fetch_wait_all();
+}
+
+void cacheinfo_sort(char *urls[], CacheInfo infos[], int count) {
+  for (int i = 1; i < count; ++i) {
+    char *url = urls[i];
+    CacheInfo info = infos[i];
+    int j = i - 1;
+    while (j >= 0 && infos[j].priority > info.priority) {
+      urls[j + 1] = urls[j];
+      infos[j + 1] = infos[j];
+      j--;
+    }
+    urls[j + 1] = url;
+    infos[j + 1] = info;
+  }
+}
+
+void cacheinfo_apply(char *const urls[], const CacheInfo infos[], int count) {
+  for (int i = 0; i < count; ++i) {
+    store_add_dir(infos[i].store_dir);
+    fetch_set_limit(urls[i], infos[i].want_mass_query ? 0
+                                                      : CACHEINFO_SLOW_LIMIT);
+  }
+}
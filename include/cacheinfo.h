@@ -0,0 +1,23 @@
+#ifndef CACHEINFO_H
+#define CACHEINFO_H
+
+#define CACHEINFO_TTL (7 * 24 * 3600)
+#define CACHEINFO_FAILED_TTL 3600
+#define CACHEINFO_TIMEOUT_MS 3000
+#define CACHEINFO_DEFAULT_PRIORITY 50
+#define CACHEINFO_SLOW_LIMIT 2
+
+typedef struct {
+  char store_dir[256];
+  int priority;
+  int want_mass_query;
+  int known;
+  int failed;
+} CacheInfo;
+
+void cacheinfo_load(char *const urls[], int count, CacheInfo infos[],
+                    int persist, int wait);
+void cacheinfo_sort(char *urls[], CacheInfo infos[], int count);
+void cacheinfo_apply(char *const urls[], const CacheInfo infos[], int count);
+
+#endif
@@ -1,11 +1,12 @@
 #include "clipboard.h"
+#include <dirent.h>
 #include <fcntl.h>
 #include <poll.h>
+#include <signal.h>
+#include <stdio.h>
 #include <stdlib.h>
-#include <sys/select.h>
-#include <sys/socket.h>
-#include <sys/time.h>
-#include <sys/un.h>
+#include <string.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
 #ifdef HAVE_X11
@@ -21,19 +22,20 @@
 #endif
 
 typedef enum {
+  CLIPBOARD_UNSET,
   CLIPBOARD_NONE,
   CLIPBOARD_X11,
-  CLIPBOARD_WAYLAND
+  CLIPBOARD_WAYLAND,
+  CLIPBOARD_OSC52
 } clipboard_type_t;
 
-static clipboard_type_t clipboard_type = CLIPBOARD_NONE;
+static clipboard_type_t clipboard_type = CLIPBOARD_UNSET;
 
 #ifdef HAVE_X11
 static Display *x11_display = NULL;
 static Window x11_window;
 static Atom xa_clipboard, xa_targets, xa_string, xa_utf8_string, xa_text;
 static char *x11_clipboard_data = NULL;
-static int x11_running = 0;
 
 static int x11_handle_selection_request(XEvent *event) {
   XSelectionRequestEvent *req = &event->xselectionrequest;
@@ -70,39 +72,60 @@ static int x11_handle_selection_request(XEvent *event) {
 
 static void x11_run_event_loop(void) {
   XEvent event;
-  int x11_fd = ConnectionNumber(x11_display);
-  fd_set read_fds;
-  struct timeval timeout;
-
-  x11_running = 1;
-
-  while (x11_running) {
-    FD_ZERO(&read_fds);
-    FD_SET(x11_fd, &read_fds);
-
-    timeout.tv_sec = 0;
-    timeout.tv_usec = 100000;
-
-    int result = select(x11_fd + 1, &read_fds, NULL, NULL, &timeout);
-
-    if (result > 0 && FD_ISSET(x11_fd, &read_fds)) {
-      while (XPending(x11_display)) {
-        XNextEvent(x11_display, &event);
-
-        switch (event.type) {
-        case SelectionRequest:
-          x11_handle_selection_request(&event);
-          break;
-        case SelectionClear:
-          x11_running = 0;
-          break;
-        }
-      }
-    } else if (result == 0) {
-      break;
-    }
+
+  while (1) {
+    XNextEvent(x11_display, &event);
+    if (event.type == SelectionRequest)
+      x11_handle_selection_request(&event);
+    else if (event.type == SelectionClear)
+      return;
   }
 }
+
+static int x11_open(void) {
+  x11_display = XOpenDisplay(NULL);
+  if (!x11_display)
+    return -1;
+
+  int screen = DefaultScreen(x11_display);
+  x11_window = XCreateSimpleWindow(
+      x11_display, RootWindow(x11_display, screen), 0, 0, 1, 1, 0,
+      BlackPixel(x11_display, screen), WhitePixel(x11_display, screen));
+
+  XSelectInput(x11_display, x11_window, PropertyChangeMask);
+
+  xa_clipboard = XInternAtom(x11_display, "CLIPBOARD", False);
+  xa_targets = XInternAtom(x11_display, "TARGETS", False);
+  xa_string = XInternAtom(x11_display, "STRING", False);
+  xa_utf8_string = XInternAtom(x11_display, "UTF8_STRING", False);
+  xa_text = XInternAtom(x11_display, "TEXT", False);
+
+  if (xa_clipboard != None)
+    return 0;
+  XDestroyWindow(x11_display, x11_window);
+  XCloseDisplay(x11_display);
+  x11_display = NULL;
+  return -1;
+}
+
+static int x11_serve(const char *text, int status_fd) {
+  if (x11_open() != 0)
+    return -1;
+  x11_clipboard_data = strdup(text);
+  if (!x11_clipboard_data)
+    return -1;
+
+  XSetSelectionOwner(x11_display, xa_clipboard, x11_window, CurrentTime);
+  if (XGetSelectionOwner(x11_display, xa_clipboard) != x11_window)
+    return -1;
+  XFlush(x11_display);
+
+  if (write(status_fd, "", 1) != 1)
+    return -1;
+  close(status_fd);
+  x11_run_event_loop();
+  return 0;
+}
 #endif
 
 #ifdef HAVE_WAYLAND
@@ -222,204 +245,228 @@ static const struct wl_registry_listener registry_listener = {
 };
 
 static void wayland_run_event_loop(void) {
-  int wl_fd = wl_display_get_fd(wl_display);
-  struct pollfd pfd;
-
   wayland_running = 1;
+  while (wayland_running && wl_display_dispatch(wl_display) != -1)
+    ;
+}
 
-  while (wayland_running) {
-    while (wl_display_prepare_read(wl_display) != 0) {
-      wl_display_dispatch_pending(wl_display);
-    }
-
-    wl_display_flush(wl_display);
+static int wayland_open(void) {
+  wl_display = wl_display_connect(NULL);
+  if (!wl_display)
+    return -1;
 
-    pfd.fd = wl_fd;
-    pfd.events = POLLIN;
-    pfd.revents = 0;
+  wl_registry = wl_display_get_registry(wl_display);
+  if (wl_registry) {
+    wl_registry_add_listener(wl_registry, &registry_listener, NULL);
+    wl_display_roundtrip(wl_display);
 
-    if (poll(&pfd, 1, 100) > 0) {
-      wl_display_read_events(wl_display);
-      wl_display_dispatch_pending(wl_display);
-    } else {
-      wl_display_cancel_read(wl_display);
-      break;
+    if (data_device_manager && seat) {
+      data_device =
+          wl_data_device_manager_get_data_device(data_device_manager, seat);
+      if (data_device)
+        return 0;
     }
   }
+  wl_display_disconnect(wl_display);
+  wl_display = NULL;
+  return -1;
 }
-#endif
 
-int clipboard_init(void) {
-  const char *wayland_display = getenv("WAYLAND_DISPLAY");
-  const char *x11_display_env = getenv("DISPLAY");
+static int wayland_serve(const char *text, int status_fd) {
+  if (wayland_open() != 0)
+    return -1;
+  wayland_clipboard_data = strdup(text);
+  if (!wayland_clipboard_data)
+    return -1;
 
-#ifdef HAVE_WAYLAND
-  if (wayland_display) {
-    wl_display = wl_display_connect(NULL);
-    if (wl_display) {
-      wl_registry = wl_display_get_registry(wl_display);
-      if (wl_registry) {
-        wl_registry_add_listener(wl_registry, &registry_listener, NULL);
-        wl_display_roundtrip(wl_display);
-
-        if (data_device_manager && seat) {
-          data_device =
-              wl_data_device_manager_get_data_device(data_device_manager, seat);
-          if (data_device) {
-            clipboard_type = CLIPBOARD_WAYLAND;
-            return 0;
-          }
-        }
-      }
-      wl_display_disconnect(wl_display);
-      wl_display = NULL;
-    }
-  }
+  data_source =
+      wl_data_device_manager_create_data_source(data_device_manager);
+  if (!data_source)
+    return -1;
+
+  wl_data_source_add_listener(data_source, &data_source_listener, NULL);
+  wl_data_source_offer(data_source, "text/plain");
+  wl_data_source_offer(data_source, "text/plain;charset=utf-8");
+  wl_data_source_offer(data_source, "TEXT");
+  wl_data_source_offer(data_source, "STRING");
+  wl_data_source_offer(data_source, "UTF8_STRING");
+
+  wl_data_device_set_selection(data_device, data_source, 0);
+  if (wl_display_roundtrip(wl_display) == -1 || !data_source)
+    return -1;
+
+  if (write(status_fd, "", 1) != 1)
+    return -1;
+  close(status_fd);
+  wayland_run_event_loop();
+  return 0;
+}
 #endif
 
-#ifdef HAVE_X11
-  if (x11_display_env) {
-    x11_display = XOpenDisplay(NULL);
-    if (x11_display) {
-      int screen = DefaultScreen(x11_display);
-      x11_window = XCreateSimpleWindow(
-          x11_display, RootWindow(x11_display, screen), 0, 0, 1, 1, 0,
-          BlackPixel(x11_display, screen), WhitePixel(x11_display, screen));
-
-      XSelectInput(x11_display, x11_window, PropertyChangeMask);
-
-      xa_clipboard = XInternAtom(x11_display, "CLIPBOARD", False);
-      xa_targets = XInternAtom(x11_display, "TARGETS", False);
-      xa_string = XInternAtom(x11_display, "STRING", False);
-      xa_utf8_string = XInternAtom(x11_display, "UTF8_STRING", False);
-      xa_text = XInternAtom(x11_display, "TEXT", False);
-
-      if (xa_clipboard != None) {
-        clipboard_type = CLIPBOARD_X11;
-        return 0;
-      }
-      XDestroyWindow(x11_display, x11_window);
-      XCloseDisplay(x11_display);
-      x11_display = NULL;
-    }
+static int osc52_available(void) {
+  const char *term = getenv("TERM");
+  return isatty(STDOUT_FILENO) && term && strcmp(term, "dumb") != 0 &&
+         strcmp(term, "linux") != 0;
+}
+
+static int osc52_set_text(const char *text) {
+  static const char b64[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const unsigned char *in = (const unsigned char *)text;
+  size_t len = strlen(text);
+  int tmux = getenv("TMUX") != NULL;
+  char *buf = malloc(32 + (len + 2) / 3 * 4);
+  if (!buf)
+    return -1;
+
+  size_t n = 0;
+  n += sprintf(buf, "%s\033]52;c;", tmux ? "\033Ptmux;\033" : "");
+  for (size_t i = 0; i < len; i += 3) {
+    unsigned v = in[i] << 16 | (i + 1 < len ? in[i + 1] << 8 : 0) |
+                 (i + 2 < len ? in[i + 2] : 0);
+    buf[n++] = b64[v >> 18 & 63];
+    buf[n++] = b64[v >> 12 & 63];
+    buf[n++] = i + 1 < len ? b64[v >> 6 & 63] : '=';
+    buf[n++] = i + 2 < len ? b64[v & 63] : '=';
   }
-#endif
+  n += sprintf(buf + n, "\a%s", tmux ? "\033\\" : "");
+
+  int fd = open("/dev/tty", O_WRONLY | O_NOCTTY | O_CLOEXEC);
+  int out = fd >= 0 ? fd : STDOUT_FILENO;
+  size_t off = 0;
+  while (off < n) {
+    ssize_t w = write(out, buf + off, n - off);
+    if (w <= 0)
+      break;
+    off += w;
+  }
+  if (fd >= 0)
+    close(fd);
+  free(buf);
+  return off == n ? 0 : -1;
+}
+
+int clipboard_init(void) {
+  int remote = getenv("SSH_CONNECTION") || getenv("SSH_TTY");
 
   clipboard_type = CLIPBOARD_NONE;
-  return -1;
-}
 
-void clipboard_cleanup(void) {
+  if (remote && osc52_available())
+    clipboard_type = CLIPBOARD_OSC52;
 #ifdef HAVE_WAYLAND
-  if (clipboard_type == CLIPBOARD_WAYLAND) {
-    wayland_running = 0;
-    if (wayland_clipboard_data) {
-      free(wayland_clipboard_data);
-      wayland_clipboard_data = NULL;
-    }
-    if (data_source) {
-      wl_data_source_destroy(data_source);
-      data_source = NULL;
-    }
-    if (data_device) {
-      wl_data_device_destroy(data_device);
-      data_device = NULL;
-    }
-    if (seat) {
-      wl_seat_destroy(seat);
-      seat = NULL;
-    }
-    if (data_device_manager) {
-      wl_data_device_manager_destroy(data_device_manager);
-      data_device_manager = NULL;
-    }
-    if (wl_registry) {
-      wl_registry_destroy(wl_registry);
-      wl_registry = NULL;
-    }
-    if (wl_display) {
-      wl_display_disconnect(wl_display);
-      wl_display = NULL;
-    }
-  }
+  else if (getenv("WAYLAND_DISPLAY"))
+    clipboard_type = CLIPBOARD_WAYLAND;
 #endif
-
 #ifdef HAVE_X11
-  if (clipboard_type == CLIPBOARD_X11) {
-    x11_running = 0;
-    if (x11_clipboard_data) {
-      free(x11_clipboard_data);
-      x11_clipboard_data = NULL;
-    }
-    if (x11_display) {
-      XDestroyWindow(x11_display, x11_window);
-      XCloseDisplay(x11_display);
-      x11_display = NULL;
-    }
-  }
+  else if (getenv("DISPLAY"))
+    clipboard_type = CLIPBOARD_X11;
 #endif
+  else if (osc52_available())
+    clipboard_type = CLIPBOARD_OSC52;
 
-  clipboard_type = CLIPBOARD_NONE;
+  return clipboard_type == CLIPBOARD_NONE ? -1 : 0;
 }
 
-int clipboard_set_text(const char *text) {
-  if (!text)
-    return -1;
+void clipboard_cleanup(void) { clipboard_type = CLIPBOARD_UNSET; }
 
-#ifdef HAVE_WAYLAND
-  if (clipboard_type == CLIPBOARD_WAYLAND) {
-    if (wayland_clipboard_data) {
-      free(wayland_clipboard_data);
+static void close_inherited(int keep_fd) {
+  DIR *dir = opendir("/proc/self/fd");
+  if (dir) {
+    struct dirent *entry;
+    while ((entry = readdir(dir))) {
+      int fd = atoi(entry->d_name);
+      if (fd > STDERR_FILENO && fd != keep_fd && fd != dirfd(dir))
+        close(fd);
     }
-    wayland_clipboard_data = strdup(text);
-    if (!wayland_clipboard_data)
-      return -1;
+    closedir(dir);
+    return;
+  }
 
-    if (data_source) {
-      wl_data_source_destroy(data_source);
-    }
+  long max_fd = sysconf(_SC_OPEN_MAX);
+  for (long fd = STDERR_FILENO + 1; fd < (max_fd > 0 ? max_fd : 1024); ++fd) {
+    if (fd != keep_fd)
+      close((int)fd);
+  }
+}
 
-    data_source =
-        wl_data_device_manager_create_data_source(data_device_manager);
-    if (!data_source)
-      return -1;
+static void clipboard_detach(int keep_fd) {
+  int null_fd = open("/dev/null", O_RDWR);
+  if (null_fd >= 0) {
+    dup2(null_fd, STDIN_FILENO);
+    dup2(null_fd, STDOUT_FILENO);
+    dup2(null_fd, STDERR_FILENO);
+  }
 
-    wl_data_source_add_listener(data_source, &data_source_listener, NULL);
-    wl_data_source_offer(data_source, "text/plain");
-    wl_data_source_offer(data_source, "text/plain;charset=utf-8");
-    wl_data_source_offer(data_source, "TEXT");
-    wl_data_source_offer(data_source, "STRING");
-    wl_data_source_offer(data_source, "UTF8_STRING");
+  close_inherited(keep_fd);
 
-    wl_data_device_set_selection(data_device, data_source, 0);
-    wl_display_flush(wl_display);
+  setsid();
+  signal(SIGHUP, SIG_IGN);
+  signal(SIGINT, SIG_IGN);
+  signal(SIGPIPE, SIG_IGN);
+}
 
-    wayland_run_event_loop();
+static void clipboard_serve(const char *text, int status_fd) {
+  int rc = -1;
 
-    return 0;
-  }
+  clipboard_detach(status_fd);
+#if !defined(HAVE_WAYLAND) && !defined(HAVE_X11)
+  (void)text;
+#endif
+#ifdef HAVE_WAYLAND
+  if (clipboard_type == CLIPBOARD_WAYLAND)
+    rc = wayland_serve(text, status_fd);
 #endif
-
 #ifdef HAVE_X11
-  if (clipboard_type == CLIPBOARD_X11) {
-    if (x11_clipboard_data) {
-      free(x11_clipboard_data);
-    }
-    x11_clipboard_data = strdup(text);
-    if (!x11_clipboard_data)
-      return -1;
+  if (clipboard_type == CLIPBOARD_X11)
+    rc = x11_serve(text, status_fd);
+#endif
+  _exit(rc == 0 ? 0 : 1);
+}
 
-    XSetSelectionOwner(x11_display, xa_clipboard, x11_window, CurrentTime);
-    if (XGetSelectionOwner(x11_display, xa_clipboard) != x11_window) {
-      return -1;
-    }
+static int clipboard_spawn(const char *text) {
+  int fds[2];
 
-    XFlush(x11_display);
-    x11_run_event_loop();
+  if (pipe(fds) != 0)
+    return -1;
 
-    return 0;
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    if (fork() == 0)
+      clipboard_serve(text, fds[1]);
+    _exit(0);
   }
-#endif
 
-  return -1;
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return -1;
+  }
+  waitpid(pid, NULL, 0);
+
+  struct pollfd pfd = {fds[0], POLLIN, 0};
+  char status;
+  int rc = -1;
+  if (poll(&pfd, 1, CLIPBOARD_CONFIRM_MS) > 0 && read(fds[0], &status, 1) == 1)
+    rc = 0;
+  close(fds[0]);
+  return rc;
+}
+
+int clipboard_set_text(const char *text) {
+  if (!text)
+    return -1;
+  if (clipboard_type == CLIPBOARD_UNSET)
+    clipboard_init();
+
+  if (clipboard_type == CLIPBOARD_OSC52)
+    return osc52_set_text(text);
+  if (clipboard_type == CLIPBOARD_NONE)
+    return -1;
+  if (clipboard_spawn(text) == 0)
+    return 0;
+  if (!osc52_available())
+    return -1;
+  clipboard_type = CLIPBOARD_OSC52;
+  return osc52_set_text(text);
 }
@@ -1,6 +1,8 @@
 #ifndef CLIPBOARD_H
 #define CLIPBOARD_H
 
+#define CLIPBOARD_CONFIRM_MS 250
+
 int clipboard_init(void);
 void clipboard_cleanup(void);
 int clipboard_set_text(const char *text);
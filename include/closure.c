@@ -0,0 +1,449 @@
+#include "closure.h"
+#include "fetch.h"
+#include "localstore.h"
+#include "narinfo.h"
+#include "sigverify.h"
+#include "store.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  ClosureSession *session;
+  char hash[HASH_LEN + 1];
+  char *name;
+  uint32_t hits;
+  uint32_t errors;
+  int pending;
+  int expanded;
+  FetchGroup group;
+  uint64_t nar_size;
+  uint64_t file_size;
+  int reference_count;
+  SigStatus sig;
+} ClosurePath;
+
+typedef struct {
+  ClosurePath *path;
+  int cache;
+  int next_free;
+  Arena arena;
+  FetchRequest req;
+} ClosureSlot;
+
+struct ClosureSession {
+  FILE *out;
+  char *const *urls;
+  int url_count;
+  OutputFormat format;
+  int local;
+  int verify;
+  int aborted;
+
+  Arena path_arena;
+  ClosurePath **paths;
+  size_t path_count;
+  size_t path_cap;
+
+  ClosurePath **set;
+  size_t set_cap;
+
+  size_t *queue;
+  size_t queue_head;
+  size_t queue_len;
+
+  ClosureSlot *slots;
+  int slot_count;
+  int free_slot;
+  int free_slots;
+
+  size_t available;
+  size_t missing;
+  uint64_t total_nar_size;
+  uint64_t total_file_size;
+  size_t cache_hits[32];
+  size_t sig_counts[SIG_VALID + 1];
+  size_t verifying;
+};
+
+static uint64_t hash_key(const char *hash) {
+  uint64_t h = 14695981039346656037ULL;
+  for (int i = 0; i < HASH_LEN; ++i)
+    h = (h ^ (unsigned char)hash[i]) * 1099511628211ULL;
+  return h;
+}
+
+static int set_grow(ClosureSession *c) {
+  size_t cap = c->set_cap ? c->set_cap * 2 : 1024;
+  ClosurePath **table = calloc(cap, sizeof(*table));
+  if (!table)
+    return -1;
+
+  for (size_t i = 0; i < c->set_cap; ++i) {
+    if (!c->set[i])
+      continue;
+    size_t j = hash_key(c->set[i]->hash) & (cap - 1);
+    while (table[j])
+      j = (j + 1) & (cap - 1);
+    table[j] = c->set[i];
+  }
+
+  free(c->set);
+  c->set = table;
+  c->set_cap = cap;
+  return 0;
+}
+
+static ClosurePath *path_add(ClosureSession *c, const char *ref, size_t len) {
+  if (len < HASH_LEN || !is_store_hash(ref, HASH_LEN))
+    return NULL;
+  if ((c->path_count + 1) * 2 > c->set_cap && set_grow(c) != 0)
+    return NULL;
+
+  size_t i = hash_key(ref) & (c->set_cap - 1);
+  while (c->set[i]) {
+    if (memcmp(c->set[i]->hash, ref, HASH_LEN) == 0)
+      return NULL;
+    i = (i + 1) & (c->set_cap - 1);
+  }
+
+  if (c->path_count == c->path_cap) {
+    size_t cap = c->path_cap ? c->path_cap * 2 : 256;
+    ClosurePath **p = realloc(c->paths, cap * sizeof(*p));
+    size_t *q = realloc(c->queue, cap * sizeof(*q));
+    if (p)
+      c->paths = p;
+    if (q)
+      c->queue = q;
+    if (!p || !q)
+      return NULL;
+    c->path_cap = cap;
+  }
+
+  ClosurePath *path = arena_alloc(&c->path_arena, sizeof(*path));
+  if (!path)
+    return NULL;
+  memset(path, 0, sizeof(*path));
+  path->session = c;
+  memcpy(path->hash, ref, HASH_LEN);
+  path->name = arena_strndup(&c->path_arena, ref, len);
+
+  c->set[i] = path;
+  c->queue[c->queue_head + c->queue_len++] = c->path_count;
+  c->paths[c->path_count++] = path;
+  return path;
+}
+
+static void write_path(const ClosurePath *path) {
+  const ClosureSession *c = path->session;
+  FILE *out = c->out;
+  const char *status = path->hits     ? "available"
+                       : path->errors ? "error"
+                                      : "missing";
+
+  if (c->format == OUTPUT_TSV) {
+    fprintf(out, "%s\t%s\t%llu\t%llu\t%s\t",
+            path->name ? path->name : path->hash, status,
+            (unsigned long long)path->nar_size,
+            (unsigned long long)path->file_size,
+            path->sig != SIG_UNCHECKED ? sigverify_status_name(path->sig)
+                                       : "");
+    for (int i = 0, first = 1; i < c->url_count; ++i) {
+      if (path->hits & (1u << i)) {
+        fprintf(out, "%s%s", first ? "" : ",", c->urls[i]);
+        first = 0;
+      }
+    }
+    fputc('\n', out);
+    return;
+  }
+
+  fputs("{\"path\":", out);
+  json_write_string(out, path->name ? path->name : path->hash,
+                    strlen(path->name ? path->name : path->hash));
+  fputs(",\"hash\":", out);
+  json_write_string(out, path->hash, HASH_LEN);
+  fprintf(out, ",\"status\":\"%s\"", status);
+  if (path->hits)
+    fprintf(out, ",\"nar_size\":%llu,\"file_size\":%llu,\"references\":%d",
+            (unsigned long long)path->nar_size,
+            (unsigned long long)path->file_size, path->reference_count);
+  if (path->sig != SIG_UNCHECKED)
+    fprintf(out, ",\"signature\":\"%s\"", sigverify_status_name(path->sig));
+
+  fputs(",\"caches\":[", out);
+  for (int i = 0, first = 1; i < c->url_count; ++i) {
+    if (path->hits & (1u << i)) {
+      if (!first)
+        fputc(',', out);
+      json_write_string(out, c->urls[i], strlen(c->urls[i]));
+      first = 0;
+    }
+  }
+  fputs("]}\n", out);
+}
+
+static void write_summary(const ClosureSession *c) {
+  FILE *out = c->out;
+
+  if (c->format == OUTPUT_TSV) {
+    fprintf(out, "# paths=%zu available=%zu missing=%zu nar_size=%llu "
+                 "file_size=%llu\n",
+            c->path_count, c->available, c->missing,
+            (unsigned long long)c->total_nar_size,
+            (unsigned long long)c->total_file_size);
+    for (int i = 0; i < c->url_count; ++i)
+      fprintf(out, "# %s=%zu\n", c->urls[i], c->cache_hits[i]);
+    for (int i = SIG_UNSIGNED; c->verify && i <= SIG_VALID; ++i)
+      fprintf(out, "# signature %s=%zu\n", sigverify_status_name(i),
+              c->sig_counts[i]);
+    return;
+  }
+
+  fprintf(out,
+          "{\"summary\":true,\"paths\":%zu,\"available\":%zu,\"missing\":%zu,"
+          "\"nar_size\":%llu,\"file_size\":%llu,\"caches\":{",
+          c->path_count, c->available, c->missing,
+          (unsigned long long)c->total_nar_size,
+          (unsigned long long)c->total_file_size);
+  for (int i = 0; i < c->url_count; ++i) {
+    if (i > 0)
+      fputc(',', out);
+    json_write_string(out, c->urls[i], strlen(c->urls[i]));
+    fprintf(out, ":%zu", c->cache_hits[i]);
+  }
+  fputc('}', out);
+  if (c->verify) {
+    fputs(",\"signatures\":{", out);
+    for (int i = SIG_UNSIGNED; i <= SIG_VALID; ++i)
+      fprintf(out, "%s\"%s\":%zu", i > SIG_UNSIGNED ? "," : "",
+              sigverify_status_name(i), c->sig_counts[i]);
+    fputc('}', out);
+  }
+  fputs("}\n", out);
+}
+
+static void path_finish(ClosurePath *path) {
+  ClosureSession *c = path->session;
+  if (--path->pending > 0)
+    return;
+
+  if (path->hits) {
+    c->available++;
+    c->total_nar_size += path->nar_size;
+    c->total_file_size += path->file_size;
+  } else {
+    c->missing++;
+  }
+  c->sig_counts[path->sig]++;
+  write_path(path);
+}
+
+static void path_verified(SigJob *job) {
+  ClosurePath *path = job->data;
+  path->sig = job->status;
+  path->session->verifying--;
+  path_finish(path);
+}
+
+static void path_verify(ClosurePath *path, const Narinfo *info) {
+  ClosureSession *c = path->session;
+  SigJob *job = arena_alloc(&c->path_arena, sizeof(*job));
+  if (!job || sigverify_prepare(job, info, &c->path_arena) != 0) {
+    path->sig = SIG_INVALID;
+    return;
+  }
+  job->on_done = path_verified;
+  job->data = path;
+  path->pending++;
+  c->verifying++;
+  sigverify_submit(job);
+}
+
+static void closure_done(FetchRequest *req) {
+  ClosureSlot *slot = req->data;
+  ClosurePath *path = slot->path;
+  ClosureSession *c = path->session;
+
+  if (req->result == CURLE_OK) {
+    Narinfo info;
+    path->hits |= 1u << slot->cache;
+    c->cache_hits[slot->cache]++;
+
+    if (!path->expanded &&
+        narinfo_parse(req->response.ptr, req->response.len, &info,
+                      req->arena) == 0) {
+      path->expanded = 1;
+      path->nar_size = info.nar_size;
+      path->file_size = info.file_size;
+      path->reference_count = info.reference_count;
+
+      size_t base = info.store_path.len;
+      while (base > 0 && info.store_path.ptr[base - 1] != '/')
+        base--;
+      if (base > 0 && base < info.store_path.len) {
+        path->name = arena_strndup(&c->path_arena, info.store_path.ptr + base,
+                                   info.store_path.len - base);
+      }
+
+      for (int i = 0; !c->local && i < info.reference_count; ++i)
+        path_add(c, info.references[i].ptr, info.references[i].len);
+      if (c->verify)
+        path_verify(path, &info);
+      narinfo_free(&info);
+    }
+  } else if (!req->cancelled && req->http_code != 404 &&
+             req->http_code != 403) {
+    path->errors |= 1u << slot->cache;
+  }
+
+  string_free(&req->response);
+  arena_reset(&slot->arena);
+
+  slot->path = NULL;
+  slot->next_free = c->free_slot;
+  c->free_slot = slot - c->slots;
+  c->free_slots++;
+
+  path_finish(path);
+}
+
+static void submit_path(ClosurePath *path) {
+  ClosureSession *c = path->session;
+  path->pending = c->url_count;
+  fetch_group_init(&path->group);
+
+  for (int i = 0; i < c->url_count; ++i) {
+    ClosureSlot *slot = &c->slots[c->free_slot];
+    c->free_slot = slot->next_free;
+    c->free_slots--;
+
+    slot->path = path;
+    slot->cache = i;
+    fetch_narinfo_init(&slot->req, c->urls[i], path->hash);
+    slot->req.on_done = closure_done;
+    slot->req.data = slot;
+    slot->req.arena = &slot->arena;
+    if (fetch_group_add(&path->group, &slot->req) != 0) {
+      slot->req.result = CURLE_FAILED_INIT;
+      closure_done(&slot->req);
+    }
+  }
+}
+
+static void closure_free(ClosureSession *c) {
+  for (int i = 0; i < c->slot_count; ++i)
+    arena_free(&c->slots[i].arena);
+  arena_free(&c->path_arena);
+  free(c->paths);
+  free(c->set);
+  free(c->queue);
+  free(c->slots);
+  free(c);
+}
+
+static ClosureSession *closure_begin(FILE *out, char *const urls[],
+                                     int url_count, const BatchOptions *opts) {
+  int jobs = opts->jobs > url_count ? opts->jobs : url_count;
+  ClosureSession *c = calloc(1, sizeof(*c));
+  if (!c)
+    return NULL;
+
+  c->out = out;
+  c->urls = urls;
+  c->url_count = url_count;
+  c->format = opts->format;
+  c->verify = sigverify_key_count() > 0;
+  c->free_slot = -1;
+
+  arena_init(&c->path_arena, 65536);
+  c->slots = calloc(jobs, sizeof(*c->slots));
+  if (!c->slots) {
+    closure_free(c);
+    return NULL;
+  }
+  c->slot_count = jobs;
+  for (int i = jobs - 1; i >= 0; --i) {
+    arena_init(&c->slots[i].arena, 0);
+    c->slots[i].next_free = c->free_slot;
+    c->free_slot = i;
+  }
+  c->free_slots = jobs;
+  return c;
+}
+
+ClosureSession *closure_open(const char *hash, FILE *out, char *const urls[],
+                             int url_count, const BatchOptions *opts) {
+  ClosureSession *c = closure_begin(out, urls, url_count, opts);
+  if (c && !path_add(c, hash, strlen(hash))) {
+    closure_free(c);
+    return NULL;
+  }
+  return c;
+}
+
+int closure_step(ClosureSession *c) {
+  if (c->aborted)
+    c->queue_len = 0;
+  while (c->queue_len > 0 && c->free_slots >= c->url_count) {
+    submit_path(c->paths[c->queue[c->queue_head]]);
+    c->queue_head++;
+    c->queue_len--;
+  }
+  return c->queue_len == 0 && c->free_slots == c->slot_count &&
+         c->verifying == 0;
+}
+
+void closure_abort(ClosureSession *c) { c->aborted = 1; }
+
+int closure_close(ClosureSession *c) {
+  int result = c->aborted ? -1 : (int)c->missing;
+
+  if (!c->aborted)
+    write_summary(c);
+  fflush(c->out);
+  closure_free(c);
+  return result;
+}
+
+static int closure_walk(ClosureSession *c) {
+  while (!closure_step(c)) {
+    fetch_perform(1000);
+    fflush(c->out);
+  }
+  return closure_close(c);
+}
+
+int closure_run(const char *hash, FILE *out, char *const urls[], int url_count,
+                const BatchOptions *opts) {
+  ClosureSession *c = closure_open(hash, out, urls, url_count, opts);
+  return c ? closure_walk(c) : -1;
+}
+
+static void local_visit(const char *store_path, uint64_t nar_size,
+                        int reference_count, void *data) {
+  ClosureSession *c = data;
+  const char *hash = store_path_hash(store_path);
+  if (!hash)
+    return;
+
+  ClosurePath *path = path_add(c, hash, strlen(hash));
+  if (path) {
+    path->nar_size = nar_size;
+    path->reference_count = reference_count;
+  }
+}
+
+int closure_run_local(const char *store_path, FILE *out, char *const urls[],
+                      int url_count, const BatchOptions *opts) {
+  ClosureSession *c = closure_begin(out, urls, url_count, opts);
+  if (!c)
+    return -1;
+  c->local = 1;
+
+  if (localstore_closure(store_path, local_visit, c) < 0) {
+    closure_free(c);
+    return -1;
+  }
+  return closure_walk(c);
+}
@@ -0,0 +1,19 @@
+#ifndef CLOSURE_H
+#define CLOSURE_H
+
+#include "batch.h"
+#include <stdio.h>
+
+typedef struct ClosureSession ClosureSession;
+
+ClosureSession *closure_open(const char *hash, FILE *out, char *const urls[],
+                             int url_count, const BatchOptions *opts);
+int closure_step(ClosureSession *c);
+void closure_abort(ClosureSession *c);
+int closure_close(ClosureSession *c);
+int closure_run(const char *hash, FILE *out, char *const urls[], int url_count,
+                const BatchOptions *opts);
+int closure_run_local(const char *store_path, FILE *out, char *const urls[],
+                      int url_count, const BatchOptions *opts);
+
+#endif
@@ -0,0 +1,949 @@
+#include "fetch.h"
+#include "narcache.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define POOL_ORIGINS 16
+#define FETCH_LANES 16
+#define POOL_HANDLES 8
+#define FETCH_PRESIZE_MAX (16 * 1024 * 1024)
+#define FETCH_STREAM_BUFFER (512 * 1024)
+#define FETCH_LATENCY_SAMPLES 64
+#define FETCH_HEDGE_MIN_SAMPLES 20
+#define FETCH_HEDGE_DEFAULT_MS 1000
+#define FETCH_HEDGE_FLOOR_MS 10
+
+typedef struct {
+  char origin[256];
+  CURL *idle[POOL_HANDLES];
+  int count;
+  int no_head;
+  int latencies[FETCH_LATENCY_SAMPLES];
+  int latency_count;
+  int p95_ms;
+} HandlePool;
+
+typedef struct {
+  char base_url[512];
+  size_t len;
+  int active;
+  int limit;
+  long connect_timeout_ms;
+  long timeout_ms;
+  const char *mirror;
+  FetchRequest *wait_head;
+  FetchRequest *wait_tail;
+} Lane;
+
+static CURLM *fetch_multi = NULL;
+static CURLSH *fetch_share = NULL;
+static HandlePool pools[POOL_ORIGINS];
+static int pool_count = 0;
+static Lane lanes[FETCH_LANES];
+static int lane_count = 0;
+static int fetch_active = 0;
+static int fetch_held = 0;
+static void (*fetch_wake_handler)(void) = NULL;
+static FetchRequest *delayed = NULL;
+static FetchPolicy fetch_policy = FETCH_ALL;
+static int fetch_stagger_ms = 0;
+static long fetch_http_version = CURL_HTTP_VERSION_2TLS;
+static long fetch_connect_timeout_ms = FETCH_CONNECT_TIMEOUT_MS;
+static long fetch_timeout_ms = FETCH_TIMEOUT_MS;
+static long fetch_budget_ms = 0;
+static int fetch_hedging = 0;
+static FetchRequest *hedging = NULL;
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void init_string(struct string *s, Arena *arena) {
+  s->ptr = NULL;
+  s->len = 0;
+  s->cap = 0;
+  s->arena = arena;
+  if (string_reserve(s, 1) == 0)
+    s->ptr[0] = '\0';
+}
+
+int string_reserve(struct string *s, size_t cap) {
+  if (cap <= s->cap)
+    return 0;
+
+  size_t new_cap = s->cap ? s->cap * 2 : 64;
+  if (new_cap < cap)
+    new_cap = cap;
+
+  char *p = s->arena ? arena_resize(s->arena, s->ptr, s->cap, new_cap)
+                     : realloc(s->ptr, new_cap);
+  if (!p)
+    return -1;
+  s->ptr = p;
+  s->cap = new_cap;
+  return 0;
+}
+
+void string_free(struct string *s) {
+  if (!s->arena)
+    free(s->ptr);
+  s->ptr = NULL;
+  s->len = 0;
+  s->cap = 0;
+}
+
+size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s) {
+  size_t n = size * nmemb;
+  if (string_reserve(s, s->len + n + 1) != 0)
+    return 0;
+  memcpy(s->ptr + s->len, ptr, n);
+  s->len += n;
+  s->ptr[s->len] = '\0';
+  return n;
+}
+
+static size_t fetch_write(void *ptr, size_t size, size_t nmemb, void *data) {
+  FetchRequest *req = data;
+
+  if (req->on_data)
+    return req->on_data(req, ptr, size * nmemb);
+
+  if (req->response.len == 0 && req->curl) {
+    curl_off_t length = -1;
+    curl_easy_getinfo(req->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+    if (length > 0 && length < FETCH_PRESIZE_MAX)
+      string_reserve(&req->response, (size_t)length + 1);
+  }
+  return writefunc(ptr, size, nmemb, &req->response);
+}
+
+static void url_origin(const char *url, char *out, size_t outlen) {
+  const char *p = strstr(url, "://");
+  p = p ? p + 3 : url;
+  p += strcspn(p, "/");
+  size_t len = p - url;
+  if (len >= outlen)
+    len = outlen - 1;
+  memcpy(out, url, len);
+  out[len] = '\0';
+}
+
+static HandlePool *pool_for(const char *url, int create) {
+  char origin[256];
+  url_origin(url, origin, sizeof(origin));
+
+  for (int i = 0; i < pool_count; ++i) {
+    if (strcmp(pools[i].origin, origin) == 0)
+      return &pools[i];
+  }
+  if (!create || pool_count >= POOL_ORIGINS)
+    return NULL;
+
+  HandlePool *pool = &pools[pool_count++];
+  memset(pool, 0, sizeof(*pool));
+  strcpy(pool->origin, origin);
+  return pool;
+}
+
+static Lane *lane_get(const char *base_url) {
+  size_t len = strlen(base_url);
+  while (len > 0 && base_url[len - 1] == '/')
+    len--;
+  if (len >= sizeof(lanes[0].base_url))
+    return NULL;
+
+  for (int i = 0; i < lane_count; ++i) {
+    if (lanes[i].len == len && memcmp(lanes[i].base_url, base_url, len) == 0)
+      return &lanes[i];
+  }
+  if (lane_count >= FETCH_LANES)
+    return NULL;
+
+  Lane *lane = &lanes[lane_count++];
+  memset(lane, 0, sizeof(*lane));
+  memcpy(lane->base_url, base_url, len);
+  lane->len = len;
+  return lane;
+}
+
+static Lane *lane_for(const char *url) {
+  Lane *best = NULL;
+  for (int i = 0; i < lane_count; ++i) {
+    Lane *lane = &lanes[i];
+    if (strncmp(url, lane->base_url, lane->len) == 0 &&
+        (url[lane->len] == '/' || url[lane->len] == '\0') &&
+        (!best || lane->len > best->len))
+      best = lane;
+  }
+  return best;
+}
+
+static CURL *pool_get(const char *url) {
+  HandlePool *pool = pool_for(url, 0);
+  if (pool && pool->count > 0) {
+    CURL *curl = pool->idle[--pool->count];
+    curl_easy_reset(curl);
+    return curl;
+  }
+  return curl_easy_init();
+}
+
+static void pool_put(const char *url, CURL *curl) {
+  HandlePool *pool = pool_for(url, 1);
+  if (pool && pool->count < POOL_HANDLES) {
+    pool->idle[pool->count++] = curl;
+    return;
+  }
+  curl_easy_cleanup(curl);
+}
+
+int fetch_init(void) {
+  fetch_multi = curl_multi_init();
+  if (!fetch_multi)
+    return -1;
+
+  curl_multi_setopt(fetch_multi, CURLMOPT_PIPELINING, CURLPIPE_MULTIPLEX);
+
+  fetch_share = curl_share_init();
+  if (fetch_share) {
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+    curl_share_setopt(fetch_share, CURLSHOPT_SHARE,
+                      CURL_LOCK_DATA_SSL_SESSION);
+  }
+
+  pool_count = 0;
+  lane_count = 0;
+  fetch_active = 0;
+  delayed = NULL;
+  hedging = NULL;
+  return 0;
+}
+
+void fetch_set_limit(const char *base_url, int max_active) {
+  Lane *lane = lane_get(base_url);
+  if (lane)
+    lane->limit = max_active > 0 ? max_active : 0;
+}
+
+void fetch_set_policy(FetchPolicy policy, int stagger_ms) {
+  fetch_policy = policy;
+  fetch_stagger_ms = stagger_ms > 0 ? stagger_ms : 0;
+}
+
+void fetch_set_http_version(long version) { fetch_http_version = version; }
+
+void fetch_set_timeouts(const char *base_url, long connect_ms, long total_ms) {
+  Lane *lane = base_url ? lane_get(base_url) : NULL;
+  if (base_url && !lane)
+    return;
+
+  if (connect_ms >= 0) {
+    if (lane)
+      lane->connect_timeout_ms = connect_ms;
+    else
+      fetch_connect_timeout_ms = connect_ms;
+  }
+  if (total_ms >= 0) {
+    if (lane)
+      lane->timeout_ms = total_ms;
+    else
+      fetch_timeout_ms = total_ms;
+  }
+}
+
+void fetch_set_budget(long budget_ms) {
+  fetch_budget_ms = budget_ms > 0 ? budget_ms : 0;
+}
+
+void fetch_set_hedging(int enabled) { fetch_hedging = enabled; }
+
+void fetch_set_mirror(const char *base_url, const char *mirror_url) {
+  Lane *lane = lane_get(base_url);
+  if (lane)
+    lane->mirror = mirror_url;
+  fetch_hedging = 1;
+}
+
+void fetch_cleanup(void) {
+  if (fetch_multi) {
+    curl_multi_cleanup(fetch_multi);
+    fetch_multi = NULL;
+  }
+  for (int i = 0; i < pool_count; ++i) {
+    for (int j = 0; j < pools[i].count; ++j)
+      curl_easy_cleanup(pools[i].idle[j]);
+    pools[i].count = 0;
+  }
+  pool_count = 0;
+  if (fetch_share) {
+    curl_share_cleanup(fetch_share);
+    fetch_share = NULL;
+  }
+  fetch_active = 0;
+  fetch_held = 0;
+  fetch_wake_handler = NULL;
+  hedging = NULL;
+}
+
+void fetch_request_init(FetchRequest *req, const char *url) {
+  memset(req, 0, sizeof(*req));
+  snprintf(req->url, sizeof(req->url), "%s", url);
+  req->result = CURLE_OK;
+}
+
+void fetch_narinfo_init(FetchRequest *req, const char *base_url,
+                        const char *hash) {
+  char url[512];
+  snprintf(url, sizeof(url), "%s/%s.narinfo", base_url, hash);
+  fetch_request_init(req, url);
+  req->base_url = base_url;
+  snprintf(req->hash, sizeof(req->hash), "%s", hash);
+}
+
+static void fetch_abort(FetchRequest *req);
+
+static void fetch_complete(FetchRequest *req) {
+  FetchGroup *group = req->group;
+
+  if (group && group->policy == FETCH_RACE && !group->winner &&
+      req->result == CURLE_OK) {
+    group->winner = req;
+    for (FetchRequest *m = group->first, *next; m; m = next) {
+      next = m->group_next;
+      if (m != req && !m->done)
+        fetch_abort(m);
+    }
+  }
+
+  if (req->on_done)
+    req->on_done(req);
+}
+
+static int fetch_from_narcache(FetchRequest *req) {
+  const char *body;
+  size_t len;
+  NarcacheStatus status =
+      narcache_lookup(req->base_url, req->hash, &body, &len);
+
+  if (status == NARCACHE_MISS)
+    return -1;
+
+  init_string(&req->response, req->arena);
+  if (string_reserve(&req->response, len + 1) != 0) {
+    string_free(&req->response);
+    return -1;
+  }
+  memcpy(req->response.ptr, body, len);
+  req->response.ptr[len] = '\0';
+  req->response.len = len;
+
+  if (status == NARCACHE_HIT) {
+    req->result = CURLE_OK;
+    req->http_code = 200;
+  } else {
+    req->result = CURLE_HTTP_RETURNED_ERROR;
+    req->http_code = 404;
+  }
+  req->cached = 1;
+  req->done = 1;
+  fetch_complete(req);
+  return 0;
+}
+
+static void store_narcache(const FetchRequest *req) {
+  if (!req->base_url)
+    return;
+  if (req->head && req->result == CURLE_OK)
+    return;
+  if (req->result == CURLE_OK)
+    narcache_store(req->base_url, req->hash, req->response.ptr,
+                   req->response.len);
+  else if (req->http_code == 404 || req->http_code == 403)
+    narcache_store(req->base_url, req->hash, NULL, 0);
+}
+
+void fetch_request_free(FetchRequest *req) {
+  fetch_cancel(req);
+  string_free(&req->response);
+}
+
+static int hedge_delay(const HandlePool *pool) {
+  if (!pool || pool->latency_count < FETCH_HEDGE_MIN_SAMPLES)
+    return FETCH_HEDGE_DEFAULT_MS;
+  return pool->p95_ms > FETCH_HEDGE_FLOOR_MS ? pool->p95_ms
+                                             : FETCH_HEDGE_FLOOR_MS;
+}
+
+static void set_deadlines(FetchRequest *req, CURL *curl, const Lane *lane) {
+  long connect_ms = lane && lane->connect_timeout_ms
+                        ? lane->connect_timeout_ms
+                        : fetch_connect_timeout_ms;
+  long total_ms =
+      lane && lane->timeout_ms ? lane->timeout_ms : fetch_timeout_ms;
+
+  if (req->deadline) {
+    long long left = req->deadline - now_ms();
+    if (left < 1)
+      left = 1;
+    if (total_ms == 0 || left < total_ms)
+      total_ms = (long)left;
+    if (connect_ms == 0 || total_ms < connect_ms)
+      connect_ms = total_ms;
+  }
+
+  curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, connect_ms);
+  if (total_ms == 0)
+    return;
+  if (req->on_data) {
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, 1L);
+    curl_easy_setopt(curl, CURLOPT_LOW_SPEED_TIME,
+                     total_ms < 1000 ? 1L : total_ms / 1000);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, total_ms);
+  }
+}
+
+static int lane_free(const Lane *lane, const FetchRequest *req) {
+  int limit = lane->limit;
+  if (req->background && (limit == 0 || limit > FETCH_BACKGROUND_LANES))
+    limit = FETCH_BACKGROUND_LANES;
+  return limit == 0 || lane->active < limit;
+}
+
+static void lane_wait(Lane *lane, FetchRequest *req) {
+  FetchRequest *prev = NULL;
+  if (!req->background) {
+    for (FetchRequest *p = lane->wait_head; p && !p->background;
+         p = p->wait_next)
+      prev = p;
+  } else {
+    prev = lane->wait_tail;
+  }
+
+  req->wait_next = prev ? prev->wait_next : lane->wait_head;
+  if (prev)
+    prev->wait_next = req;
+  else
+    lane->wait_head = req;
+  if (!req->wait_next)
+    lane->wait_tail = req;
+  req->waiting = 1;
+  req->done = 0;
+  fetch_active++;
+}
+
+static int fetch_start(FetchRequest *req) {
+  HandlePool *pool = pool_for(req->url, 1);
+  if (req->base_url)
+    lane_get(req->base_url);
+  Lane *lane = lane_for(req->url);
+  if (lane && !lane_free(lane, req) && !req->hedge_of) {
+    lane_wait(lane, req);
+    return 0;
+  }
+
+  CURL *curl = pool_get(req->url);
+  if (!curl)
+    return -1;
+
+  init_string(&req->response, req->arena);
+  if (!req->response.ptr) {
+    pool_put(req->url, curl);
+    return -1;
+  }
+  req->errbuf[0] = '\0';
+  req->done = 0;
+  req->http_code = 0;
+  memset(&req->timing, 0, sizeof(req->timing));
+
+  if (req->head && pool && pool->no_head)
+    req->head = 0;
+
+  curl_easy_setopt(curl, CURLOPT_URL, req->url);
+  if (req->head)
+    curl_easy_setopt(curl, CURLOPT_NOBODY, 1L);
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, fetch_write);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, req);
+  curl_easy_setopt(curl, CURLOPT_USERAGENT, "narnia/1.0");
+  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, req->errbuf);
+  curl_easy_setopt(curl, CURLOPT_PRIVATE, req);
+  curl_easy_setopt(curl, CURLOPT_TCP_KEEPALIVE, 1L);
+  curl_easy_setopt(curl, CURLOPT_HTTP_VERSION, fetch_http_version);
+  curl_easy_setopt(curl, CURLOPT_PIPEWAIT, req->fresh_connect ? 0L : 1L);
+  curl_easy_setopt(curl, CURLOPT_STREAM_WEIGHT, req->background ? 1L : 16L);
+  if (req->fresh_connect)
+    curl_easy_setopt(curl, CURLOPT_FRESH_CONNECT, 1L);
+  set_deadlines(req, curl, lane);
+  curl_easy_setopt(curl, CURLOPT_BUFFERSIZE,
+                   req->on_data ? (long)FETCH_STREAM_BUFFER
+                                : (long)CURL_MAX_WRITE_SIZE);
+  if (req->accept_encoding)
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, req->accept_encoding);
+  if (fetch_share)
+    curl_easy_setopt(curl, CURLOPT_SHARE, fetch_share);
+
+  if (curl_multi_add_handle(fetch_multi, curl) != CURLM_OK) {
+    pool_put(req->url, curl);
+    return -1;
+  }
+
+  req->curl = curl;
+  if (lane)
+    lane->active++;
+  fetch_active++;
+
+  if (fetch_hedging && req->base_url && !req->on_data && !req->hedge_of &&
+      !req->hedge_at && !req->background) {
+    req->hedge_at = now_ms() + hedge_delay(pool);
+    req->hedge_next = hedging;
+    hedging = req;
+  }
+  return 0;
+}
+
+static void lane_release(const char *url) {
+  Lane *lane = lane_for(url);
+  if (!lane)
+    return;
+  lane->active--;
+
+  while (lane->wait_head && lane_free(lane, lane->wait_head)) {
+    FetchRequest *req = lane->wait_head;
+    lane->wait_head = req->wait_next;
+    if (!lane->wait_head)
+      lane->wait_tail = NULL;
+    req->wait_next = NULL;
+    req->waiting = 0;
+    fetch_active--;
+
+    if (fetch_start(req) != 0) {
+      req->result = CURLE_FAILED_INIT;
+      req->done = 1;
+      fetch_complete(req);
+    }
+  }
+}
+
+static int unlink_waiting(FetchRequest *req) {
+  Lane *lane = lane_for(req->url);
+  if (!req->waiting || !lane)
+    return 0;
+
+  FetchRequest *prev = NULL;
+  for (FetchRequest *p = lane->wait_head; p; prev = p, p = p->wait_next) {
+    if (p != req)
+      continue;
+    if (prev)
+      prev->wait_next = p->wait_next;
+    else
+      lane->wait_head = p->wait_next;
+    if (lane->wait_tail == p)
+      lane->wait_tail = prev;
+    break;
+  }
+  req->wait_next = NULL;
+  req->waiting = 0;
+  fetch_active--;
+  return 1;
+}
+
+static void set_budget(FetchRequest *req, long long deadline) {
+  if (!req->on_data && !req->deadline && !req->background &&
+      fetch_budget_ms > 0)
+    req->deadline = deadline ? deadline : now_ms() + fetch_budget_ms;
+}
+
+int fetch_add(FetchRequest *req) {
+  if (req->base_url && fetch_from_narcache(req) == 0)
+    return 0;
+  set_budget(req, 0);
+  return fetch_start(req);
+}
+
+void fetch_group_init(FetchGroup *group) {
+  memset(group, 0, sizeof(*group));
+  group->policy = fetch_policy;
+}
+
+int fetch_group_add(FetchGroup *group, FetchRequest *req) {
+  int index = group->count++;
+
+  req->group = group;
+  req->group_next = NULL;
+  if (group->last)
+    group->last->group_next = req;
+  else
+    group->first = req;
+  group->last = req;
+
+  if (group->winner) {
+    fetch_abort(req);
+    return 0;
+  }
+
+  if (req->base_url && fetch_from_narcache(req) == 0)
+    return 0;
+
+  set_budget(req, group->first->deadline);
+  if (group->policy == FETCH_RACE && fetch_stagger_ms > 0 && index > 0) {
+    req->start_at = now_ms() + (long long)index * fetch_stagger_ms;
+    req->delayed_next = delayed;
+    delayed = req;
+    fetch_active++;
+    return 0;
+  }
+
+  return fetch_start(req);
+}
+
+static int unlink_delayed(FetchRequest *req) {
+  for (FetchRequest **p = &delayed; *p; p = &(*p)->delayed_next) {
+    if (*p == req) {
+      *p = req->delayed_next;
+      req->delayed_next = NULL;
+      fetch_active--;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void unlink_hedging(FetchRequest *req) {
+  if (!req->hedge_at)
+    return;
+  for (FetchRequest **p = &hedging; *p; p = &(*p)->hedge_next) {
+    if (*p == req) {
+      *p = req->hedge_next;
+      break;
+    }
+  }
+  req->hedge_next = NULL;
+  req->hedge_at = 0;
+}
+
+static void fetch_detach(FetchRequest *req) {
+  if (!req->curl)
+    return;
+  curl_multi_remove_handle(fetch_multi, req->curl);
+  pool_put(req->url, req->curl);
+  req->curl = NULL;
+  fetch_active--;
+  lane_release(req->url);
+}
+
+static void hedge_drop(FetchRequest *req) {
+  FetchRequest *hedge = req->hedge;
+  if (!hedge)
+    return;
+  req->hedge = NULL;
+  req->hedge_wait = 0;
+  fetch_cancel(hedge);
+  string_free(&hedge->response);
+  free(hedge);
+}
+
+void fetch_cancel(FetchRequest *req) {
+  int hedge_wait = req->hedge_wait;
+
+  unlink_hedging(req);
+  hedge_drop(req);
+  if (!hedge_wait && !req->curl && !unlink_delayed(req) &&
+      !unlink_waiting(req))
+    return;
+  fetch_detach(req);
+  req->result = CURLE_ABORTED_BY_CALLBACK;
+  req->done = 1;
+}
+
+void fetch_promote(FetchRequest *req) {
+  if (!req->background)
+    return;
+  req->background = 0;
+  if (!unlink_waiting(req))
+    return;
+  set_budget(req, 0);
+  if (fetch_start(req) != 0) {
+    req->result = CURLE_FAILED_INIT;
+    req->done = 1;
+    fetch_complete(req);
+  }
+}
+
+static void fetch_abort(FetchRequest *req) {
+  fetch_cancel(req);
+  req->result = CURLE_ABORTED_BY_CALLBACK;
+  req->cancelled = 1;
+  req->done = 1;
+  if (req->on_done)
+    req->on_done(req);
+}
+
+static void hedge_start(FetchRequest *req) {
+  Lane *lane = lane_for(req->url);
+  FetchRequest *hedge = malloc(sizeof(*hedge));
+  if (!hedge)
+    return;
+
+  if (lane && lane->mirror) {
+    fetch_narinfo_init(hedge, lane->mirror, req->hash);
+  } else {
+    fetch_request_init(hedge, req->url);
+    hedge->fresh_connect = 1;
+  }
+  hedge->head = req->head;
+  hedge->arena = req->arena;
+  hedge->deadline = req->deadline;
+  hedge->accept_encoding = req->accept_encoding;
+  hedge->hedge_of = req;
+
+  if (fetch_start(hedge) != 0) {
+    free(hedge);
+    return;
+  }
+  req->hedge = hedge;
+}
+
+static int start_hedges(void) {
+  long long now = now_ms();
+  long long next = -1;
+
+  for (FetchRequest **p = &hedging; *p;) {
+    FetchRequest *req = *p;
+    if (req->hedge_at <= now) {
+      *p = req->hedge_next;
+      req->hedge_next = NULL;
+      req->hedge_at = 0;
+      if (req->curl && !req->hedge)
+        hedge_start(req);
+      continue;
+    }
+    if (next < 0 || req->hedge_at - now < next)
+      next = req->hedge_at - now;
+    p = &req->hedge_next;
+  }
+  return (int)next;
+}
+
+static int start_delayed(void) {
+  long long now = now_ms();
+  long long next = -1;
+
+  for (FetchRequest **p = &delayed; *p;) {
+    FetchRequest *req = *p;
+    if (req->start_at <= now) {
+      *p = req->delayed_next;
+      req->delayed_next = NULL;
+      fetch_active--;
+      if (fetch_start(req) != 0) {
+        req->result = CURLE_FAILED_INIT;
+        req->done = 1;
+        fetch_complete(req);
+      }
+      p = &delayed;
+      continue;
+    }
+    if (next < 0 || req->start_at - now < next)
+      next = req->start_at - now;
+    p = &req->delayed_next;
+  }
+  return (int)next;
+}
+
+const char *fetch_http_version_name(long version) {
+  switch (version) {
+  case CURL_HTTP_VERSION_1_0:
+    return "HTTP/1.0";
+  case CURL_HTTP_VERSION_1_1:
+    return "HTTP/1.1";
+  case CURL_HTTP_VERSION_2_0:
+    return "HTTP/2";
+  case CURL_HTTP_VERSION_3:
+    return "HTTP/3";
+  default:
+    return "";
+  }
+}
+
+static double info_ms(CURL *curl, CURLINFO info) {
+  curl_off_t us = 0;
+  if (curl_easy_getinfo(curl, info, &us) != CURLE_OK)
+    return 0;
+  return us / 1000.0;
+}
+
+static void record_timing(FetchRequest *req, CURL *curl) {
+  FetchTiming *t = &req->timing;
+
+  t->namelookup_ms = info_ms(curl, CURLINFO_NAMELOOKUP_TIME_T);
+  t->connect_ms = info_ms(curl, CURLINFO_CONNECT_TIME_T);
+  t->appconnect_ms = info_ms(curl, CURLINFO_APPCONNECT_TIME_T);
+  t->starttransfer_ms = info_ms(curl, CURLINFO_STARTTRANSFER_TIME_T);
+  t->total_ms = info_ms(curl, CURLINFO_TOTAL_TIME_T);
+  curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &t->bytes);
+  curl_easy_getinfo(curl, CURLINFO_HTTP_VERSION, &t->http_version);
+}
+
+static int head_rejected(FetchRequest *req) {
+  if (!req->head || (req->http_code != 405 && req->http_code != 501))
+    return 0;
+
+  HandlePool *pool = pool_for(req->url, 1);
+  if (pool)
+    pool->no_head = 1;
+  req->head = 0;
+  string_free(&req->response);
+  return 1;
+}
+
+static int definitive(const FetchRequest *req) {
+  return req->result == CURLE_OK || req->http_code == 404 ||
+         req->http_code == 403;
+}
+
+static int compare_int(const void *a, const void *b) {
+  return *(const int *)a - *(const int *)b;
+}
+
+static void record_latency(const FetchRequest *req) {
+  if (req->on_data || !req->timing.http_version || !definitive(req))
+    return;
+  HandlePool *pool = pool_for(req->url, 0);
+  if (!pool)
+    return;
+
+  int sorted[FETCH_LATENCY_SAMPLES];
+  pool->latencies[pool->latency_count++ % FETCH_LATENCY_SAMPLES] =
+      (int)req->timing.total_ms;
+  if (pool->latency_count < FETCH_HEDGE_MIN_SAMPLES)
+    return;
+
+  int n = pool->latency_count < FETCH_LATENCY_SAMPLES ? pool->latency_count
+                                                      : FETCH_LATENCY_SAMPLES;
+  memcpy(sorted, pool->latencies, n * sizeof(int));
+  qsort(sorted, n, sizeof(int), compare_int);
+  pool->p95_ms = sorted[(n * 95 - 1) / 100];
+}
+
+static void hedge_adopt(FetchRequest *req, FetchRequest *hedge) {
+  fetch_detach(req);
+  string_free(&req->response);
+  req->response = hedge->response;
+  memset(&hedge->response, 0, sizeof(hedge->response));
+  req->result = hedge->result;
+  req->http_code = hedge->http_code;
+  req->timing = hedge->timing;
+  memcpy(req->errbuf, hedge->errbuf, sizeof(req->errbuf));
+  req->hedged = 1;
+}
+
+static void fetch_finish(FetchRequest *req, int store) {
+  unlink_hedging(req);
+  req->hedge_wait = 0;
+  req->done = 1;
+  if (store)
+    store_narcache(req);
+  fetch_complete(req);
+}
+
+static void hedge_finished(FetchRequest *hedge) {
+  FetchRequest *req = hedge->hedge_of;
+  int adopt = definitive(hedge);
+  int mirrored = hedge->base_url != NULL;
+
+  req->hedge = NULL;
+  if (adopt && mirrored)
+    store_narcache(hedge);
+  if (adopt)
+    hedge_adopt(req, hedge);
+  string_free(&hedge->response);
+  free(hedge);
+  if (adopt || req->hedge_wait)
+    fetch_finish(req, !(adopt && mirrored));
+}
+
+static void fetch_read_messages(void) {
+  CURLMsg *msg;
+  int left;
+
+  while ((msg = curl_multi_info_read(fetch_multi, &left))) {
+    if (msg->msg != CURLMSG_DONE)
+      continue;
+
+    FetchRequest *req = NULL;
+    CURL *curl = msg->easy_handle;
+    curl_easy_getinfo(curl, CURLINFO_PRIVATE, (char **)&req);
+    req->result = msg->data.result;
+    curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &req->http_code);
+    record_timing(req, curl);
+
+    curl_multi_remove_handle(fetch_multi, curl);
+    pool_put(req->url, curl);
+    req->curl = NULL;
+    req->done = 1;
+    fetch_active--;
+    lane_release(req->url);
+    if (head_rejected(req) && fetch_start(req) == 0)
+      continue;
+    record_latency(req);
+    if (req->hedge_of) {
+      hedge_finished(req);
+      continue;
+    }
+    if (req->hedge && !definitive(req)) {
+      unlink_hedging(req);
+      req->hedge_wait = 1;
+      req->done = 0;
+      continue;
+    }
+    hedge_drop(req);
+    fetch_finish(req, 1);
+  }
+}
+
+int fetch_perform(int timeout_ms) {
+  return fetch_poll(NULL, 0, timeout_ms);
+}
+
+int fetch_poll(struct curl_waitfd *extra, unsigned int nextra,
+               int timeout_ms) {
+  int running = 0;
+  int next = start_delayed();
+  int hedge = start_hedges();
+
+  if (hedge >= 0 && (next < 0 || hedge < next))
+    next = hedge;
+  if (next >= 0 && timeout_ms > 0 && next < timeout_ms)
+    timeout_ms = next > 0 ? next : 1;
+
+  if (timeout_ms > 0 && (fetch_active > 0 || fetch_held > 0 || nextra > 0))
+    curl_multi_poll(fetch_multi, extra, nextra, timeout_ms, NULL);
+
+  start_delayed();
+  start_hedges();
+  curl_multi_perform(fetch_multi, &running);
+  fetch_read_messages();
+  if (fetch_wake_handler)
+    fetch_wake_handler();
+  return fetch_active + fetch_held;
+}
+
+void fetch_hold(int delta) { fetch_held += delta; }
+
+void fetch_set_wakeup(void (*handler)(void)) { fetch_wake_handler = handler; }
+
+void fetch_wakeup(void) {
+  if (fetch_multi)
+    curl_multi_wakeup(fetch_multi);
+}
+
+void fetch_wait_all(void) {
+  while (fetch_perform(1000) > 0)
+    ;
+}
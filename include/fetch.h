@@ -0,0 +1,111 @@
+#ifndef FETCH_H
+#define FETCH_H
+
+#include "arena.h"
+#include "store.h"
+#include <curl/curl.h>
+#include <stddef.h>
+
+#define FETCH_CONNECT_TIMEOUT_MS 10000
+#define FETCH_TIMEOUT_MS 30000
+#define FETCH_BACKGROUND_LANES 2
+
+struct string {
+  char *ptr;
+  size_t len;
+  size_t cap;
+  Arena *arena;
+};
+
+typedef struct FetchRequest FetchRequest;
+
+typedef struct {
+  double namelookup_ms;
+  double connect_ms;
+  double appconnect_ms;
+  double starttransfer_ms;
+  double total_ms;
+  curl_off_t bytes;
+  long http_version;
+} FetchTiming;
+
+typedef enum { FETCH_ALL, FETCH_RACE } FetchPolicy;
+
+typedef struct {
+  FetchPolicy policy;
+  int count;
+  FetchRequest *first;
+  FetchRequest *last;
+  FetchRequest *winner;
+} FetchGroup;
+
+struct FetchRequest {
+  char url[512];
+  struct string response;
+  char errbuf[CURL_ERROR_SIZE];
+  CURLcode result;
+  long http_code;
+  FetchTiming timing;
+  int done;
+  int cached;
+  int cancelled;
+  int head;
+  int hedged;
+  int background;
+  const char *base_url;
+  char hash[HASH_LEN + 1];
+  Arena *arena;
+  CURL *curl;
+  FetchGroup *group;
+  FetchRequest *group_next;
+  FetchRequest *delayed_next;
+  FetchRequest *wait_next;
+  int waiting;
+  long long start_at;
+  long long deadline;
+  long long hedge_at;
+  FetchRequest *hedge;
+  FetchRequest *hedge_of;
+  FetchRequest *hedge_next;
+  int hedge_wait;
+  int fresh_connect;
+  const char *accept_encoding;
+  size_t (*on_data)(FetchRequest *req, const char *data, size_t len);
+  void (*on_done)(FetchRequest *req);
+  void *data;
+};
+
+void init_string(struct string *s, Arena *arena);
+int string_reserve(struct string *s, size_t cap);
+void string_free(struct string *s);
+size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s);
+
+int fetch_init(void);
+void fetch_cleanup(void);
+void fetch_set_policy(FetchPolicy policy, int stagger_ms);
+void fetch_set_limit(const char *base_url, int max_active);
+void fetch_set_http_version(long version);
+void fetch_set_timeouts(const char *base_url, long connect_ms, long total_ms);
+void fetch_set_budget(long budget_ms);
+void fetch_set_hedging(int enabled);
+void fetch_set_mirror(const char *base_url, const char *mirror_url);
+
+const char *fetch_http_version_name(long version);
+
+void fetch_request_init(FetchRequest *req, const char *url);
+void fetch_narinfo_init(FetchRequest *req, const char *base_url,
+                        const char *hash);
+void fetch_request_free(FetchRequest *req);
+int fetch_add(FetchRequest *req);
+void fetch_group_init(FetchGroup *group);
+int fetch_group_add(FetchGroup *group, FetchRequest *req);
+void fetch_cancel(FetchRequest *req);
+void fetch_promote(FetchRequest *req);
+int fetch_perform(int timeout_ms);
+int fetch_poll(struct curl_waitfd *extra, unsigned int nextra, int timeout_ms);
+void fetch_wait_all(void);
+void fetch_hold(int delta);
+void fetch_set_wakeup(void (*handler)(void));
+void fetch_wakeup(void);
+
+#endif
@@ -0,0 +1,128 @@
+#include "localstore.h"
+#include "store.h"
+#include <ctype.h>
+#include <limits.h>
+#include <sqlite3.h>
+#include <stdio.h>
+#include <string.h>
+
+static sqlite3 *db = NULL;
+static sqlite3_stmt *closure_stmt = NULL;
+static char error[256];
+
+static const char closure_sql[] =
+    "WITH RECURSIVE closure(id) AS ("
+    "  SELECT id FROM ValidPaths WHERE path > ?1 AND path < ?2"
+    "  UNION"
+    "  SELECT Refs.reference FROM Refs JOIN closure"
+    "    ON Refs.referrer = closure.id"
+    ") "
+    "SELECT ValidPaths.path, ValidPaths.narSize,"
+    "  (SELECT count(*) FROM Refs WHERE Refs.referrer = ValidPaths.id) "
+    "FROM closure JOIN ValidPaths ON ValidPaths.id = closure.id";
+
+static int set_error(const char *what) {
+  snprintf(error, sizeof(error), "%s: %s", what,
+           db ? sqlite3_errmsg(db) : "out of memory");
+  return -1;
+}
+
+static int open_uri(const char *db_path, const char *params) {
+  static const char hex[] = "0123456789ABCDEF";
+  char uri[3 * PATH_MAX + 64];
+  size_t n = 0;
+
+  if (strlen(db_path) >= PATH_MAX) {
+    snprintf(error, sizeof(error), "%.200s...: path too long", db_path);
+    return -1;
+  }
+  n += snprintf(uri, sizeof(uri), "file:");
+  for (const unsigned char *p = (const unsigned char *)db_path; *p; ++p) {
+    if (isalnum(*p) || strchr("/-._~", *p)) {
+      uri[n++] = *p;
+    } else {
+      uri[n++] = '%';
+      uri[n++] = hex[*p >> 4];
+      uri[n++] = hex[*p & 15];
+    }
+  }
+  snprintf(uri + n, sizeof(uri) - n, "?%s", params);
+
+  int rc = sqlite3_open_v2(uri, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_URI,
+                           NULL);
+  if (rc == SQLITE_OK)
+    rc = sqlite3_prepare_v2(db, closure_sql, -1, &closure_stmt, NULL);
+  if (rc == SQLITE_OK)
+    return 0;
+
+  set_error(db_path);
+  localstore_close();
+  return -1;
+}
+
+int localstore_open(const char *db_path) {
+  if (!db_path)
+    db_path = LOCALSTORE_DEFAULT_DB;
+  localstore_close();
+
+  if (open_uri(db_path, "mode=ro") == 0)
+    return 0;
+  return open_uri(db_path, "immutable=1");
+}
+
+void localstore_close(void) {
+  sqlite3_finalize(closure_stmt);
+  sqlite3_close(db);
+  closure_stmt = NULL;
+  db = NULL;
+}
+
+const char *localstore_error(void) { return error; }
+
+int localstore_closure(const char *path, LocalStoreVisit visit, void *data) {
+  char lower[4096];
+  char upper[4096];
+  const char *hash = store_path_hash(path);
+
+  if (!db) {
+    snprintf(error, sizeof(error), "local store is not open");
+    return -1;
+  }
+
+  if (hash) {
+    snprintf(lower, sizeof(lower), "%.*s-", (int)(hash - path + HASH_LEN),
+             path);
+  } else if (is_store_hash(path, strlen(path))) {
+    snprintf(lower, sizeof(lower), "%s/%s-", DEFAULT_STORE_DIR, path);
+  } else {
+    snprintf(error, sizeof(error), "%s is not a store path", path);
+    return -1;
+  }
+  snprintf(upper, sizeof(upper), "%s", lower);
+  upper[strlen(upper) - 1] = '.';
+
+  sqlite3_reset(closure_stmt);
+  sqlite3_bind_text(closure_stmt, 1, lower, -1, SQLITE_STATIC);
+  sqlite3_bind_text(closure_stmt, 2, upper, -1, SQLITE_STATIC);
+
+  int count = 0;
+  int rc;
+  while ((rc = sqlite3_step(closure_stmt)) == SQLITE_ROW) {
+    const char *store_path = (const char *)sqlite3_column_text(closure_stmt, 0);
+    if (!store_path)
+      continue;
+    visit(store_path, (uint64_t)sqlite3_column_int64(closure_stmt, 1),
+          sqlite3_column_int(closure_stmt, 2), data);
+    count++;
+  }
+  sqlite3_reset(closure_stmt);
+
+  if (rc != SQLITE_DONE)
+    return set_error("query");
+  if (count == 0) {
+    snprintf(error, sizeof(error), "%s is not registered in the local store",
+             path);
+    return -1;
+  }
+  return count;
+}
@@ -0,0 +1,16 @@
+#ifndef LOCALSTORE_H
+#define LOCALSTORE_H
+
+#include <stdint.h>
+
+#define LOCALSTORE_DEFAULT_DB "/nix/var/nix/db/db.sqlite"
+
+typedef void (*LocalStoreVisit)(const char *path, uint64_t nar_size,
+                                int reference_count, void *data);
+
+int localstore_open(const char *db_path);
+void localstore_close(void);
+const char *localstore_error(void);
+int localstore_closure(const char *path, LocalStoreVisit visit, void *data);
+
+#endif
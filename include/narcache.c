@@ -0,0 +1,473 @@
+#include "narcache.h"
+#include "store.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NARCACHE_MAGIC "NRNC"
+#define NARCACHE_VERSION 1
+
+enum {
+  SLOT_EMPTY = 0,
+  SLOT_POSITIVE = 1,
+  SLOT_NEGATIVE = 2,
+};
+
+typedef struct {
+  char magic[4];
+  uint32_t version;
+  uint32_t slot_count;
+  uint32_t entry_count;
+  uint64_t data_size;
+} NarcacheHeader;
+
+typedef struct {
+  uint64_t key;
+  uint32_t offset;
+  uint32_t length;
+  int64_t stored;
+  uint32_t flags;
+  uint32_t pad;
+} NarcacheSlot;
+
+typedef struct {
+  uint64_t key;
+  const char *url;
+  const char *hash;
+  const char *body;
+  size_t len;
+  int64_t stored;
+  uint32_t flags;
+} NarcacheEntry;
+
+typedef struct {
+  void *base;
+  size_t size;
+  const NarcacheHeader *header;
+  const NarcacheSlot *slots;
+  const char *data;
+} NarcacheMap;
+
+static char narcache_path[PATH_MAX];
+static NarcacheMap narcache_map;
+static NarcacheEntry *pending = NULL;
+static size_t pending_count = 0;
+static size_t pending_cap = 0;
+static uint32_t *pending_index = NULL;
+static uint32_t pending_slots = 0;
+static long positive_ttl = NARCACHE_POSITIVE_TTL;
+static long negative_ttl = NARCACHE_NEGATIVE_TTL;
+static int refresh_only = 0;
+static int narcache_enabled = 0;
+
+static uint64_t narcache_key(const char *url, const char *hash) {
+  uint64_t h = 14695981039346656037ULL;
+  for (const char *p = url; *p; ++p)
+    h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+  h = (h ^ 0) * 1099511628211ULL;
+  for (const char *p = hash; *p; ++p)
+    h = (h ^ (unsigned char)*p) * 1099511628211ULL;
+  return h;
+}
+
+static int map_file(const char *path, NarcacheMap *map) {
+  memset(map, 0, sizeof(*map));
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(NarcacheHeader)) {
+    close(fd);
+    return -1;
+  }
+
+  void *base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return -1;
+
+  const NarcacheHeader *hdr = base;
+  size_t table = (size_t)hdr->slot_count * sizeof(NarcacheSlot);
+  if (memcmp(hdr->magic, NARCACHE_MAGIC, 4) != 0 ||
+      hdr->version != NARCACHE_VERSION || hdr->slot_count == 0 ||
+      (hdr->slot_count & (hdr->slot_count - 1)) != 0 ||
+      sizeof(*hdr) + table + hdr->data_size > (size_t)st.st_size) {
+    munmap(base, st.st_size);
+    return -1;
+  }
+
+  map->base = base;
+  map->size = st.st_size;
+  map->header = hdr;
+  map->slots = (const NarcacheSlot *)(hdr + 1);
+  map->data = (const char *)(map->slots + hdr->slot_count);
+  return 0;
+}
+
+static void unmap_file(NarcacheMap *map) {
+  if (map->base)
+    munmap(map->base, map->size);
+  memset(map, 0, sizeof(*map));
+}
+
+static int slot_entry(const NarcacheMap *map, const NarcacheSlot *slot,
+                      NarcacheEntry *out) {
+  if ((uint64_t)slot->offset + slot->length > map->header->data_size)
+    return -1;
+
+  const char *rec = map->data + slot->offset;
+  const char *end = rec + slot->length;
+  const char *url_end = memchr(rec, '\0', slot->length);
+  if (!url_end || end - (url_end + 1) < HASH_LEN + 1 ||
+      url_end[1 + HASH_LEN] != '\0')
+    return -1;
+
+  out->key = slot->key;
+  out->url = rec;
+  out->hash = url_end + 1;
+  out->body = url_end + 2 + HASH_LEN;
+  out->len = end - out->body;
+  out->stored = slot->stored;
+  out->flags = slot->flags;
+  return 0;
+}
+
+static int same_entry(const NarcacheEntry *a, const NarcacheEntry *b) {
+  return a->key == b->key && strcmp(a->url, b->url) == 0 &&
+         strncmp(a->hash, b->hash, HASH_LEN) == 0;
+}
+
+static int entry_expired(const NarcacheEntry *e, int64_t now) {
+  long ttl = e->flags == SLOT_NEGATIVE ? negative_ttl : positive_ttl;
+  return now - e->stored > ttl;
+}
+
+int narcache_file_path(const char *name, char *out, size_t outlen) {
+  const char *xdg = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+
+  if (xdg && *xdg)
+    snprintf(out, outlen, "%s/narnia/%s", xdg, name);
+  else if (home && *home)
+    snprintf(out, outlen, "%s/.cache/narnia/%s", home, name);
+  else
+    out[0] = '\0';
+  return out[0] ? 0 : -1;
+}
+
+void narcache_make_parents(const char *path) {
+  char tmp[PATH_MAX];
+  snprintf(tmp, sizeof(tmp), "%s", path);
+  for (char *p = tmp + 1; *p; ++p) {
+    if (*p == '/') {
+      *p = '\0';
+      mkdir(tmp, 0755);
+      *p = '/';
+    }
+  }
+}
+
+int narcache_open(const char *path) {
+  if (path)
+    snprintf(narcache_path, sizeof(narcache_path), "%s", path);
+  else
+    narcache_file_path("narinfo.cache", narcache_path, sizeof(narcache_path));
+
+  if (!narcache_path[0])
+    return -1;
+
+  narcache_enabled = 1;
+  map_file(narcache_path, &narcache_map);
+  return 0;
+}
+
+void narcache_set_ttl(long positive, long negative) {
+  if (positive >= 0)
+    positive_ttl = positive;
+  if (negative >= 0)
+    negative_ttl = negative;
+}
+
+void narcache_set_refresh(int refresh) { refresh_only = refresh; }
+
+static void pending_insert(uint32_t n) {
+  uint32_t mask = pending_slots - 1;
+  uint32_t i = pending[n].key & mask;
+
+  while (pending_index[i] && !same_entry(&pending[pending_index[i] - 1],
+                                         &pending[n]))
+    i = (i + 1) & mask;
+  pending_index[i] = n + 1;
+}
+
+static int pending_reindex(void) {
+  uint32_t slots = pending_slots ? pending_slots : 128;
+  while (slots < pending_count * 2)
+    slots *= 2;
+  if (slots == pending_slots)
+    return 0;
+
+  uint32_t *index = calloc(slots, sizeof(*index));
+  if (!index)
+    return -1;
+  free(pending_index);
+  pending_index = index;
+  pending_slots = slots;
+  for (size_t n = 0; n + 1 < pending_count; ++n)
+    pending_insert(n);
+  return 0;
+}
+
+static const NarcacheEntry *pending_find(uint64_t key, const char *cache_url,
+                                         const char *hash) {
+  if (!pending_slots)
+    return NULL;
+
+  uint32_t mask = pending_slots - 1;
+  for (uint32_t i = key & mask; pending_index[i]; i = (i + 1) & mask) {
+    const NarcacheEntry *e = &pending[pending_index[i] - 1];
+    if (e->key == key && strcmp(e->url, cache_url) == 0 &&
+        strncmp(e->hash, hash, HASH_LEN) == 0)
+      return e;
+  }
+  return NULL;
+}
+
+NarcacheStatus narcache_lookup(const char *cache_url, const char *hash,
+                               const char **body, size_t *len) {
+  if (!narcache_enabled || refresh_only)
+    return NARCACHE_MISS;
+
+  uint64_t key = narcache_key(cache_url, hash);
+  int64_t now = time(NULL);
+
+  const NarcacheEntry *recent = pending_find(key, cache_url, hash);
+  if (recent) {
+    if (entry_expired(recent, now))
+      return NARCACHE_MISS;
+    *body = recent->body;
+    *len = recent->len;
+    return recent->flags == SLOT_NEGATIVE ? NARCACHE_NEGATIVE : NARCACHE_HIT;
+  }
+  if (!narcache_map.base)
+    return NARCACHE_MISS;
+
+  uint32_t mask = narcache_map.header->slot_count - 1;
+
+  for (uint32_t n = 0, i = key & mask; n <= mask; ++n, i = (i + 1) & mask) {
+    const NarcacheSlot *slot = &narcache_map.slots[i];
+    if (slot->flags == SLOT_EMPTY)
+      return NARCACHE_MISS;
+    if (slot->key != key)
+      continue;
+
+    NarcacheEntry e;
+    if (slot_entry(&narcache_map, slot, &e) != 0 ||
+        strcmp(e.url, cache_url) != 0 || strncmp(e.hash, hash, HASH_LEN) != 0)
+      continue;
+    if (entry_expired(&e, now))
+      return NARCACHE_MISS;
+
+    *body = e.body;
+    *len = e.len;
+    return e.flags == SLOT_NEGATIVE ? NARCACHE_NEGATIVE : NARCACHE_HIT;
+  }
+  return NARCACHE_MISS;
+}
+
+void narcache_store(const char *cache_url, const char *hash, const char *body,
+                    size_t len) {
+  if (!narcache_enabled)
+    return;
+
+  if (pending_count == pending_cap) {
+    size_t cap = pending_cap ? pending_cap * 2 : 64;
+    NarcacheEntry *p = realloc(pending, cap * sizeof(*p));
+    if (!p)
+      return;
+    pending = p;
+    pending_cap = cap;
+  }
+
+  char *url = strdup(cache_url);
+  char *copy = malloc(len + 1);
+  if (!url || !copy) {
+    free(url);
+    free(copy);
+    return;
+  }
+  if (body)
+    memcpy(copy, body, len);
+  copy[body ? len : 0] = '\0';
+
+  NarcacheEntry *e = &pending[pending_count++];
+  e->url = url;
+  e->hash = strndup(hash, HASH_LEN);
+  e->body = copy;
+  e->len = body ? len : 0;
+  e->stored = time(NULL);
+  e->flags = body ? SLOT_POSITIVE : SLOT_NEGATIVE;
+  e->key = narcache_key(cache_url, hash);
+  if (!e->hash || pending_reindex() != 0) {
+    free(url);
+    free((char *)e->hash);
+    free(copy);
+    pending_count--;
+    return;
+  }
+  pending_insert(pending_count - 1);
+}
+
+static int narcache_write(const NarcacheEntry *entries, size_t count) {
+  uint32_t slot_count = 64;
+  while (slot_count < count * 2)
+    slot_count *= 2;
+
+  uint32_t *index = malloc(slot_count * sizeof(*index));
+  NarcacheSlot *slots = calloc(slot_count, sizeof(*slots));
+  if (!index || !slots) {
+    free(index);
+    free(slots);
+    return -1;
+  }
+  memset(index, 0xff, slot_count * sizeof(*index));
+
+  for (size_t n = 0; n < count; ++n) {
+    uint32_t i = entries[n].key & (slot_count - 1);
+    while (index[i] != UINT32_MAX &&
+           !same_entry(&entries[index[i]], &entries[n]))
+      i = (i + 1) & (slot_count - 1);
+    index[i] = n;
+  }
+
+  char tmp[PATH_MAX + 16];
+  snprintf(tmp, sizeof(tmp), "%s.%d", narcache_path, (int)getpid());
+  narcache_make_parents(narcache_path);
+  FILE *f = fopen(tmp, "wb");
+  if (!f) {
+    free(index);
+    free(slots);
+    return -1;
+  }
+
+  NarcacheHeader hdr = {{'N', 'R', 'N', 'C'}, NARCACHE_VERSION, slot_count, 0,
+                        0};
+  uint64_t offset = 0;
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    if (index[i] == UINT32_MAX)
+      continue;
+    const NarcacheEntry *e = &entries[index[i]];
+    slots[i].key = e->key;
+    slots[i].offset = offset;
+    slots[i].length = strlen(e->url) + 1 + HASH_LEN + 1 + e->len;
+    slots[i].stored = e->stored;
+    slots[i].flags = e->flags;
+    offset += slots[i].length;
+    hdr.entry_count++;
+  }
+  hdr.data_size = offset;
+
+  fwrite(&hdr, sizeof(hdr), 1, f);
+  fwrite(slots, sizeof(*slots), slot_count, f);
+  for (uint32_t i = 0; i < slot_count; ++i) {
+    if (index[i] == UINT32_MAX)
+      continue;
+    const NarcacheEntry *e = &entries[index[i]];
+    fwrite(e->url, 1, strlen(e->url) + 1, f);
+    fwrite(e->hash, 1, HASH_LEN, f);
+    fputc('\0', f);
+    fwrite(e->body, 1, e->len, f);
+  }
+
+  free(index);
+  free(slots);
+
+  int failed = ferror(f);
+  if (fclose(f) != 0 || failed || rename(tmp, narcache_path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static int narcache_flush(void) {
+  if (pending_count == 0)
+    return 0;
+
+  NarcacheMap current;
+  int have_current = map_file(narcache_path, &current) == 0;
+  size_t existing = have_current ? current.header->slot_count : 0;
+
+  NarcacheEntry *entries =
+      malloc((existing + pending_count) * sizeof(*entries));
+  if (!entries) {
+    if (have_current)
+      unmap_file(&current);
+    return -1;
+  }
+
+  size_t count = 0;
+  int64_t now = time(NULL);
+  for (size_t i = 0; i < existing; ++i) {
+    if (current.slots[i].flags == SLOT_EMPTY)
+      continue;
+    if (slot_entry(&current, &current.slots[i], &entries[count]) == 0 &&
+        !entry_expired(&entries[count], now))
+      count++;
+  }
+  memcpy(entries + count, pending, pending_count * sizeof(*entries));
+  count += pending_count;
+
+  int rc = narcache_write(entries, count);
+
+  free(entries);
+  if (have_current)
+    unmap_file(&current);
+  return rc;
+}
+
+static void pending_free(void) {
+  for (size_t i = 0; i < pending_count; ++i) {
+    free((char *)pending[i].url);
+    free((char *)pending[i].hash);
+    free((char *)pending[i].body);
+  }
+  free(pending);
+  free(pending_index);
+  pending = NULL;
+  pending_index = NULL;
+  pending_count = pending_cap = 0;
+  pending_slots = 0;
+}
+
+size_t narcache_pending(void) { return pending_count; }
+
+int narcache_sync(void) {
+  if (!narcache_enabled || pending_count == 0)
+    return 0;
+  if (narcache_flush() != 0)
+    return -1;
+
+  unmap_file(&narcache_map);
+  map_file(narcache_path, &narcache_map);
+  pending_free();
+  return 0;
+}
+
+void narcache_close(void) {
+  if (narcache_enabled)
+    narcache_flush();
+
+  unmap_file(&narcache_map);
+  pending_free();
+  narcache_enabled = 0;
+}
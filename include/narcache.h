@@ -0,0 +1,30 @@
+#ifndef NARCACHE_H
+#define NARCACHE_H
+
+#include <stddef.h>
+
+#define NARCACHE_POSITIVE_TTL (30 * 24 * 3600)
+#define NARCACHE_NEGATIVE_TTL 3600
+
+typedef enum {
+  NARCACHE_MISS,
+  NARCACHE_HIT,
+  NARCACHE_NEGATIVE,
+} NarcacheStatus;
+
+int narcache_file_path(const char *name, char *out, size_t outlen);
+void narcache_make_parents(const char *path);
+
+int narcache_open(const char *path);
+void narcache_close(void);
+void narcache_set_ttl(long positive, long negative);
+void narcache_set_refresh(int refresh);
+
+NarcacheStatus narcache_lookup(const char *cache_url, const char *hash,
+                               const char **body, size_t *len);
+void narcache_store(const char *cache_url, const char *hash, const char *body,
+                    size_t len);
+size_t narcache_pending(void);
+int narcache_sync(void);
+
+#endif
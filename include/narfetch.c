@@ -0,0 +1,543 @@
+#include "narfetch.h"
+#include "fetch.h"
+#include "narinfo.h"
+#include <bzlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <lzma.h>
+#include <openssl/evp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define NARFETCH_CHUNK (256 * 1024)
+#define SHA256_LEN 32
+
+typedef enum {
+  CODEC_NONE,
+  CODEC_XZ,
+  CODEC_BZIP2,
+  CODEC_ZSTD,
+  CODEC_UNSUPPORTED,
+} Codec;
+
+typedef enum {
+  NAR_OK,
+  NAR_FETCH_FAILED,
+  NAR_UNSUPPORTED,
+  NAR_CORRUPT,
+  NAR_FILE_MISMATCH,
+  NAR_NAR_MISMATCH,
+  NAR_UNVERIFIED,
+  NAR_WRITE_FAILED,
+} NarStatus;
+
+typedef struct {
+  int cache;
+  FetchRequest info_req;
+  FetchRequest req;
+  Narinfo info;
+  int parsed;
+  int active;
+  Codec codec;
+  lzma_stream xz;
+  bz_stream bz;
+#ifdef HAVE_ZSTD
+  ZSTD_DStream *zstd;
+  size_t zstd_left;
+#endif
+  int ended;
+  EVP_MD_CTX *file_ctx;
+  EVP_MD_CTX *nar_ctx;
+  unsigned char *out;
+  uint64_t file_bytes;
+  uint64_t nar_bytes;
+  int fd;
+  NarStatus status;
+  double started;
+  double seconds;
+} NarSlot;
+
+static const char nix_base32_chars[] = "0123456789abcdfghijklmnpqrsvwxyz";
+
+static FILE *nar_out = NULL;
+static char *const *nar_urls = NULL;
+static OutputFormat nar_format = OUTPUT_JSON;
+static int nar_pending = 0;
+
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  return -1;
+}
+
+static int parse_sha256(StrView v, unsigned char out[SHA256_LEN]) {
+  if (v.len < 7 || memcmp(v.ptr, "sha256:", 7) != 0)
+    return -1;
+  const char *s = v.ptr + 7;
+  size_t len = v.len - 7;
+
+  memset(out, 0, SHA256_LEN);
+  if (len == SHA256_LEN * 2) {
+    for (size_t i = 0; i < SHA256_LEN; ++i) {
+      int hi = hex_value(s[2 * i]), lo = hex_value(s[2 * i + 1]);
+      if (hi < 0 || lo < 0)
+        return -1;
+      out[i] = hi << 4 | lo;
+    }
+    return 0;
+  }
+
+  if (len != (SHA256_LEN * 8 + 4) / 5)
+    return -1;
+  for (size_t n = 0; n < len; ++n) {
+    const char *c = memchr(nix_base32_chars, s[len - n - 1], 32);
+    if (!c)
+      return -1;
+    unsigned digit = c - nix_base32_chars;
+    size_t b = n * 5, i = b / 8, j = b % 8;
+    out[i] |= digit << j;
+    if (i + 1 < SHA256_LEN)
+      out[i + 1] |= digit >> (8 - j);
+    else if (digit >> (8 - j))
+      return -1;
+  }
+  return 0;
+}
+
+static NarStatus check_digest(EVP_MD_CTX *ctx, StrView expected,
+                              NarStatus mismatch) {
+  unsigned char want[SHA256_LEN];
+  unsigned char got[EVP_MAX_MD_SIZE];
+  unsigned int len = 0;
+
+  EVP_DigestFinal_ex(ctx, got, &len);
+  if (parse_sha256(expected, want) != 0)
+    return NAR_UNVERIFIED;
+  if (len != SHA256_LEN || memcmp(want, got, SHA256_LEN) != 0)
+    return mismatch;
+  return NAR_OK;
+}
+
+static Codec codec_for(StrView compression) {
+  if (compression.len == 0 || strview_eq(compression, "none"))
+    return CODEC_NONE;
+  if (strview_eq(compression, "xz"))
+    return CODEC_XZ;
+  if (strview_eq(compression, "bzip2"))
+    return CODEC_BZIP2;
+#ifdef HAVE_ZSTD
+  if (strview_eq(compression, "zstd"))
+    return CODEC_ZSTD;
+#endif
+  return CODEC_UNSUPPORTED;
+}
+
+static int codec_init(NarSlot *slot) {
+  switch (slot->codec) {
+  case CODEC_XZ:
+    memset(&slot->xz, 0, sizeof(slot->xz));
+    return lzma_stream_decoder(&slot->xz, UINT64_MAX, LZMA_CONCATENATED) ==
+                   LZMA_OK
+               ? 0
+               : -1;
+  case CODEC_BZIP2:
+    memset(&slot->bz, 0, sizeof(slot->bz));
+    return BZ2_bzDecompressInit(&slot->bz, 0, 0) == BZ_OK ? 0 : -1;
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    slot->zstd = ZSTD_createDStream();
+    return slot->zstd ? 0 : -1;
+#endif
+  default:
+    return 0;
+  }
+}
+
+static void codec_end(NarSlot *slot) {
+  switch (slot->codec) {
+  case CODEC_XZ:
+    lzma_end(&slot->xz);
+    break;
+  case CODEC_BZIP2:
+    BZ2_bzDecompressEnd(&slot->bz);
+    break;
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    ZSTD_freeDStream(slot->zstd);
+    slot->zstd = NULL;
+    break;
+#endif
+  default:
+    break;
+  }
+}
+
+static int nar_consume(NarSlot *slot, const unsigned char *data, size_t len) {
+  EVP_DigestUpdate(slot->nar_ctx, data, len);
+  slot->nar_bytes += len;
+
+  while (slot->fd >= 0 && len > 0) {
+    ssize_t n = write(slot->fd, data, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      slot->status = NAR_WRITE_FAILED;
+      return -1;
+    }
+    data += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int decompress_xz(NarSlot *slot, const unsigned char *in, size_t len,
+                         int finish) {
+  lzma_stream *s = &slot->xz;
+  s->next_in = in;
+  s->avail_in = len;
+
+  do {
+    s->next_out = slot->out;
+    s->avail_out = NARFETCH_CHUNK;
+    lzma_ret ret = lzma_code(s, finish ? LZMA_FINISH : LZMA_RUN);
+    if (nar_consume(slot, slot->out, NARFETCH_CHUNK - s->avail_out) != 0)
+      return -1;
+    if (ret == LZMA_STREAM_END) {
+      slot->ended = 1;
+      return 0;
+    }
+    if (ret != LZMA_OK)
+      break;
+    if (finish && s->avail_out > 0)
+      break;
+  } while (s->avail_in > 0 || s->avail_out == 0);
+
+  if (!finish && s->avail_in == 0)
+    return 0;
+  slot->status = NAR_CORRUPT;
+  return -1;
+}
+
+static int decompress_bzip2(NarSlot *slot, const unsigned char *in,
+                            size_t len) {
+  bz_stream *s = &slot->bz;
+  s->next_in = (char *)in;
+  s->avail_in = len;
+
+  while (!slot->ended && (s->avail_in > 0 || len == 0)) {
+    s->next_out = (char *)slot->out;
+    s->avail_out = NARFETCH_CHUNK;
+    int ret = BZ2_bzDecompress(s);
+    if (ret != BZ_OK && ret != BZ_STREAM_END) {
+      slot->status = NAR_CORRUPT;
+      return -1;
+    }
+    if (nar_consume(slot, slot->out, NARFETCH_CHUNK - s->avail_out) != 0)
+      return -1;
+    if (ret == BZ_STREAM_END)
+      slot->ended = 1;
+    else if (len == 0 && s->avail_out > 0)
+      break;
+  }
+  return 0;
+}
+
+#ifdef HAVE_ZSTD
+static int decompress_zstd(NarSlot *slot, const unsigned char *in,
+                           size_t len) {
+  ZSTD_inBuffer input = {in, len, 0};
+
+  while (1) {
+    ZSTD_outBuffer output = {slot->out, NARFETCH_CHUNK, 0};
+    size_t ret = ZSTD_decompressStream(slot->zstd, &output, &input);
+    if (ZSTD_isError(ret)) {
+      slot->status = NAR_CORRUPT;
+      return -1;
+    }
+    slot->zstd_left = ret;
+    if (nar_consume(slot, slot->out, output.pos) != 0)
+      return -1;
+    if (input.pos == input.size && output.pos < output.size)
+      return 0;
+  }
+}
+#endif
+
+static int decompress(NarSlot *slot, const unsigned char *in, size_t len,
+                      int finish) {
+  switch (slot->codec) {
+  case CODEC_NONE:
+    slot->ended = finish;
+    return len ? nar_consume(slot, in, len) : 0;
+  case CODEC_XZ:
+    return decompress_xz(slot, in, len, finish);
+  case CODEC_BZIP2:
+    return decompress_bzip2(slot, in, len);
+#ifdef HAVE_ZSTD
+  case CODEC_ZSTD:
+    if (decompress_zstd(slot, in, len) != 0)
+      return -1;
+    slot->ended = finish && slot->zstd_left == 0;
+    return 0;
+#endif
+  default:
+    return 0;
+  }
+}
+
+static size_t nar_data(FetchRequest *req, const char *data, size_t len) {
+  NarSlot *slot = req->data;
+
+  EVP_DigestUpdate(slot->file_ctx, data, len);
+  slot->file_bytes += len;
+  if (decompress(slot, (const unsigned char *)data, len, 0) != 0)
+    return 0;
+  return len;
+}
+
+static const char *status_name(NarStatus status) {
+  switch (status) {
+  case NAR_OK:
+    return "ok";
+  case NAR_FETCH_FAILED:
+    return "error";
+  case NAR_UNSUPPORTED:
+    return "unsupported";
+  case NAR_CORRUPT:
+    return "corrupt";
+  case NAR_FILE_MISMATCH:
+    return "file_hash_mismatch";
+  case NAR_NAR_MISMATCH:
+    return "nar_hash_mismatch";
+  case NAR_UNVERIFIED:
+    return "unverified";
+  case NAR_WRITE_FAILED:
+    return "write_failed";
+  }
+  return "";
+}
+
+static void write_nar_record(const NarSlot *slot) {
+  FILE *out = nar_out;
+  int cache = slot->cache;
+  const FetchRequest *req = &slot->req;
+  double mbps =
+      slot->seconds > 0 ? slot->file_bytes / 1e6 / slot->seconds : 0.0;
+  const char *error = slot->status == NAR_FETCH_FAILED
+                          ? (req->errbuf[0] ? req->errbuf
+                                            : curl_easy_strerror(req->result))
+                          : "";
+  StrView store_path = slot->info.store_path;
+  StrView compression = slot->info.compression;
+
+  if (nar_format == OUTPUT_TSV) {
+    fprintf(out, "%.*s\t%s\t%s\t%.*s\t%llu\t%llu\t%.3f\t%.2f\t%s\n",
+            (int)store_path.len, store_path.ptr, nar_urls[cache],
+            status_name(slot->status), (int)compression.len, compression.ptr,
+            (unsigned long long)slot->file_bytes,
+            (unsigned long long)slot->nar_bytes, slot->seconds, mbps, error);
+    return;
+  }
+
+  fputs("{\"path\":", out);
+  json_write_string(out, store_path.ptr, store_path.len);
+  fputs(",\"cache\":", out);
+  json_write_string(out, nar_urls[cache], strlen(nar_urls[cache]));
+  fprintf(out, ",\"status\":\"%s\",\"compression\":",
+          status_name(slot->status));
+  json_write_string(out, compression.ptr, compression.len);
+  fprintf(out,
+          ",\"file_size\":%llu,\"nar_size\":%llu,\"seconds\":%.3f,"
+          "\"mb_per_s\":%.2f",
+          (unsigned long long)slot->file_bytes,
+          (unsigned long long)slot->nar_bytes, slot->seconds, mbps);
+  if (error[0]) {
+    fputs(",\"error\":", out);
+    json_write_string(out, error, strlen(error));
+  }
+  fputs("}\n", out);
+}
+
+static void nar_done(FetchRequest *req) {
+  NarSlot *slot = req->data;
+
+  slot->seconds = now_seconds() - slot->started;
+  if (slot->status == NAR_OK && req->result != CURLE_OK)
+    slot->status = NAR_FETCH_FAILED;
+  if (slot->status == NAR_OK && decompress(slot, NULL, 0, 1) == 0 &&
+      !slot->ended && slot->codec != CODEC_UNSUPPORTED)
+    slot->status = NAR_CORRUPT;
+
+  if (slot->status == NAR_OK) {
+    const Narinfo *info = &slot->info;
+    if (info->file_size && info->file_size != slot->file_bytes)
+      slot->status = NAR_FILE_MISMATCH;
+    else
+      slot->status =
+          check_digest(slot->file_ctx, info->file_hash, NAR_FILE_MISMATCH);
+  }
+  if (slot->status == NAR_OK) {
+    const Narinfo *info = &slot->info;
+    if (slot->codec == CODEC_UNSUPPORTED)
+      slot->status = NAR_UNSUPPORTED;
+    else if (info->nar_size && info->nar_size != slot->nar_bytes)
+      slot->status = NAR_NAR_MISMATCH;
+    else
+      slot->status =
+          check_digest(slot->nar_ctx, info->nar_hash, NAR_NAR_MISMATCH);
+  }
+
+  codec_end(slot);
+  slot->active = 0;
+  nar_pending--;
+  write_nar_record(slot);
+}
+
+static int nar_start(NarSlot *slot, const char *base_url, int fd) {
+  char url[512];
+  StrView nar_url = slot->info.url;
+
+  if (nar_url.len == 0)
+    return -1;
+  if ((nar_url.len > 7 && memcmp(nar_url.ptr, "http://", 7) == 0) ||
+      (nar_url.len > 8 && memcmp(nar_url.ptr, "https://", 8) == 0))
+    snprintf(url, sizeof(url), "%.*s", (int)nar_url.len, nar_url.ptr);
+  else
+    snprintf(url, sizeof(url), "%s/%.*s", base_url, (int)nar_url.len,
+             nar_url.ptr);
+
+  slot->codec = codec_for(slot->info.compression);
+  slot->out = malloc(NARFETCH_CHUNK);
+  slot->file_ctx = EVP_MD_CTX_new();
+  slot->nar_ctx = EVP_MD_CTX_new();
+  if (!slot->out || !slot->file_ctx || !slot->nar_ctx ||
+      EVP_DigestInit_ex(slot->file_ctx, EVP_sha256(), NULL) != 1 ||
+      EVP_DigestInit_ex(slot->nar_ctx, EVP_sha256(), NULL) != 1 ||
+      codec_init(slot) != 0)
+    return -1;
+
+  fetch_request_init(&slot->req, url);
+  slot->req.on_data = nar_data;
+  slot->req.on_done = nar_done;
+  slot->req.data = slot;
+  slot->fd = fd;
+  slot->status = NAR_OK;
+  slot->started = now_seconds();
+  slot->active = 1;
+  nar_pending++;
+  if (fetch_add(&slot->req) != 0) {
+    slot->req.result = CURLE_FAILED_INIT;
+    nar_done(&slot->req);
+  }
+  return 0;
+}
+
+static void info_done(FetchRequest *req) {
+  NarSlot *slot = req->data;
+  nar_pending--;
+  if (req->result == CURLE_OK &&
+      narinfo_parse(req->response.ptr, req->response.len, &slot->info,
+                    req->arena) == 0)
+    slot->parsed = 1;
+}
+
+int narfetch_run(const char *hash, FILE *out, char *const urls[],
+                 int url_count, const BatchOptions *opts, const char *output,
+                 NarStats *stats) {
+  NarSlot *slots = calloc(url_count, sizeof(*slots));
+  FetchGroup group;
+  int fd = -1;
+  int failed = 0;
+  double start = now_seconds();
+
+  if (!slots)
+    return -1;
+  nar_out = out;
+  nar_urls = urls;
+  nar_format = opts->format;
+  nar_pending = 0;
+
+  fetch_group_init(&group);
+  for (int i = 0; i < url_count; ++i) {
+    fetch_narinfo_init(&slots[i].info_req, urls[i], hash);
+    slots[i].info_req.on_done = info_done;
+    slots[i].info_req.data = &slots[i];
+    slots[i].cache = i;
+    slots[i].fd = -1;
+    nar_pending++;
+    if (fetch_group_add(&group, &slots[i].info_req) != 0) {
+      slots[i].info_req.result = CURLE_FAILED_INIT;
+      info_done(&slots[i].info_req);
+    }
+  }
+  while (nar_pending > 0)
+    fetch_perform(1000);
+
+  if (output) {
+    fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      perror(output);
+      free(slots);
+      return -1;
+    }
+  }
+
+  int started = 0;
+  for (int i = 0; i < url_count; ++i) {
+    if (!slots[i].parsed || (output && started))
+      continue;
+    if (nar_start(&slots[i], urls[i], fd) != 0) {
+      slots[i].status = NAR_FETCH_FAILED;
+      write_nar_record(&slots[i]);
+    }
+    started++;
+  }
+  while (nar_pending > 0) {
+    fetch_perform(1000);
+    fflush(out);
+  }
+
+  for (int i = 0; i < url_count; ++i) {
+    NarSlot *slot = &slots[i];
+    if (slot->status != NAR_OK)
+      failed++;
+    if (stats) {
+      stats->file_bytes += slot->file_bytes;
+      stats->nar_bytes += slot->nar_bytes;
+    }
+    if (slot->parsed)
+      narinfo_free(&slot->info);
+    fetch_request_free(&slot->info_req);
+    fetch_request_free(&slot->req);
+    EVP_MD_CTX_free(slot->file_ctx);
+    EVP_MD_CTX_free(slot->nar_ctx);
+    free(slot->out);
+  }
+  free(slots);
+
+  if (fd >= 0) {
+    close(fd);
+    if (failed || !started)
+      unlink(output);
+  }
+  if (stats) {
+    stats->seconds += now_seconds() - start;
+    stats->failed += failed || !started;
+  }
+  fflush(out);
+  return started ? failed : -1;
+}
@@ -0,0 +1,19 @@
+#ifndef NARFETCH_H
+#define NARFETCH_H
+
+#include "batch.h"
+#include <stdint.h>
+#include <stdio.h>
+
+typedef struct {
+  uint64_t file_bytes;
+  uint64_t nar_bytes;
+  double seconds;
+  int failed;
+} NarStats;
+
+int narfetch_run(const char *hash, FILE *out, char *const urls[],
+                 int url_count, const BatchOptions *opts, const char *output,
+                 NarStats *stats);
+
+#endif
@@ -0,0 +1,135 @@
+#include "narinfo.h"
+#include <stdlib.h>
+#include <string.h>
+
+static StrView *alloc_views(Arena *arena, size_t count) {
+  if (count == 0)
+    return NULL;
+  return arena ? arena_alloc(arena, count * sizeof(StrView))
+               : malloc(count * sizeof(StrView));
+}
+
+static size_t count_words(const char *p, size_t len) {
+  size_t words = 0;
+  for (size_t i = 0; i < len; ++i)
+    words += p[i] != ' ' && (i == 0 || p[i - 1] == ' ');
+  return words;
+}
+
+static uint64_t parse_u64(const char *p, size_t len) {
+  uint64_t v = 0;
+  for (size_t i = 0; i < len && p[i] >= '0' && p[i] <= '9'; ++i)
+    v = v * 10 + (p[i] - '0');
+  return v;
+}
+
+static int parse_references(Narinfo *info, const char *p, size_t len) {
+  const char *end = p + len;
+  size_t words = count_words(p, len);
+
+  if (!info->arena)
+    free(info->references);
+  info->references = alloc_views(info->arena, words);
+  info->reference_count = 0;
+  if (!info->references && words > 0)
+    return -1;
+
+  while (p < end) {
+    while (p < end && *p == ' ')
+      p++;
+    const char *start = p;
+    while (p < end && *p != ' ')
+      p++;
+    if (p > start) {
+      info->references[info->reference_count].ptr = start;
+      info->references[info->reference_count].len = p - start;
+      info->reference_count++;
+    }
+  }
+  return 0;
+}
+
+int strview_eq(StrView v, const char *s) {
+  size_t len = strlen(s);
+  return v.len == len && memcmp(v.ptr, s, len) == 0;
+}
+
+int narinfo_parse(const char *buf, size_t len, Narinfo *out, Arena *arena) {
+  const char *p = buf;
+  const char *end = buf + len;
+  size_t lines = 1;
+
+  memset(out, 0, sizeof(*out));
+  out->arena = arena;
+  for (const char *nl = buf; (nl = memchr(nl, '\n', end - nl)); ++nl)
+    lines++;
+  out->lines = alloc_views(arena, lines);
+  if (!out->lines)
+    return -1;
+
+  while (p < end) {
+    const char *eol = memchr(p, '\n', end - p);
+    if (!eol)
+      eol = end;
+    size_t line_len = eol - p;
+    if (line_len > 0 && p[line_len - 1] == '\r')
+      line_len--;
+
+    if (line_len > 0) {
+      out->lines[out->line_count].ptr = p;
+      out->lines[out->line_count].len = line_len;
+      out->line_count++;
+    }
+
+    const char *colon = memchr(p, ':', line_len);
+    if (colon && colon + 1 < p + line_len && colon[1] == ' ') {
+      StrView key = {p, colon - p};
+      StrView val = {colon + 2, line_len - (colon - p) - 2};
+
+      if (strview_eq(key, "StorePath")) {
+        out->store_path = val;
+      } else if (strview_eq(key, "URL")) {
+        out->url = val;
+      } else if (strview_eq(key, "Compression")) {
+        out->compression = val;
+      } else if (strview_eq(key, "FileHash")) {
+        out->file_hash = val;
+      } else if (strview_eq(key, "FileSize")) {
+        out->file_size = parse_u64(val.ptr, val.len);
+      } else if (strview_eq(key, "NarHash")) {
+        out->nar_hash = val;
+      } else if (strview_eq(key, "NarSize")) {
+        out->nar_size = parse_u64(val.ptr, val.len);
+      } else if (strview_eq(key, "References")) {
+        if (parse_references(out, val.ptr, val.len) != 0)
+          goto fail;
+      } else if (strview_eq(key, "Deriver")) {
+        out->deriver = val;
+      } else if (strview_eq(key, "Sig")) {
+        if (out->sig_count < NARINFO_MAX_SIGS)
+          out->sigs[out->sig_count++] = val;
+      } else if (strview_eq(key, "CA")) {
+        out->ca = val;
+      }
+    }
+
+    p = eol + 1;
+  }
+
+  return 0;
+
+fail:
+  narinfo_free(out);
+  return -1;
+}
+
+void narinfo_free(Narinfo *info) {
+  if (!info->arena) {
+    free(info->references);
+    free(info->lines);
+  }
+  info->references = NULL;
+  info->lines = NULL;
+  info->reference_count = 0;
+  info->line_count = 0;
+}
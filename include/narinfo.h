@@ -0,0 +1,39 @@
+#ifndef NARINFO_H
+#define NARINFO_H
+
+#include "arena.h"
+#include <stddef.h>
+#include <stdint.h>
+
+#define NARINFO_MAX_SIGS 8
+
+typedef struct {
+  const char *ptr;
+  size_t len;
+} StrView;
+
+typedef struct {
+  StrView store_path;
+  StrView url;
+  StrView compression;
+  StrView file_hash;
+  StrView nar_hash;
+  StrView deriver;
+  StrView ca;
+  uint64_t file_size;
+  uint64_t nar_size;
+  StrView sigs[NARINFO_MAX_SIGS];
+  int sig_count;
+  StrView *references;
+  int reference_count;
+  StrView *lines;
+  int line_count;
+  Arena *arena;
+} Narinfo;
+
+int narinfo_parse(const char *buf, size_t len, Narinfo *out, Arena *arena);
+void narinfo_free(Narinfo *info);
+
+int strview_eq(StrView v, const char *s);
+
+#endif
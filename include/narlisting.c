@@ -0,0 +1,508 @@
+#include "narlisting.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+enum { LEX_VALUE, LEX_STRING, LEX_ESCAPE, LEX_UNICODE, LEX_ATOM };
+
+enum { FRAME_DOC, FRAME_NODE, FRAME_ENTRIES, FRAME_SKIP };
+
+enum {
+  KEY_OTHER,
+  KEY_ROOT,
+  KEY_TYPE,
+  KEY_SIZE,
+  KEY_EXECUTABLE,
+  KEY_TARGET,
+  KEY_ENTRIES,
+};
+
+static int token_append(ListingParser *p, const char *data, size_t len) {
+  if (p->token_len + len + 1 > p->token_cap) {
+    size_t cap = p->token_cap ? p->token_cap : 256;
+    while (cap < p->token_len + len + 1)
+      cap *= 2;
+    char *token = realloc(p->token, cap);
+    if (!token)
+      return -1;
+    p->token = token;
+    p->token_cap = cap;
+  }
+  memcpy(p->token + p->token_len, data, len);
+  p->token_len += len;
+  p->token[p->token_len] = '\0';
+  return 0;
+}
+
+static int token_is(const ListingParser *p, const char *s) {
+  return p->token_len == strlen(s) && memcmp(p->token, s, p->token_len) == 0;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+static int append_codepoint(ListingParser *p) {
+  unsigned cp = p->codepoint;
+  char buf[4];
+  size_t n;
+
+  if (cp >= 0xd800 && cp < 0xdc00) {
+    p->surrogate = cp;
+    return 0;
+  }
+  if (cp >= 0xdc00 && cp < 0xe000) {
+    if (!p->surrogate)
+      return -1;
+    cp = 0x10000 + ((p->surrogate - 0xd800) << 10) + (cp - 0xdc00);
+  }
+  p->surrogate = 0;
+
+  if (cp < 0x80) {
+    buf[0] = (char)cp;
+    n = 1;
+  } else if (cp < 0x800) {
+    buf[0] = (char)(0xc0 | cp >> 6);
+    buf[1] = (char)(0x80 | (cp & 0x3f));
+    n = 2;
+  } else if (cp < 0x10000) {
+    buf[0] = (char)(0xe0 | cp >> 12);
+    buf[1] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    buf[2] = (char)(0x80 | (cp & 0x3f));
+    n = 3;
+  } else {
+    buf[0] = (char)(0xf0 | cp >> 18);
+    buf[1] = (char)(0x80 | ((cp >> 12) & 0x3f));
+    buf[2] = (char)(0x80 | ((cp >> 6) & 0x3f));
+    buf[3] = (char)(0x80 | (cp & 0x3f));
+    n = 4;
+  }
+  return token_append(p, buf, n);
+}
+
+static int key_id(const ListingParser *p) {
+  if (token_is(p, "root"))
+    return KEY_ROOT;
+  if (token_is(p, "type"))
+    return KEY_TYPE;
+  if (token_is(p, "size"))
+    return KEY_SIZE;
+  if (token_is(p, "executable"))
+    return KEY_EXECUTABLE;
+  if (token_is(p, "target"))
+    return KEY_TARGET;
+  if (token_is(p, "entries"))
+    return KEY_ENTRIES;
+  return KEY_OTHER;
+}
+
+static int node_visible(const ListingNode *node) {
+  for (const ListingNode *p = node->parent; p; p = p->parent) {
+    if (!p->expanded)
+      return 0;
+  }
+  return 1;
+}
+
+static ListingNode *add_node(NarListing *ls, ListingNode *parent,
+                             StrView name) {
+  ListingNode *node = arena_alloc(&ls->arena, sizeof(*node));
+  if (!node)
+    return NULL;
+
+  memset(node, 0, sizeof(*node));
+  node->name = name;
+  node->parent = parent;
+  node->depth = parent->depth + 1;
+  if (parent->last_child)
+    parent->last_child->next = node;
+  else
+    parent->first_child = node;
+  parent->last_child = node;
+  parent->child_count++;
+  ls->node_count++;
+  if (node_visible(node))
+    ls->rows_stale = 1;
+  return node;
+}
+
+static int push_frame(ListingParser *p, int kind, int object,
+                      ListingNode *node) {
+  if (p->depth == LISTING_MAX_DEPTH)
+    return -1;
+  ListingFrame *f = &p->frames[p->depth++];
+  f->kind = kind;
+  f->object = object;
+  f->expect_key = object;
+  f->node = node;
+  return 0;
+}
+
+static int open_value(NarListing *ls, int object) {
+  ListingParser *p = &ls->parser;
+  ListingNode *node = NULL;
+  int kind = FRAME_SKIP;
+
+  if (p->depth == 0) {
+    if (!object || p->finished)
+      return -1;
+    kind = FRAME_DOC;
+  } else {
+    ListingFrame *f = &p->frames[p->depth - 1];
+    if (f->expect_key)
+      return -1;
+    if (object && f->kind == FRAME_DOC && p->key == KEY_ROOT) {
+      kind = FRAME_NODE;
+      node = ls->root;
+    } else if (object && f->kind == FRAME_NODE && p->key == KEY_ENTRIES) {
+      kind = FRAME_ENTRIES;
+      node = f->node;
+      node->type = LISTING_DIRECTORY;
+    } else if (object && f->kind == FRAME_ENTRIES) {
+      kind = FRAME_NODE;
+      node = add_node(ls, f->node, p->name);
+      if (!node)
+        return -1;
+    }
+  }
+  p->key = KEY_OTHER;
+  return push_frame(p, kind, object, node);
+}
+
+static int close_value(NarListing *ls, int object) {
+  ListingParser *p = &ls->parser;
+
+  if (p->depth == 0 || p->frames[p->depth - 1].object != object)
+    return -1;
+  if (--p->depth == 0)
+    p->finished = 1;
+  return 0;
+}
+
+static int set_field(NarListing *ls, ListingNode *node, int key, int string) {
+  ListingParser *p = &ls->parser;
+
+  switch (key) {
+  case KEY_TYPE:
+    if (!string)
+      return -1;
+    if (token_is(p, "directory"))
+      node->type = LISTING_DIRECTORY;
+    else if (token_is(p, "regular"))
+      node->type = LISTING_REGULAR;
+    else if (token_is(p, "symlink"))
+      node->type = LISTING_SYMLINK;
+    break;
+  case KEY_SIZE:
+    if (string)
+      return -1;
+    node->size = strtoull(p->token, NULL, 10);
+    break;
+  case KEY_EXECUTABLE:
+    node->executable = !string && token_is(p, "true");
+    break;
+  case KEY_TARGET:
+    if (!string)
+      return -1;
+    node->target.ptr = arena_strndup(&ls->arena, p->token, p->token_len);
+    node->target.len = p->token_len;
+    if (!node->target.ptr)
+      return -1;
+    break;
+  }
+  return 0;
+}
+
+static int scalar(NarListing *ls, int string) {
+  ListingParser *p = &ls->parser;
+
+  if (p->depth == 0)
+    return -1;
+
+  ListingFrame *f = &p->frames[p->depth - 1];
+  if (f->expect_key) {
+    if (!string)
+      return -1;
+    f->expect_key = 0;
+    if (f->kind == FRAME_ENTRIES) {
+      p->name.ptr = arena_strndup(&ls->arena, p->token, p->token_len);
+      p->name.len = p->token_len;
+      return p->name.ptr ? 0 : -1;
+    }
+    p->key = key_id(p);
+    return 0;
+  }
+
+  int key = p->key;
+  p->key = KEY_OTHER;
+  if (f->kind == FRAME_NODE)
+    return set_field(ls, f->node, key, string);
+  return 0;
+}
+
+static int fail(ListingParser *p, size_t consumed) {
+  p->offset += consumed;
+  return -1;
+}
+
+static int feed(NarListing *ls, const char *data, size_t len) {
+  ListingParser *p = &ls->parser;
+  size_t i = 0;
+
+  while (i < len) {
+    char c = data[i];
+
+    if (p->lex == LEX_STRING) {
+      size_t j = i;
+      while (j < len && data[j] != '"' && data[j] != '\\')
+        j++;
+      if (token_append(p, data + i, j - i) != 0)
+        return fail(p, i);
+      i = j;
+      if (i == len)
+        break;
+      p->lex = data[i++] == '"' ? LEX_VALUE : LEX_ESCAPE;
+      if (p->lex == LEX_VALUE && scalar(ls, 1) != 0)
+        return fail(p, i);
+      continue;
+    }
+
+    if (p->lex == LEX_ESCAPE) {
+      static const char from[] = "\"\\/bfnrt";
+      static const char to[] = "\"\\/\b\f\n\r\t";
+      const char *e = c ? strchr(from, c) : NULL;
+
+      i++;
+      if (c == 'u') {
+        p->lex = LEX_UNICODE;
+        p->codepoint = 0;
+        p->hex_digits = 0;
+        continue;
+      }
+      if (!e || token_append(p, &to[e - from], 1) != 0)
+        return fail(p, i);
+      p->lex = LEX_STRING;
+      continue;
+    }
+
+    if (p->lex == LEX_UNICODE) {
+      int v = hex_value(c);
+      i++;
+      if (v < 0)
+        return fail(p, i);
+      p->codepoint = p->codepoint * 16 + v;
+      if (++p->hex_digits < 4)
+        continue;
+      p->lex = LEX_STRING;
+      if (append_codepoint(p) != 0)
+        return fail(p, i);
+      continue;
+    }
+
+    if (p->lex == LEX_ATOM) {
+      if (isalnum((unsigned char)c) || c == '-' || c == '+' || c == '.') {
+        if (token_append(p, &c, 1) != 0)
+          return fail(p, i);
+        i++;
+        continue;
+      }
+      p->lex = LEX_VALUE;
+      if (scalar(ls, 0) != 0)
+        return fail(p, i);
+      continue;
+    }
+
+    i++;
+    switch (c) {
+    case ' ':
+    case '\t':
+    case '\n':
+    case '\r':
+    case ':':
+      break;
+    case ',':
+      if (p->depth > 0)
+        p->frames[p->depth - 1].expect_key = p->frames[p->depth - 1].object;
+      break;
+    case '{':
+    case '[':
+      if (open_value(ls, c == '{') != 0)
+        return fail(p, i);
+      break;
+    case '}':
+    case ']':
+      if (close_value(ls, c == '}') != 0)
+        return fail(p, i);
+      break;
+    case '"':
+      p->lex = LEX_STRING;
+      p->token_len = 0;
+      break;
+    default:
+      if (!isalnum((unsigned char)c) && c != '-')
+        return fail(p, i);
+      p->lex = LEX_ATOM;
+      p->token_len = 0;
+      if (token_append(p, &c, 1) != 0)
+        return fail(p, i);
+    }
+  }
+
+  p->offset += len;
+  return 0;
+}
+
+static size_t listing_data(FetchRequest *req, const char *data, size_t len) {
+  NarListing *ls = req->data;
+
+  ls->changed = 1;
+  if (feed(ls, data, len) != 0) {
+    ls->state = LISTING_FAILED;
+    snprintf(ls->error, sizeof(ls->error), "Malformed listing at byte %llu",
+             (unsigned long long)ls->parser.offset);
+    return 0;
+  }
+  return len;
+}
+
+static void listing_done(FetchRequest *req) {
+  NarListing *ls = req->data;
+
+  ls->changed = 1;
+  if (ls->state == LISTING_FAILED)
+    return;
+
+  if (req->result == CURLE_OK && ls->parser.finished) {
+    ls->state = LISTING_DONE;
+  } else if (req->result == CURLE_OK) {
+    ls->state = LISTING_FAILED;
+    snprintf(ls->error, sizeof(ls->error), "Listing ended early");
+  } else if (req->http_code == 404 || req->http_code == 403) {
+    ls->state = LISTING_MISSING;
+    snprintf(ls->error, sizeof(ls->error), "No listing in this cache");
+  } else {
+    ls->state = LISTING_FAILED;
+    snprintf(ls->error, sizeof(ls->error), "%s",
+             req->errbuf[0] ? req->errbuf : curl_easy_strerror(req->result));
+  }
+}
+
+int listing_start(NarListing *ls, const char *base_url, const char *hash) {
+  char url[512];
+
+  memset(ls, 0, sizeof(*ls));
+  arena_init(&ls->arena, 0);
+  ls->state = LISTING_LOADING;
+  ls->root = arena_alloc(&ls->arena, sizeof(*ls->root));
+  if (!ls->root) {
+    ls->state = LISTING_FAILED;
+    snprintf(ls->error, sizeof(ls->error), "Out of memory");
+    return -1;
+  }
+  memset(ls->root, 0, sizeof(*ls->root));
+  ls->root->expanded = 1;
+  ls->node_count = 1;
+  ls->selected = ls->root;
+  ls->rows_stale = 1;
+
+  snprintf(url, sizeof(url), "%s/%s.ls", base_url, hash);
+  fetch_request_init(&ls->req, url);
+  ls->req.accept_encoding = "";
+  ls->req.on_data = listing_data;
+  ls->req.on_done = listing_done;
+  ls->req.data = ls;
+  if (fetch_add(&ls->req) != 0) {
+    ls->state = LISTING_FAILED;
+    snprintf(ls->error, sizeof(ls->error), "Could not start request");
+    return -1;
+  }
+  return 0;
+}
+
+void listing_free(NarListing *ls) {
+  fetch_request_free(&ls->req);
+  arena_free(&ls->arena);
+  free(ls->parser.token);
+  free(ls->rows);
+  memset(ls, 0, sizeof(*ls));
+}
+
+static int collect_rows(NarListing *ls, ListingNode *node) {
+  if (ls->row_count == ls->row_cap) {
+    int cap = ls->row_cap ? ls->row_cap * 2 : 256;
+    ListingNode **rows = realloc(ls->rows, cap * sizeof(*rows));
+    if (!rows)
+      return -1;
+    ls->rows = rows;
+    ls->row_cap = cap;
+  }
+
+  if (node == ls->selected)
+    ls->cursor = ls->row_count;
+  ls->rows[ls->row_count++] = node;
+  if (!node->expanded)
+    return 0;
+  for (ListingNode *child = node->first_child; child; child = child->next) {
+    if (collect_rows(ls, child) != 0)
+      return -1;
+  }
+  return 0;
+}
+
+int listing_rows(NarListing *ls) {
+  if (!ls->rows_stale)
+    return ls->row_count;
+
+  ls->rows_stale = 0;
+  ls->row_count = 0;
+  ls->cursor = 0;
+  collect_rows(ls, ls->root);
+  ls->selected = ls->row_count > 0 ? ls->rows[ls->cursor] : NULL;
+  return ls->row_count;
+}
+
+void listing_move(NarListing *ls, int delta) {
+  int rows = listing_rows(ls);
+
+  ls->cursor += delta;
+  if (ls->cursor > rows - 1)
+    ls->cursor = rows - 1;
+  if (ls->cursor < 0)
+    ls->cursor = 0;
+  ls->selected = rows > 0 ? ls->rows[ls->cursor] : NULL;
+}
+
+void listing_toggle(NarListing *ls) {
+  ListingNode *node = ls->selected;
+
+  if (!node || node->type != LISTING_DIRECTORY)
+    return;
+  node->expanded = !node->expanded;
+  ls->rows_stale = 1;
+  ls->changed = 1;
+}
+
+size_t listing_path(const ListingNode *node, char *buf, size_t len) {
+  size_t need = 0;
+
+  for (const ListingNode *n = node; n->parent; n = n->parent)
+    need += n->name.len + 1;
+  if (need + 1 > len)
+    return 0;
+
+  size_t pos = need;
+  buf[pos] = '\0';
+  for (const ListingNode *n = node; n->parent; n = n->parent) {
+    pos -= n->name.len;
+    memcpy(buf + pos, n->name.ptr, n->name.len);
+    buf[--pos] = '/';
+  }
+  return need;
+}
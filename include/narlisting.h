@@ -0,0 +1,87 @@
+#ifndef NARLISTING_H
+#define NARLISTING_H
+
+#include "arena.h"
+#include "fetch.h"
+#include "narinfo.h"
+#include <stdint.h>
+
+#define LISTING_MAX_DEPTH 256
+
+typedef enum {
+  LISTING_UNKNOWN,
+  LISTING_DIRECTORY,
+  LISTING_REGULAR,
+  LISTING_SYMLINK,
+} ListingType;
+
+typedef enum {
+  LISTING_LOADING,
+  LISTING_DONE,
+  LISTING_MISSING,
+  LISTING_FAILED,
+} ListingState;
+
+typedef struct ListingNode {
+  StrView name;
+  StrView target;
+  uint64_t size;
+  ListingType type;
+  int executable;
+  int expanded;
+  int depth;
+  int child_count;
+  struct ListingNode *parent;
+  struct ListingNode *first_child;
+  struct ListingNode *last_child;
+  struct ListingNode *next;
+} ListingNode;
+
+typedef struct {
+  int kind;
+  int object;
+  int expect_key;
+  ListingNode *node;
+} ListingFrame;
+
+typedef struct {
+  int lex;
+  char *token;
+  size_t token_len;
+  size_t token_cap;
+  unsigned codepoint;
+  unsigned surrogate;
+  int hex_digits;
+  int key;
+  StrView name;
+  int depth;
+  int finished;
+  uint64_t offset;
+  ListingFrame frames[LISTING_MAX_DEPTH];
+} ListingParser;
+
+typedef struct {
+  FetchRequest req;
+  Arena arena;
+  ListingParser parser;
+  ListingState state;
+  char error[CURL_ERROR_SIZE];
+  ListingNode *root;
+  int node_count;
+  ListingNode **rows;
+  int row_count;
+  int row_cap;
+  int rows_stale;
+  int cursor;
+  ListingNode *selected;
+  int changed;
+} NarListing;
+
+int listing_start(NarListing *ls, const char *base_url, const char *hash);
+void listing_free(NarListing *ls);
+int listing_rows(NarListing *ls);
+void listing_move(NarListing *ls, int delta);
+void listing_toggle(NarListing *ls);
+size_t listing_path(const ListingNode *node, char *buf, size_t len);
+
+#endif
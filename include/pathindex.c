@@ -0,0 +1,297 @@
+#include "pathindex.h"
+#include "arena.h"
+#include <ctype.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PATHINDEX_MAX_DIRS 128
+#define PATHINDEX_CHECK_MS 1000
+
+typedef struct {
+  const char *name;
+  const char *dir;
+  const char *resolved;
+  int state;
+  int next;
+} PathEntry;
+
+typedef struct {
+  const char *path;
+  struct timespec mtime;
+  int present;
+} PathDir;
+
+static Arena index_arena;
+static char *index_path = NULL;
+static PathDir dirs[PATHINDEX_MAX_DIRS];
+static int dir_count = 0;
+static PathEntry *entries = NULL;
+static int entry_count = 0;
+static int entry_cap = 0;
+static int *table = NULL;
+static size_t table_cap = 0;
+static long long checked_at = -1;
+
+static long long now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static uint64_t name_key(const char *name) {
+  uint64_t h = 14695981039346656037ULL;
+  for (; *name; ++name)
+    h = (h ^ (unsigned char)*name) * 1099511628211ULL;
+  return h;
+}
+
+static int *table_slot(const char *name) {
+  size_t i = name_key(name) & (table_cap - 1);
+  while (table[i] && strcmp(entries[table[i] - 1].name, name) != 0)
+    i = (i + 1) & (table_cap - 1);
+  return &table[i];
+}
+
+static int table_grow(void) {
+  size_t cap = table_cap ? table_cap * 2 : 4096;
+  int *old = table;
+  size_t old_cap = table_cap;
+
+  table = calloc(cap, sizeof(*table));
+  if (!table) {
+    table = old;
+    return -1;
+  }
+  table_cap = cap;
+
+  for (size_t i = 0; i < old_cap; ++i) {
+    if (old[i])
+      *table_slot(entries[old[i] - 1].name) = old[i];
+  }
+  free(old);
+  return 0;
+}
+
+static void add_entry(const char *dir, const char *name) {
+  if ((size_t)(entry_count + 1) * 2 > table_cap && table_grow() != 0)
+    return;
+  if (entry_count == entry_cap) {
+    int cap = entry_cap ? entry_cap * 2 : 1024;
+    PathEntry *p = realloc(entries, cap * sizeof(*p));
+    if (!p)
+      return;
+    entries = p;
+    entry_cap = cap;
+  }
+
+  PathEntry *entry = &entries[entry_count];
+  entry->name = arena_strndup(&index_arena, name, strlen(name));
+  if (!entry->name)
+    return;
+  entry->dir = dir;
+  entry->resolved = NULL;
+  entry->state = 0;
+  entry->next = 0;
+  entry_count++;
+
+  int *slot = table_slot(name);
+  if (!*slot) {
+    *slot = entry_count;
+    return;
+  }
+  PathEntry *p = &entries[*slot - 1];
+  while (p->next)
+    p = &entries[p->next - 1];
+  p->next = entry_count;
+}
+
+static void scan_dir(PathDir *dir) {
+  struct stat st;
+  dir->present = stat(dir->path, &st) == 0;
+  if (!dir->present)
+    return;
+  dir->mtime = st.st_mtim;
+
+  DIR *d = opendir(dir->path);
+  if (!d)
+    return;
+
+  struct dirent *ent;
+  while ((ent = readdir(d))) {
+    if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+      continue;
+    add_entry(dir->path, ent->d_name);
+  }
+  closedir(d);
+}
+
+static int is_stale(const char *path) {
+  if (!index_path || strcmp(index_path, path) != 0)
+    return 1;
+
+  for (int i = 0; i < dir_count; ++i) {
+    struct stat st;
+    int present = stat(dirs[i].path, &st) == 0;
+    if (present != dirs[i].present)
+      return 1;
+    if (present && (st.st_mtim.tv_sec != dirs[i].mtime.tv_sec ||
+                    st.st_mtim.tv_nsec != dirs[i].mtime.tv_nsec))
+      return 1;
+  }
+  return 0;
+}
+
+void pathindex_free(void) {
+  arena_free(&index_arena);
+  free(index_path);
+  free(entries);
+  free(table);
+  index_path = NULL;
+  entries = NULL;
+  table = NULL;
+  entry_count = entry_cap = dir_count = 0;
+  table_cap = 0;
+  checked_at = -1;
+}
+
+int pathindex_refresh(void) {
+  const char *path = getenv("PATH");
+  if (!path)
+    path = "";
+
+  long long now = now_ms();
+  if (checked_at >= 0 && now - checked_at < PATHINDEX_CHECK_MS &&
+      index_path && strcmp(index_path, path) == 0)
+    return 0;
+  checked_at = now;
+
+  if (!is_stale(path))
+    return 0;
+
+  pathindex_free();
+  checked_at = now;
+  arena_init(&index_arena, 65536);
+  index_path = strdup(path);
+  if (!index_path)
+    return -1;
+
+  const char *p = path;
+  while (dir_count < PATHINDEX_MAX_DIRS) {
+    size_t len = strcspn(p, ":");
+    if (len > 0) {
+      dirs[dir_count].path = arena_strndup(&index_arena, p, len);
+      if (dirs[dir_count].path)
+        scan_dir(&dirs[dir_count++]);
+    }
+    if (!p[len])
+      break;
+    p += len + 1;
+  }
+  return 0;
+}
+
+static const char *entry_resolve(PathEntry *entry) {
+  if (entry->state == 0) {
+    char full[PATH_MAX];
+    char real[PATH_MAX];
+    snprintf(full, sizeof(full), "%s/%s", entry->dir, entry->name);
+
+    entry->state = -1;
+    if (access(full, X_OK) == 0) {
+      const char *resolved = realpath(full, real) ? real : full;
+      entry->resolved = arena_strndup(&index_arena, resolved, strlen(resolved));
+      if (entry->resolved)
+        entry->state = 1;
+    }
+  }
+  return entry->state > 0 ? entry->resolved : NULL;
+}
+
+const char *pathindex_find(const char *name) {
+  if (!table_cap)
+    return NULL;
+
+  int index = *table_slot(name);
+  while (index) {
+    PathEntry *entry = &entries[index - 1];
+    const char *resolved = entry_resolve(entry);
+    if (resolved)
+      return resolved;
+    index = entry->next;
+  }
+  return NULL;
+}
+
+static int fuzzy_score(const char *name, const char *query) {
+  const char *n = name;
+  const char *prev = NULL;
+  int score = 0;
+  int run = 0;
+
+  for (const char *q = query; *q; ++q) {
+    int c = tolower((unsigned char)*q);
+    while (*n && tolower((unsigned char)*n) != c)
+      n++;
+    if (!*n)
+      return -1;
+
+    if (n == name)
+      score += 8;
+    else if (n[-1] == '-' || n[-1] == '_' || n[-1] == '.')
+      score += 5;
+
+    if (prev && n == prev + 1) {
+      run++;
+      score += 3 * run;
+    } else {
+      run = 0;
+      score -= n - (prev ? prev + 1 : name);
+    }
+    prev = n++;
+  }
+
+  if (strcmp(name, query) == 0)
+    score += 100;
+  return score - (int)strlen(name) / 4;
+}
+
+int pathindex_complete(const char *query, const char **names, int max) {
+  int scores[max > 0 ? max : 1];
+  int count = 0;
+
+  if (!*query || max <= 0)
+    return 0;
+
+  for (size_t i = 0; i < table_cap; ++i) {
+    if (!table[i])
+      continue;
+    const char *name = entries[table[i] - 1].name;
+    int score = fuzzy_score(name, query);
+    if (score < 0)
+      continue;
+
+    int pos = count;
+    while (pos > 0 &&
+           (score > scores[pos - 1] ||
+            (score == scores[pos - 1] && strcmp(name, names[pos - 1]) < 0)))
+      pos--;
+    if (pos >= max)
+      continue;
+
+    int last = count < max ? count : max - 1;
+    memmove(&names[pos + 1], &names[pos], (last - pos) * sizeof(*names));
+    memmove(&scores[pos + 1], &scores[pos], (last - pos) * sizeof(*scores));
+    names[pos] = name;
+    scores[pos] = score;
+    if (count < max)
+      count++;
+  }
+  return count;
+}
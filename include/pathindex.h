@@ -0,0 +1,9 @@
+#ifndef PATHINDEX_H
+#define PATHINDEX_H
+
+int pathindex_refresh(void);
+const char *pathindex_find(const char *name);
+int pathindex_complete(const char *query, const char **names, int max);
+void pathindex_free(void);
+
+#endif
@@ -0,0 +1,103 @@
+#include "search.h"
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+void search_init(Search *s) { memset(s, 0, sizeof(*s)); }
+
+void search_free(Search *s) {
+  free(s->matches);
+  search_init(s);
+}
+
+long search_find(StrView line, const char *query, size_t len) {
+  if (len == 0)
+    return 0;
+  if (line.len < len)
+    return -1;
+
+  int first = tolower((unsigned char)query[0]);
+  for (size_t i = 0; i + len <= line.len; ++i) {
+    if (tolower((unsigned char)line.ptr[i]) != first)
+      continue;
+    size_t j = 1;
+    while (j < len && tolower((unsigned char)line.ptr[i + j]) ==
+                          tolower((unsigned char)query[j]))
+      j++;
+    if (j == len)
+      return (long)i;
+  }
+  return -1;
+}
+
+int search_update(Search *s, const StrView *lines, int count,
+                  const char *query) {
+  size_t len = strlen(query);
+  if (len >= sizeof(s->query))
+    len = sizeof(s->query) - 1;
+
+  int narrow = s->lines == lines && s->line_count == count &&
+               s->query_len > 0 && len >= s->query_len &&
+               strncmp(query, s->query, s->query_len) == 0;
+
+  memcpy(s->query, query, len);
+  s->query[len] = '\0';
+  s->query_len = len;
+  s->lines = lines;
+  s->line_count = count;
+
+  if (len == 0) {
+    s->match_count = 0;
+    return 0;
+  }
+
+  if (narrow) {
+    int n = 0;
+    for (int i = 0; i < s->match_count; ++i) {
+      if (search_find(lines[s->matches[i]], s->query, len) >= 0)
+        s->matches[n++] = s->matches[i];
+    }
+    s->match_count = n;
+    return n;
+  }
+
+  s->match_count = 0;
+  for (int i = 0; i < count; ++i) {
+    if (search_find(lines[i], s->query, len) < 0)
+      continue;
+    if (s->match_count == s->match_cap) {
+      int cap = s->match_cap ? s->match_cap * 2 : 256;
+      int *p = realloc(s->matches, cap * sizeof(*p));
+      if (!p)
+        break;
+      s->matches = p;
+      s->match_cap = cap;
+    }
+    s->matches[s->match_count++] = i;
+  }
+  return s->match_count;
+}
+
+int search_lower_bound(const Search *s, int line) {
+  int lo = 0, hi = s->match_count;
+  while (lo < hi) {
+    int mid = lo + (hi - lo) / 2;
+    if (s->matches[mid] < line)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+int search_next(const Search *s, int line, int dir) {
+  if (s->match_count == 0)
+    return -1;
+
+  if (dir > 0) {
+    int i = search_lower_bound(s, line + 1);
+    return s->matches[i < s->match_count ? i : 0];
+  }
+  int i = search_lower_bound(s, line) - 1;
+  return s->matches[i >= 0 ? i : s->match_count - 1];
+}
@@ -0,0 +1,24 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "narinfo.h"
+
+typedef struct {
+  char query[128];
+  size_t query_len;
+  const StrView *lines;
+  int line_count;
+  int *matches;
+  int match_count;
+  int match_cap;
+} Search;
+
+void search_init(Search *s);
+void search_free(Search *s);
+long search_find(StrView line, const char *query, size_t len);
+int search_update(Search *s, const StrView *lines, int count,
+                  const char *query);
+int search_lower_bound(const Search *s, int line);
+int search_next(const Search *s, int line, int dir);
+
+#endif
@@ -0,0 +1,486 @@
+#include "serve.h"
+#include "closure.h"
+#include "fetch.h"
+#include "narcache.h"
+#include "store.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SERVE_HEADER_MAX 128
+#define SERVE_BUF_SIZE 65536
+
+static volatile sig_atomic_t serve_stop = 0;
+
+static void serve_signal(int sig) {
+  (void)sig;
+  serve_stop = 1;
+}
+
+static int socket_address(const char *path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+static const char *format_name(OutputFormat format) {
+  return format == OUTPUT_TSV ? "tsv" : "json";
+}
+
+typedef struct ServeClient {
+  int fd;
+  char header[SERVE_HEADER_MAX];
+  size_t header_len;
+  FILE *out;
+  char *out_buf;
+  size_t out_len;
+  size_t out_sent;
+  BatchSession *batch;
+  ClosureSession *closure;
+  int finished;
+  time_t active;
+  struct ServeClient *next;
+} ServeClient;
+
+static ServeClient *client_open(int fd) {
+  ServeClient *cl = calloc(1, sizeof(*cl));
+  if (!cl)
+    return NULL;
+  cl->out = open_memstream(&cl->out_buf, &cl->out_len);
+  if (!cl->out) {
+    free(cl);
+    return NULL;
+  }
+  cl->fd = fd;
+  cl->active = time(NULL);
+  return cl;
+}
+
+static void client_close(ServeClient *cl) {
+  if (cl->fd >= 0)
+    close(cl->fd);
+  fclose(cl->out);
+  free(cl->out_buf);
+  free(cl);
+}
+
+static void client_reply(ServeClient *cl, int status, const char *error) {
+  fputc('\0', cl->out);
+  fputc(status, cl->out);
+  if (error)
+    fprintf(cl->out, "%s\n", error);
+  cl->finished = 1;
+}
+
+static void client_start(ServeClient *cl, char *const urls[], int url_count,
+                         const BatchOptions *opts) {
+  char op[16] = "", format[8] = "", hash[HASH_LEN + 2] = "";
+  BatchOptions query = *opts;
+  char error[SERVE_HEADER_MAX + 32];
+
+  if (sscanf(cl->header, "%15s %7s %33s", op, format, hash) < 1) {
+    client_reply(cl, 1, "malformed request");
+    return;
+  }
+  query.format = strcmp(format, "tsv") == 0 ? OUTPUT_TSV : OUTPUT_JSON;
+
+  if (strcmp(op, "lookup") == 0 || strcmp(op, "exists") == 0) {
+    query.exists = strcmp(op, "exists") == 0;
+    cl->batch = batch_open(cl->fd, cl->out, urls, url_count, &query);
+  } else if (strcmp(op, "closure") == 0 &&
+             is_store_hash(hash, strlen(hash))) {
+    cl->closure = closure_open(hash, cl->out, urls, url_count, &query);
+  } else {
+    snprintf(error, sizeof(error), "unknown request: %s", cl->header);
+    client_reply(cl, 1, error);
+    return;
+  }
+  if (!cl->batch && !cl->closure)
+    client_reply(cl, 2, NULL);
+}
+
+static int read_header(ServeClient *cl) {
+  while (cl->header_len + 1 < sizeof(cl->header)) {
+    ssize_t r = read(cl->fd, cl->header + cl->header_len, 1);
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (r < 0 && errno == EINTR)
+      continue;
+    if (r <= 0)
+      return -1;
+    if (cl->header[cl->header_len] == '\n') {
+      cl->header[cl->header_len] = '\0';
+      return 1;
+    }
+    cl->header_len++;
+  }
+  return -1;
+}
+
+static int client_reading(const ServeClient *cl) {
+  if (cl->finished || cl->fd < 0)
+    return 0;
+  if (!cl->batch && !cl->closure)
+    return 1;
+  return cl->batch && batch_want_input(cl->batch) &&
+         cl->out_len - cl->out_sent < SERVE_BUF_SIZE;
+}
+
+static int client_flush(ServeClient *cl) {
+  fflush(cl->out);
+  if (cl->fd < 0)
+    cl->out_sent = cl->out_len;
+  while (cl->out_sent < cl->out_len) {
+    ssize_t n = write(cl->fd, cl->out_buf + cl->out_sent,
+                      cl->out_len - cl->out_sent);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      return 0;
+    if (n <= 0)
+      return -1;
+    cl->out_sent += n;
+    cl->active = time(NULL);
+  }
+  if (cl->out_sent == cl->out_len) {
+    fseeko(cl->out, 0, SEEK_SET);
+    fflush(cl->out);
+    cl->out_sent = 0;
+  }
+  return 0;
+}
+
+static void client_idle(ServeClient *cl) {
+  char error[64];
+  snprintf(error, sizeof(error), "client idle for %d seconds",
+           SERVE_IDLE_SECONDS);
+  client_reply(cl, 1, error);
+}
+
+static void client_drop(ServeClient *cl) {
+  close(cl->fd);
+  cl->fd = -1;
+  cl->finished = 1;
+  if (cl->batch)
+    batch_abort(cl->batch);
+  if (cl->closure)
+    closure_abort(cl->closure);
+}
+
+/* Advances one client; returns 1 once it can be freed. */
+static int client_step(ServeClient *cl, short revents, char *const urls[],
+                       int url_count, const BatchOptions *opts) {
+  time_t now = time(NULL);
+  int reading = client_reading(cl);
+
+  if (reading && (revents & (CURL_WAIT_POLLIN | CURL_WAIT_POLLPRI))) {
+    if (!cl->batch && !cl->closure) {
+      int rc = read_header(cl);
+      cl->active = now;
+      if (rc < 0)
+        client_reply(cl, 1, "malformed request");
+      else if (rc > 0)
+        client_start(cl, urls, url_count, opts);
+    } else if (batch_read(cl->batch) != 0) {
+      cl->active = now;
+    }
+  }
+
+  if (cl->batch && cl->out_len - cl->out_sent < SERVE_BUF_SIZE &&
+      batch_step(cl->batch)) {
+    int rc = batch_close(cl->batch);
+    cl->batch = NULL;
+    if (cl->fd >= 0 && rc < 0)
+      client_idle(cl);
+    else if (cl->fd >= 0)
+      client_reply(cl, rc > 0 ? 2 : 0, NULL);
+  }
+  if (cl->closure && cl->out_len - cl->out_sent < SERVE_BUF_SIZE &&
+      closure_step(cl->closure)) {
+    int rc = closure_close(cl->closure);
+    cl->closure = NULL;
+    if (cl->fd >= 0)
+      client_reply(cl, rc != 0 ? 2 : 0, NULL);
+  }
+
+  if (client_flush(cl) != 0)
+    client_drop(cl);
+  if (cl->fd < 0)
+    return !cl->batch && !cl->closure;
+
+  int pending = cl->out_sent < cl->out_len;
+  if (cl->finished && !pending)
+    return 1;
+
+  if (!pending && !client_reading(cl)) {
+    cl->active = now;
+  } else if (now - cl->active > SERVE_IDLE_SECONDS) {
+    if (pending)
+      client_drop(cl);
+    else if (cl->batch)
+      batch_abort(cl->batch);
+    else
+      client_idle(cl);
+  }
+  return 0;
+}
+
+static int serve_listen(const char *path) {
+  struct sockaddr_un addr;
+  if (socket_address(path, &addr) != 0)
+    return -1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    perror("socket");
+    return -1;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0) {
+    fprintf(stderr, "A daemon is already listening on %s\n", path);
+    close(fd);
+    return -1;
+  }
+
+  struct stat st;
+  if (lstat(path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      fprintf(stderr, "%s exists and is not a socket\n", path);
+      close(fd);
+      return -1;
+    }
+    unlink(path);
+  }
+
+  mode_t mask = umask(077);
+  int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(mask);
+  if (rc != 0 || listen(fd, 64) != 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+    close(fd);
+    return -1;
+  }
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+  return fd;
+}
+
+int serve_run(const char *socket_path, char *const urls[], int url_count,
+              const BatchOptions *opts) {
+  int lfd = serve_listen(socket_path);
+  if (lfd < 0)
+    return 1;
+
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = serve_signal;
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+  signal(SIGPIPE, SIG_IGN);
+
+  ServeClient *clients = NULL;
+  struct curl_waitfd *wfds = NULL;
+  unsigned int wfd_cap = 0;
+  time_t synced = time(NULL);
+  serve_stop = 0;
+  while (!serve_stop || clients) {
+    int listening = !serve_stop;
+    unsigned int n = 0, count = 1;
+    for (ServeClient *cl = clients; cl; cl = cl->next)
+      count++;
+    if (count > wfd_cap) {
+      struct curl_waitfd *grown = realloc(wfds, count * sizeof(*wfds));
+      if (!grown)
+        break;
+      wfds = grown;
+      wfd_cap = count;
+    }
+
+    if (listening)
+      wfds[n++] = (struct curl_waitfd){lfd, CURL_WAIT_POLLIN, 0};
+    for (ServeClient *cl = clients; cl; cl = cl->next) {
+      short events = client_reading(cl) ? CURL_WAIT_POLLIN : 0;
+      if (cl->fd >= 0 && cl->out_sent < cl->out_len)
+        events |= CURL_WAIT_POLLOUT;
+      wfds[n++] = (struct curl_waitfd){cl->fd, events, 0};
+    }
+    fetch_poll(wfds, n, 1000);
+
+    unsigned int i = listening;
+    for (ServeClient **link = &clients; *link; ++i) {
+      ServeClient *cl = *link;
+      if (serve_stop && !cl->finished && cl->fd >= 0 && !cl->batch &&
+          !cl->closure)
+        client_drop(cl);
+      if (client_step(cl, wfds[i].revents, urls, url_count, opts)) {
+        *link = cl->next;
+        client_close(cl);
+      } else {
+        link = &cl->next;
+      }
+    }
+
+    while (listening && (wfds[0].revents & CURL_WAIT_POLLIN)) {
+      int fd = accept(lfd, NULL, NULL);
+      if (fd < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR &&
+            errno != ECONNABORTED)
+          perror("accept");
+        break;
+      }
+      fcntl(fd, F_SETFD, FD_CLOEXEC);
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+      ServeClient *cl = client_open(fd);
+      if (!cl) {
+        close(fd);
+        break;
+      }
+      cl->next = clients;
+      clients = cl;
+    }
+
+    if (narcache_pending() >= SERVE_SYNC_ENTRIES ||
+        (narcache_pending() > 0 && time(NULL) - synced >= SERVE_SYNC_SECONDS)) {
+      narcache_sync();
+      synced = time(NULL);
+    }
+  }
+
+  free(wfds);
+  close(lfd);
+  unlink(socket_path);
+  return 0;
+}
+
+static int write_all(int fd, const char *buf, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int serve_query(const char *socket_path, ServeOp op, OutputFormat format,
+                const char *hash, int in_fd, FILE *out) {
+  struct sockaddr_un addr;
+  char header[SERVE_HEADER_MAX];
+
+  if (socket_address(socket_path, &addr) != 0)
+    return 1;
+
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+    fprintf(stderr, "Could not connect to %s: %s\n", socket_path,
+            strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+
+  if (op == SERVE_CLOSURE)
+    snprintf(header, sizeof(header), "closure %s %s\n", format_name(format),
+             hash);
+  else if (op == SERVE_EXISTS)
+    snprintf(header, sizeof(header), "exists %s\n", format_name(format));
+  else
+    snprintf(header, sizeof(header), "lookup %s\n", format_name(format));
+
+  if (write_all(fd, header, strlen(header)) != 0) {
+    perror("write");
+    close(fd);
+    return 1;
+  }
+  if (in_fd < 0)
+    shutdown(fd, SHUT_WR);
+  fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+  static char in_buf[SERVE_BUF_SIZE];
+  static char buf[SERVE_BUF_SIZE];
+  size_t in_len = 0, in_off = 0;
+  int in_eof = in_fd < 0;
+  int state = 0;
+  int status = -1;
+
+  while (1) {
+    struct pollfd pfd[2] = {{fd, POLLIN, 0}, {in_fd, POLLIN, 0}};
+    int want_input = !in_eof && in_off == in_len;
+    if (in_off < in_len)
+      pfd[0].events |= POLLOUT;
+
+    if (poll(pfd, want_input ? 2 : 1, -1) < 0) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+
+    if (want_input && pfd[1].revents) {
+      ssize_t n = read(in_fd, in_buf, sizeof(in_buf));
+      if (n > 0) {
+        in_len = n;
+        in_off = 0;
+      } else if (n == 0 || errno != EINTR) {
+        in_eof = 1;
+        shutdown(fd, SHUT_WR);
+      }
+    }
+
+    if (pfd[0].revents & POLLOUT) {
+      ssize_t n = write(fd, in_buf + in_off, in_len - in_off);
+      if (n > 0)
+        in_off += n;
+      else if (errno != EAGAIN && errno != EINTR)
+        break;
+    }
+
+    if (!(pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+      continue;
+
+    ssize_t n = read(fd, buf, sizeof(buf));
+    if (n < 0 && (errno == EAGAIN || errno == EINTR))
+      continue;
+    if (n <= 0)
+      break;
+
+    for (ssize_t i = 0; i < n;) {
+      if (state == 0) {
+        char *nul = memchr(buf + i, '\0', n - i);
+        ssize_t end = nul ? nul - buf : n;
+        fwrite(buf + i, 1, end - i, out);
+        i = nul ? end + 1 : end;
+        state = nul ? 1 : 0;
+      } else if (state == 1) {
+        status = (unsigned char)buf[i++];
+        state = 2;
+      } else {
+        fwrite(buf + i, 1, n - i, stderr);
+        i = n;
+      }
+    }
+  }
+
+  close(fd);
+  fflush(out);
+  if (status < 0) {
+    fprintf(stderr, "Connection to %s closed before the reply was complete\n",
+            socket_path);
+    return 1;
+  }
+  return status;
+}
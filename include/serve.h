@@ -0,0 +1,18 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include "batch.h"
+#include <stdio.h>
+
+#define SERVE_SYNC_ENTRIES 4096
+#define SERVE_SYNC_SECONDS 300
+#define SERVE_IDLE_SECONDS 10
+
+typedef enum { SERVE_LOOKUP, SERVE_EXISTS, SERVE_CLOSURE } ServeOp;
+
+int serve_run(const char *socket_path, char *const urls[], int url_count,
+              const BatchOptions *opts);
+int serve_query(const char *socket_path, ServeOp op, OutputFormat format,
+                const char *hash, int in_fd, FILE *out);
+
+#endif
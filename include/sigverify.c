@@ -0,0 +1,326 @@
+#include "sigverify.h"
+#include "fetch.h"
+#include <ctype.h>
+#include <openssl/evp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ED25519_KEY_LEN 32
+#define ED25519_SIG_LEN 64
+
+typedef struct {
+  char name[128];
+  size_t name_len;
+  EVP_PKEY *pkey;
+} SigKey;
+
+static SigKey keys[SIGVERIFY_MAX_KEYS];
+static int key_count = 0;
+
+static pthread_t workers[SIGVERIFY_MAX_THREADS];
+static int worker_count = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_ready = PTHREAD_COND_INITIALIZER;
+static SigJob *queue_head = NULL;
+static SigJob *queue_tail = NULL;
+static SigJob *done_jobs = NULL;
+static int stopping = 0;
+
+static int base64_decode(const char *in, size_t len, unsigned char *out,
+                         size_t outlen) {
+  unsigned char buf[128];
+  if (len == 0 || len % 4 != 0 || len / 4 * 3 > sizeof(buf))
+    return -1;
+
+  int n = EVP_DecodeBlock(buf, (const unsigned char *)in, (int)len);
+  if (n < 0)
+    return -1;
+  while (len > 0 && in[len - 1] == '=') {
+    len--;
+    n--;
+  }
+  if ((size_t)n != outlen)
+    return -1;
+  memcpy(out, buf, outlen);
+  return 0;
+}
+
+static const SigKey *find_key(const char *name, size_t len) {
+  for (int i = 0; i < key_count; ++i) {
+    if (keys[i].name_len == len && memcmp(keys[i].name, name, len) == 0)
+      return &keys[i];
+  }
+  return NULL;
+}
+
+static int add_key(const char *spec, size_t len) {
+  unsigned char raw[ED25519_KEY_LEN];
+  const char *colon = memchr(spec, ':', len);
+
+  if (!colon || colon == spec ||
+      (size_t)(colon - spec) >= sizeof(keys[0].name) ||
+      key_count == SIGVERIFY_MAX_KEYS)
+    return -1;
+
+  size_t name_len = colon - spec;
+  if (find_key(spec, name_len))
+    return 0;
+  if (base64_decode(colon + 1, len - name_len - 1, raw, sizeof(raw)) != 0)
+    return -1;
+
+  EVP_PKEY *pkey =
+      EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, NULL, raw, sizeof(raw));
+  if (!pkey)
+    return -1;
+
+  SigKey *key = &keys[key_count++];
+  memcpy(key->name, spec, name_len);
+  key->name[name_len] = '\0';
+  key->name_len = name_len;
+  key->pkey = pkey;
+  return 0;
+}
+
+int sigverify_add_key(const char *spec) { return add_key(spec, strlen(spec)); }
+
+int sigverify_add_keys(const char *list) {
+  int added = 0;
+  while (*list) {
+    while (isspace((unsigned char)*list))
+      list++;
+    size_t len = 0;
+    while (list[len] && !isspace((unsigned char)list[len]))
+      len++;
+    if (len > 0 && add_key(list, len) == 0)
+      added++;
+    list += len;
+  }
+  return added;
+}
+
+int sigverify_load_nix_conf(const char *path) {
+  char line[4096];
+  FILE *f = fopen(path, "r");
+  int added = 0;
+
+  if (!f)
+    return -1;
+
+  while (fgets(line, sizeof(line), f)) {
+    char *p = line;
+    while (isspace((unsigned char)*p))
+      p++;
+    if (strncmp(p, "extra-", 6) == 0)
+      p += 6;
+    if (strncmp(p, "trusted-public-keys", 19) != 0)
+      continue;
+    p += 19;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    if (*p++ != '=')
+      continue;
+    added += sigverify_add_keys(p);
+  }
+  fclose(f);
+  return added;
+}
+
+int sigverify_key_count(void) { return key_count; }
+
+static SigStatus verify_job(SigJob *job, EVP_MD_CTX *ctx) {
+  SigStatus status = job->sig_count > 0 ? SIG_UNTRUSTED : SIG_UNSIGNED;
+
+  for (int i = 0; i < job->sig_count; ++i) {
+    StrView sig = job->sigs[i];
+    const char *colon = memchr(sig.ptr, ':', sig.len);
+    if (!colon)
+      continue;
+
+    const SigKey *key = find_key(sig.ptr, colon - sig.ptr);
+    if (!key)
+      continue;
+
+    unsigned char raw[ED25519_SIG_LEN];
+    status = SIG_INVALID;
+    if (base64_decode(colon + 1, sig.len - (colon - sig.ptr) - 1, raw,
+                      sizeof(raw)) != 0)
+      continue;
+
+    EVP_MD_CTX_reset(ctx);
+    if (EVP_DigestVerifyInit(ctx, NULL, NULL, NULL, key->pkey) == 1 &&
+        EVP_DigestVerify(ctx, raw, sizeof(raw),
+                         (const unsigned char *)job->fingerprint,
+                         job->fingerprint_len) == 1)
+      return SIG_VALID;
+  }
+  return status;
+}
+
+SigStatus sigverify_check(SigJob *job) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  job->status = ctx ? verify_job(job, ctx) : SIG_INVALID;
+  EVP_MD_CTX_free(ctx);
+  return job->status;
+}
+
+int sigverify_prepare(SigJob *job, const Narinfo *info, Arena *arena) {
+  StrView store_path = info->store_path;
+  size_t dir_len = store_path.len;
+  while (dir_len > 0 && store_path.ptr[dir_len - 1] != '/')
+    dir_len--;
+
+  size_t cap = store_path.len + info->nar_hash.len + 32;
+  for (int i = 0; i < info->reference_count; ++i)
+    cap += dir_len + info->references[i].len + 1;
+  for (int i = 0; i < info->sig_count; ++i)
+    cap += info->sigs[i].len;
+
+  memset(job, 0, sizeof(*job));
+  char *buf = arena_alloc(arena, cap);
+  if (!buf)
+    return -1;
+
+  int n = snprintf(buf, cap, "1;%.*s;%.*s;%llu;", (int)store_path.len,
+                   store_path.ptr, (int)info->nar_hash.len,
+                   info->nar_hash.ptr, (unsigned long long)info->nar_size);
+  size_t len = n;
+  for (int i = 0; i < info->reference_count; ++i) {
+    if (i > 0)
+      buf[len++] = ',';
+    memcpy(buf + len, store_path.ptr, dir_len);
+    len += dir_len;
+    memcpy(buf + len, info->references[i].ptr, info->references[i].len);
+    len += info->references[i].len;
+  }
+  job->fingerprint = buf;
+  job->fingerprint_len = len;
+
+  for (int i = 0; i < info->sig_count; ++i) {
+    memcpy(buf + len, info->sigs[i].ptr, info->sigs[i].len);
+    job->sigs[i].ptr = buf + len;
+    job->sigs[i].len = info->sigs[i].len;
+    len += info->sigs[i].len;
+  }
+  job->sig_count = info->sig_count;
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+  (void)arg;
+
+  pthread_mutex_lock(&queue_lock);
+  while (1) {
+    while (!queue_head && !stopping)
+      pthread_cond_wait(&queue_ready, &queue_lock);
+    if (!queue_head)
+      break;
+
+    SigJob *job = queue_head;
+    queue_head = job->next;
+    if (!queue_head)
+      queue_tail = NULL;
+    pthread_mutex_unlock(&queue_lock);
+
+    job->status = ctx ? verify_job(job, ctx) : SIG_INVALID;
+
+    pthread_mutex_lock(&queue_lock);
+    job->next = done_jobs;
+    done_jobs = job;
+    fetch_wakeup();
+  }
+  pthread_mutex_unlock(&queue_lock);
+
+  EVP_MD_CTX_free(ctx);
+  return NULL;
+}
+
+static void sigverify_drain(void) {
+  pthread_mutex_lock(&queue_lock);
+  SigJob *jobs = done_jobs;
+  done_jobs = NULL;
+  pthread_mutex_unlock(&queue_lock);
+
+  SigJob *ordered = NULL;
+  while (jobs) {
+    SigJob *next = jobs->next;
+    jobs->next = ordered;
+    ordered = jobs;
+    jobs = next;
+  }
+
+  while (ordered) {
+    SigJob *job = ordered;
+    ordered = job->next;
+    fetch_hold(-1);
+    job->on_done(job);
+  }
+}
+
+int sigverify_start(int threads) {
+  if (threads > SIGVERIFY_MAX_THREADS)
+    threads = SIGVERIFY_MAX_THREADS;
+
+  stopping = 0;
+  for (worker_count = 0; worker_count < threads; ++worker_count) {
+    if (pthread_create(&workers[worker_count], NULL, worker_main, NULL) != 0)
+      break;
+  }
+  if (worker_count > 0)
+    fetch_set_wakeup(sigverify_drain);
+  return worker_count;
+}
+
+void sigverify_stop(void) {
+  pthread_mutex_lock(&queue_lock);
+  stopping = 1;
+  pthread_cond_broadcast(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+
+  for (int i = 0; i < worker_count; ++i)
+    pthread_join(workers[i], NULL);
+  if (worker_count > 0)
+    fetch_set_wakeup(NULL);
+  worker_count = 0;
+
+  for (int i = 0; i < key_count; ++i)
+    EVP_PKEY_free(keys[i].pkey);
+  key_count = 0;
+}
+
+void sigverify_submit(SigJob *job) {
+  if (worker_count == 0) {
+    sigverify_check(job);
+    job->on_done(job);
+    return;
+  }
+
+  job->next = NULL;
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail)
+    queue_tail->next = job;
+  else
+    queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_ready);
+  pthread_mutex_unlock(&queue_lock);
+  fetch_hold(1);
+}
+
+const char *sigverify_status_name(SigStatus status) {
+  switch (status) {
+  case SIG_UNCHECKED:
+    return "unchecked";
+  case SIG_UNSIGNED:
+    return "unsigned";
+  case SIG_UNTRUSTED:
+    return "untrusted";
+  case SIG_INVALID:
+    return "invalid";
+  case SIG_VALID:
+    return "valid";
+  }
+  return "";
+}
@@ -0,0 +1,44 @@
+#ifndef SIGVERIFY_H
+#define SIGVERIFY_H
+
+#include "arena.h"
+#include "narinfo.h"
+
+#define SIGVERIFY_MAX_KEYS 32
+#define SIGVERIFY_MAX_THREADS 16
+#define SIGVERIFY_DEFAULT_KEY                                                  \
+  "cache.nixos.org-1:6NCHdD59X431o0gWypbMrAURkbJ16ZPMQFGspcDShjY="
+
+typedef enum {
+  SIG_UNCHECKED,
+  SIG_UNSIGNED,
+  SIG_UNTRUSTED,
+  SIG_INVALID,
+  SIG_VALID,
+} SigStatus;
+
+typedef struct SigJob {
+  const char *fingerprint;
+  size_t fingerprint_len;
+  StrView sigs[NARINFO_MAX_SIGS];
+  int sig_count;
+  SigStatus status;
+  void (*on_done)(struct SigJob *job);
+  void *data;
+  struct SigJob *next;
+} SigJob;
+
+int sigverify_add_key(const char *spec);
+int sigverify_add_keys(const char *list);
+int sigverify_load_nix_conf(const char *path);
+int sigverify_key_count(void);
+
+int sigverify_start(int threads);
+void sigverify_stop(void);
+
+int sigverify_prepare(SigJob *job, const Narinfo *info, Arena *arena);
+SigStatus sigverify_check(SigJob *job);
+void sigverify_submit(SigJob *job);
+const char *sigverify_status_name(SigStatus status);
+
+#endif
@@ -0,0 +1,99 @@
+#include "store.h"
+#include "pathindex.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static const char nix_base32_chars[] = "0123456789abcdfghijklmnpqrsvwxyz";
+
+static char store_dirs[MAX_STORE_DIRS][256] = {DEFAULT_STORE_DIR};
+static int store_dir_count = 1;
+
+void store_add_dir(const char *dir) {
+  size_t len = strlen(dir);
+  while (len > 1 && dir[len - 1] == '/')
+    len--;
+  if (len == 0 || len >= sizeof(store_dirs[0]))
+    return;
+
+  for (int i = 0; i < store_dir_count; ++i) {
+    if (strlen(store_dirs[i]) == len && strncmp(store_dirs[i], dir, len) == 0)
+      return;
+  }
+  if (store_dir_count < MAX_STORE_DIRS) {
+    memcpy(store_dirs[store_dir_count], dir, len);
+    store_dirs[store_dir_count][len] = '\0';
+    store_dir_count++;
+  }
+}
+
+const char *store_path_hash(const char *path) {
+  for (int i = 0; i < store_dir_count; ++i) {
+    size_t len = strlen(store_dirs[i]);
+    if (strncmp(path, store_dirs[i], len) == 0 && path[len] == '/' &&
+        strlen(path + len + 1) >= HASH_LEN &&
+        is_store_hash(path + len + 1, HASH_LEN))
+      return path + len + 1;
+  }
+  return NULL;
+}
+
+int find_executable(const char *prog, char *out, size_t outlen) {
+  if (strchr(prog, '/')) {
+    if (access(prog, X_OK) == 0) {
+      if (realpath(prog, out) == NULL)
+        return -1;
+      return 0;
+    }
+    return -1;
+  }
+
+  pathindex_refresh();
+  const char *resolved = pathindex_find(prog);
+  if (!resolved)
+    return -1;
+  snprintf(out, outlen, "%s", resolved);
+  return 0;
+}
+
+int extract_hash(const char *real, char *out, size_t outlen) {
+  const char *hash = store_path_hash(real);
+  if (!hash || outlen < HASH_LEN + 1)
+    return -1;
+  memcpy(out, hash, HASH_LEN);
+  out[HASH_LEN] = '\0';
+  return 0;
+}
+
+int is_store_hash(const char *s, size_t len) {
+  if (len != HASH_LEN)
+    return 0;
+  for (size_t i = 0; i < len; ++i) {
+    if (!s[i] || !strchr(nix_base32_chars, s[i]))
+      return 0;
+  }
+  return 1;
+}
+
+int resolve_store_input(const char *input, char *path, size_t pathlen,
+                        char *hash) {
+  if (is_store_hash(input, strlen(input))) {
+    snprintf(path, pathlen, "%s", input);
+    strcpy(hash, input);
+    return RESOLVE_OK;
+  }
+
+  if (find_executable(input, path, pathlen) == 0) {
+    if (extract_hash(path, hash, HASH_LEN + 1) != 0)
+      return RESOLVE_NO_HASH;
+    return RESOLVE_OK;
+  }
+
+  if (extract_hash(input, hash, HASH_LEN + 1) == 0) {
+    snprintf(path, pathlen, "%s", input);
+    return RESOLVE_OK;
+  }
+  return RESOLVE_NOT_FOUND;
+}
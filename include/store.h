@@ -0,0 +1,24 @@
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+
+#define HASH_LEN 32
+#define MAX_STORE_DIRS 8
+#define DEFAULT_STORE_DIR "/nix/store"
+
+enum {
+  RESOLVE_OK = 0,
+  RESOLVE_NOT_FOUND = -1,
+  RESOLVE_NO_HASH = -2,
+};
+
+void store_add_dir(const char *dir);
+const char *store_path_hash(const char *path);
+int find_executable(const char *prog, char *out, size_t outlen);
+int extract_hash(const char *real, char *out, size_t outlen);
+int is_store_hash(const char *s, size_t len);
+int resolve_store_input(const char *input, char *path, size_t pathlen,
+                        char *hash);
+
+#endif
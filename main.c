@@ -1,5 +1,22 @@
+#include "include/arena.h"
+#include "include/batch.h"
+#include "include/cacheinfo.h"
 #include "include/clipboard.h"
-#include <curl/curl.h>
+#include "include/closure.h"
+#include "include/fetch.h"
+#include "include/localstore.h"
+#include "include/narfetch.h"
+#include "include/narlisting.h"
+#include "include/narcache.h"
+#include "include/narinfo.h"
+#include "include/pathindex.h"
+#include "include/search.h"
+#include "include/serve.h"
+#include "include/sigverify.h"
+#include "include/store.h"
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <locale.h>
@@ -10,139 +27,89 @@
 #include <unistd.h>
 
 #define MAX_RESULTS 16
-#define HASH_START 11
-#define HASH_LEN 32
+#define COMPLETION_ROWS 8
+#define HISTORY_MAX 32
+#define PREFETCH_MAX 64
+
+typedef enum {
+  RESULT_PENDING,
+  RESULT_HIT,
+  RESULT_MISS,
+  RESULT_FAILED,
+  RESULT_SKIPPED,
+} ResultState;
+
+typedef struct Lookup Lookup;
 
 typedef struct {
-  char url[256];
+  Lookup *owner;
+  const char *url;
+  char *narinfo;
+  Narinfo info;
+  StrView *view;
+  int view_count;
+  int ref_first;
+  int ref_count;
+  SigStatus sig;
+  NarListing *listing;
+  ResultState state;
+  int prefetched;
+  FetchRequest req;
+} NarinfoResult;
+
+struct Lookup {
   char name[128];
   char resolved_path[PATH_MAX];
   char hash[HASH_LEN + 1];
-  char *narinfo;
-  int narinfo_lines;
-  char **narinfo_view;
-} NarinfoResult;
+  int loaded;
+  int current;
+  int cursor;
+  FetchGroup group;
+  Arena arena;
+  NarinfoResult results[MAX_RESULTS];
+};
 
 typedef struct {
   char *key;
   char *desc;
 } StatusItem;
 
-struct string {
-  char *ptr;
-  size_t len;
+enum {
+  OPT_RACE = 256,
+  OPT_STAGGER,
+  OPT_NO_CACHE,
+  OPT_REFRESH,
+  OPT_TTL,
+  OPT_NEGATIVE_TTL,
+  OPT_LOCAL,
+  OPT_STORE_DB,
+  OPT_VERIFY,
+  OPT_TRUSTED_KEY,
+  OPT_EXISTS,
+  OPT_SERVE,
+  OPT_CONNECT,
+  OPT_CONNECT_TIMEOUT,
+  OPT_TIMEOUT,
+  OPT_BUDGET,
+  OPT_HEDGE,
+  OPT_MIRROR,
 };
 
+typedef struct {
+  int option;
+  const char *arg;
+} FetchOption;
+
 static char *cache_urls[MAX_RESULTS];
 static int cache_count = 0;
-
-void init_string(struct string *s) {
-  s->len = 0;
-  s->ptr = malloc(1);
-  if (s->ptr)
-    s->ptr[0] = '\0';
-}
-
-size_t writefunc(void *ptr, size_t size, size_t nmemb, struct string *s) {
-  size_t new_len = s->len + size * nmemb;
-  char *p = realloc(s->ptr, new_len + 1);
-  if (!p)
-    return 0;
-  s->ptr = p;
-  memcpy(s->ptr + s->len, ptr, size * nmemb);
-  s->ptr[new_len] = '\0';
-  s->len = new_len;
-  return size * nmemb;
-}
-
-int find_executable(const char *prog, char *out, size_t outlen) {
-  if (strchr(prog, '/')) {
-    if (access(prog, X_OK) == 0) {
-      if (realpath(prog, out) == NULL)
-        return -1;
-      return 0;
-    }
-    return -1;
-  }
-
-  char *path = getenv("PATH");
-  if (!path)
-    return -1;
-
-  char *paths = strdup(path);
-  if (!paths)
-    return -1;
-
-  char *tok = strtok(paths, ":");
-  while (tok) {
-    snprintf(out, outlen, "%s/%s", tok, prog);
-    if (access(out, X_OK) == 0) {
-      char real[PATH_MAX];
-      if (realpath(out, real)) {
-        strncpy(out, real, outlen - 1);
-        out[outlen - 1] = '\0';
-      }
-      free(paths);
-      return 0;
-    }
-    tok = strtok(NULL, ":");
-  }
-  free(paths);
-  return -1;
-}
-
-int extract_hash(const char *real, char *out, size_t outlen) {
-  size_t len = strlen(real);
-  if (len < HASH_START + HASH_LEN)
-    return -1;
-  strncpy(out, real + HASH_START, HASH_LEN);
-  out[HASH_LEN] = '\0';
-  return 0;
-}
-
-int fetch_narinfo(const char *base_url, const char *hash,
-                  struct string *response, char *errbuf, size_t errlen) {
-  CURL *curl = curl_easy_init();
-  if (!curl)
-    return -1;
-
-  char url[512];
-  snprintf(url, sizeof(url), "%s/%s.narinfo", base_url, hash);
-
-  curl_easy_setopt(curl, CURLOPT_URL, url);
-  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, writefunc);
-  curl_easy_setopt(curl, CURLOPT_WRITEDATA, response);
-  curl_easy_setopt(curl, CURLOPT_USERAGENT, "narnia/1.0");
-  curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
-  curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, errbuf);
-
-  CURLcode res = curl_easy_perform(curl);
-  curl_easy_cleanup(curl);
-  return (res == CURLE_OK) ? 0 : -1;
-}
-
-int split_lines(char *buf, char ***view) {
-  int lines = 0;
-  for (char *p = buf; *p; ++p) {
-    if (*p == '\n')
-      ++lines;
-  }
-
-  char **arr = malloc(sizeof(char *) * (lines + 2));
-  if (!arr)
-    return -1;
-
-  int l = 0;
-  char *saveptr, *tok = strtok_r(buf, "\n", &saveptr);
-  while (tok) {
-    arr[l++] = tok;
-    tok = strtok_r(NULL, "\n", &saveptr);
-  }
-  arr[l] = NULL;
-  *view = arr;
-  return l;
-}
+static Lookup *lookup;
+static Lookup *history[HISTORY_MAX];
+static int history_count = 0;
+static Lookup *prefetched[PREFETCH_MAX];
+static int prefetched_count = 0;
+static int results_changed = 0;
+static FetchOption fetch_options[2 * MAX_RESULTS];
+static int fetch_option_count = 0;
 
 void draw_centered_bordered_win(WINDOW **outwin, int height, int width,
                                 int maxy, int maxx) {
@@ -153,25 +120,108 @@ void draw_centered_bordered_win(WINDOW **outwin, int height, int width,
   wrefresh(*outwin);
 }
 
-void show_centered_inputbox(const char *prompt, char *out, size_t outlen) {
+static void draw_completions(WINDOW *win, int width, int rows,
+                             const char *input, const char *names[], int count,
+                             int selected) {
+  int input_width = width - 6;
+  size_t len = strlen(input);
+  const char *visible =
+      (int)len > input_width ? input + len - input_width : input;
+
+  mvwhline(win, 3, 1, ' ', width - 2);
+  mvwprintw(win, 3, 3, "%s", visible);
+
+  for (int i = 0; i < rows; ++i) {
+    mvwhline(win, 5 + i, 1, ' ', width - 2);
+    if (i >= count)
+      continue;
+
+    const char *resolved = pathindex_find(names[i]);
+    char row[512];
+    snprintf(row, sizeof(row), "%-24s %s", names[i], resolved ? resolved : "");
+    if (i == selected)
+      wattron(win, A_REVERSE);
+    mvwprintw(win, 5 + i, 2, "%.*s", width - 4, row);
+    if (i == selected)
+      wattroff(win, A_REVERSE);
+  }
+
+  wmove(win, 3, 3 + (int)strlen(visible));
+  wrefresh(win);
+}
+
+void show_centered_inputbox(const char *prompt, char *out, size_t outlen,
+                            void (*on_pick)(const char *name)) {
   int maxy, maxx;
   getmaxyx(stdscr, maxy, maxx);
   int width = strlen(prompt) + 32;
-  if (width < 40)
-    width = 40;
-  int height = 5;
+  if (width < 60)
+    width = 60;
+  if (width > maxx)
+    width = maxx;
+  int height = 6 + COMPLETION_ROWS;
+  if (height > maxy)
+    height = maxy;
+  int rows = height - 6 > 0 ? height - 6 : 0;
 
   WINDOW *win;
   draw_centered_bordered_win(&win, height, width, maxy, maxx);
   mvwprintw(win, 1, (width - strlen(prompt)) / 2, "%s", prompt);
+  if (rows > 0)
+    mvwhline(win, 4, 1, 0, width - 2);
+  keypad(win, 1);
+  nodelay(win, 1);
+  pathindex_refresh();
+
+  const char *names[COMPLETION_ROWS];
+  char picked[256] = {0};
+  size_t len = strlen(out);
+  int count = 0;
+  int selected = -1;
+  int dirty = 1;
+  int done = 0;
+
+  while (!done) {
+    if (dirty) {
+      count = strchr(out, '/') ? 0 : pathindex_complete(out, names, rows);
+      if (selected >= count)
+        selected = -1;
+      draw_completions(win, width, rows, out, names, count, selected);
+      dirty = 0;
+    }
 
-  int input_width = width - 6;
-  int input_x = 3;
-  wmove(win, 3, input_x);
+    int ch = wgetch(win);
+    if (ch == ERR) {
+      struct curl_waitfd wfd = {STDIN_FILENO, CURL_WAIT_POLLIN, 0};
+      fetch_poll(&wfd, 1, 1000);
+      continue;
+    }
 
-  echo();
-  wgetnstr(win, out, outlen - 1);
-  noecho();
+    dirty = 1;
+    if (ch == '\n' || ch == KEY_ENTER) {
+      if (selected >= 0)
+        snprintf(out, outlen, "%s", picked);
+      done = 1;
+    } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+      if (len > 0)
+        out[--len] = '\0';
+      selected = -1;
+    } else if ((ch == '\t' || ch == KEY_DOWN) && count > 0) {
+      selected = (selected + 1) % count;
+      snprintf(picked, sizeof(picked), "%s", names[selected]);
+      if (on_pick)
+        on_pick(picked);
+    } else if ((ch == KEY_BTAB || ch == KEY_UP) && count > 0) {
+      selected = selected <= 0 ? count - 1 : selected - 1;
+      snprintf(picked, sizeof(picked), "%s", names[selected]);
+      if (on_pick)
+        on_pick(picked);
+    } else if (ch < 256 && isprint(ch) && len + 1 < outlen) {
+      out[len++] = ch;
+      out[len] = '\0';
+      selected = -1;
+    }
+  }
 
   delwin(win);
   clear();
@@ -218,200 +268,1103 @@ void show_main_borders(void) {
 }
 
 void free_narinfo(NarinfoResult *res) {
-  if (res->narinfo_view)
-    free(res->narinfo_view);
-  if (res->narinfo)
-    free(res->narinfo);
+  fetch_request_free(&res->req);
+  narinfo_free(&res->info);
   res->narinfo = NULL;
-  res->narinfo_view = NULL;
+  if (res->listing) {
+    listing_free(res->listing);
+    free(res->listing);
+    res->listing = NULL;
+  }
+}
+
+static Lookup *lookup_new(void) {
+  Lookup *l = calloc(1, sizeof(*l));
+  if (l)
+    arena_init(&l->arena, 0);
+  return l;
+}
+
+static void lookup_reset(Lookup *l) {
+  for (int i = 0; i < l->loaded; ++i)
+    free_narinfo(&l->results[i]);
+  l->loaded = 0;
+  arena_reset(&l->arena);
 }
 
-void clipboard_copy(const char *str) {
-  if (clipboard_set_text(str) != 0) {
-    show_status("Failed to copy to clipboard");
-    napms(1000);
+static void lookup_free(Lookup *l) {
+  lookup_reset(l);
+  arena_free(&l->arena);
+  free(l);
+}
+
+static void release_lookup(void) {
+  while (history_count > 0)
+    lookup_free(history[--history_count]);
+  while (prefetched_count > 0)
+    lookup_free(prefetched[--prefetched_count]);
+  lookup_reset(lookup);
+}
+
+const char *clipboard_copy(const char *str) {
+  return clipboard_set_text(str) == 0 ? "Copied to clipboard!"
+                                      : "Failed to copy to clipboard";
+}
+
+static void build_view(NarinfoResult *res) {
+  const Narinfo *info = &res->info;
+  int count = info->line_count + info->reference_count;
+
+  res->view =
+      arena_alloc(&res->owner->arena, (count ? count : 1) * sizeof(StrView));
+  if (!res->view) {
+    res->view = info->lines;
+    res->view_count = info->line_count;
+    return;
+  }
+
+  int n = 0;
+  for (int i = 0; i < info->line_count; ++i) {
+    StrView line = info->lines[i];
+    if (info->reference_count > 0 && line.len >= 11 &&
+        memcmp(line.ptr, "References:", 11) == 0) {
+      res->view[n].ptr = line.ptr;
+      res->view[n++].len = 11;
+      res->ref_first = n;
+      res->ref_count = info->reference_count;
+      for (int r = 0; r < info->reference_count; ++r)
+        res->view[n++] = info->references[r];
+      continue;
+    }
+    res->view[n++] = line;
   }
+  res->view_count = n;
 }
 
-int process_executable(const char *input, NarinfoResult results[]) {
-  int loaded = 0;
+static void narinfo_done(FetchRequest *req) {
+  NarinfoResult *res = req->data;
+  char msg[512];
+
+  if (req->result == CURLE_OK) {
+    res->narinfo = req->response.ptr;
+    res->state = RESULT_HIT;
+  } else {
+    if (req->cancelled && req->group && req->group->winner) {
+      snprintf(msg, sizeof(msg), "Skipped: %s answered first\n",
+               req->group->winner->base_url);
+      res->state = RESULT_SKIPPED;
+    } else if (req->cancelled) {
+      snprintf(msg, sizeof(msg), "Cancelled\n");
+      res->state = RESULT_SKIPPED;
+    } else if (req->http_code == 404) {
+      snprintf(msg, sizeof(msg), "Not found in %s\n", res->url);
+      res->state = RESULT_MISS;
+    } else {
+      snprintf(msg, sizeof(msg), "Failed to fetch narinfo from %s: %s\n",
+               res->url,
+               req->errbuf[0] ? req->errbuf
+                              : curl_easy_strerror(req->result));
+      res->state = RESULT_FAILED;
+    }
+    string_free(&req->response);
+    res->narinfo = arena_strndup(&res->owner->arena, msg, strlen(msg));
+  }
+  req->response.ptr = NULL;
+
+  if (res->narinfo && narinfo_parse(res->narinfo, strlen(res->narinfo),
+                                    &res->info, &res->owner->arena) == 0) {
+    build_view(res);
+    if (res->state == RESULT_HIT && sigverify_key_count() > 0) {
+      SigJob job;
+      res->sig = sigverify_prepare(&job, &res->info, &res->owner->arena) == 0
+                     ? sigverify_check(&job)
+                     : SIG_INVALID;
+    }
+  }
+  if (res->owner == lookup)
+    results_changed = 1;
+}
 
+static int start_lookup(Lookup *l, const char *input,
+                        const char *resolved_path, const char *hash,
+                        int background) {
+  NarinfoResult *results = l->results;
+
+  snprintf(l->name, sizeof(l->name), "%s", input);
+  snprintf(l->resolved_path, sizeof(l->resolved_path), "%s", resolved_path);
+  strcpy(l->hash, hash);
+  l->loaded = cache_count;
+  l->current = 0;
+  l->cursor = 0;
+  fetch_group_init(&l->group);
   for (int repo = 0; repo < cache_count; ++repo) {
     NarinfoResult *res = &results[repo];
     memset(res, 0, sizeof(*res));
-    strncpy(res->url, cache_urls[repo], sizeof(res->url) - 1);
-    strncpy(res->name, input, sizeof(res->name) - 1);
-
-    show_status("Locating executable...");
-    if (find_executable(input, res->resolved_path,
-                        sizeof(res->resolved_path)) != 0) {
-      show_status("Executable not found or not executable. Press any key.");
-      getch();
-      break;
-    }
+    res->owner = l;
+    res->url = cache_urls[repo];
+    res->state = RESULT_PENDING;
+  }
 
-    show_status("Extracting hash...");
-    if (extract_hash(res->resolved_path, res->hash, sizeof(res->hash)) != 0) {
-      show_status("Could not extract hash from path. Press any key.");
-      getch();
-      break;
+  for (int repo = 0; repo < cache_count; ++repo) {
+    NarinfoResult *res = &results[repo];
+    fetch_narinfo_init(&res->req, cache_urls[repo], l->hash);
+    res->req.on_done = narinfo_done;
+    res->req.data = res;
+    res->req.arena = &l->arena;
+    res->req.background = background;
+    if (fetch_group_add(&l->group, &res->req) != 0) {
+      res->req.result = CURLE_FAILED_INIT;
+      narinfo_done(&res->req);
     }
+  }
+
+  return cache_count;
+}
 
-    show_status("Fetching narinfo...");
-    struct string response;
-    init_string(&response);
-    char errbuf[CURL_ERROR_SIZE] = {0};
-
-    if (fetch_narinfo(res->url, res->hash, &response, errbuf, sizeof(errbuf)) !=
-        0) {
-      char prompt[256];
-      snprintf(prompt, sizeof(prompt),
-               "Failed to fetch narinfo from %s. Press any key.", res->url);
-      show_status(prompt);
-      free(response.ptr);
-      loaded = repo;
-      getch();
+static void prefetch_executable(const char *name) {
+  char resolved_path[PATH_MAX];
+  char hash[HASH_LEN + 1];
+
+  if (lookup->loaded > 0 && strcmp(lookup->name, name) == 0)
+    return;
+  release_lookup();
+  if (resolve_store_input(name, resolved_path, sizeof(resolved_path), hash) ==
+      RESOLVE_OK)
+    start_lookup(lookup, name, resolved_path, hash, 0);
+}
+
+int process_executable(const char *input) {
+  char resolved_path[PATH_MAX];
+  char hash[HASH_LEN + 1];
+
+  if (lookup->loaded > 0 && strcmp(lookup->name, input) == 0)
+    return lookup->loaded;
+  release_lookup();
+
+  show_status("Locating executable...");
+  int rc = resolve_store_input(input, resolved_path, sizeof(resolved_path),
+                               hash);
+  if (rc == RESOLVE_NOT_FOUND) {
+    show_status("Executable not found or not executable. Press any key.");
+    getch();
+    return 0;
+  } else if (rc == RESOLVE_NO_HASH) {
+    show_status("Could not extract hash from path. Press any key.");
+    getch();
+    return 0;
+  }
+
+  return start_lookup(lookup, input, resolved_path, hash, 0);
+}
+
+static int reference_hash(StrView ref, char *hash) {
+  if (ref.len <= HASH_LEN || !is_store_hash(ref.ptr, HASH_LEN))
+    return -1;
+  memcpy(hash, ref.ptr, HASH_LEN);
+  hash[HASH_LEN] = '\0';
+  return 0;
+}
+
+static int find_prefetched(const char *hash) {
+  for (int i = 0; i < prefetched_count; ++i) {
+    if (strcmp(prefetched[i]->hash, hash) == 0)
+      return i;
+  }
+  return -1;
+}
+
+static Lookup *take_prefetched(int i) {
+  Lookup *l = prefetched[i];
+  prefetched[i] = prefetched[--prefetched_count];
+  return l;
+}
+
+static Lookup *start_reference(StrView ref, const NarinfoResult *parent,
+                               int background) {
+  char hash[HASH_LEN + 1];
+  char name[128];
+  char path[PATH_MAX];
+
+  if (reference_hash(ref, hash) != 0)
+    return NULL;
+
+  StrView dir = parent->info.store_path;
+  while (dir.len > 0 && dir.ptr[dir.len - 1] != '/')
+    dir.len--;
+  if (dir.len == 0) {
+    dir.ptr = DEFAULT_STORE_DIR "/";
+    dir.len = strlen(dir.ptr);
+  }
+  snprintf(name, sizeof(name), "%.*s", (int)(ref.len - HASH_LEN - 1),
+           ref.ptr + HASH_LEN + 1);
+  snprintf(path, sizeof(path), "%.*s%.*s", (int)dir.len, dir.ptr,
+           (int)ref.len, ref.ptr);
+
+  Lookup *l = lookup_new();
+  if (l)
+    start_lookup(l, name, path, hash, background);
+  return l;
+}
+
+static int is_reference_of(const NarinfoResult *res, const char *hash) {
+  for (int r = 0; r < res->info.reference_count; ++r) {
+    StrView ref = res->info.references[r];
+    if (ref.len > HASH_LEN && memcmp(ref.ptr, hash, HASH_LEN) == 0)
+      return 1;
+  }
+  return 0;
+}
+
+static void prefetch_references(NarinfoResult *res) {
+  res->prefetched = 1;
+  for (int i = 0; i < prefetched_count;) {
+    if (is_reference_of(res, prefetched[i]->hash))
+      i++;
+    else
+      lookup_free(take_prefetched(i));
+  }
+
+  for (int r = 0; r < res->info.reference_count; ++r) {
+    char hash[HASH_LEN + 1];
+    StrView ref = res->info.references[r];
+    if (prefetched_count == PREFETCH_MAX)
       break;
-    }
+    if (reference_hash(ref, hash) != 0 || strcmp(hash, lookup->hash) == 0 ||
+        find_prefetched(hash) >= 0)
+      continue;
+    Lookup *l = start_reference(ref, res, 1);
+    if (l)
+      prefetched[prefetched_count++] = l;
+  }
+}
 
-    res->narinfo = response.ptr;
-    res->narinfo_lines = split_lines(res->narinfo, &res->narinfo_view);
-    loaded = repo + 1;
+static void enter_lookup(Lookup *next) {
+  lookup = next;
+  for (int i = 0; i < next->loaded; ++i) {
+    fetch_promote(&next->results[i].req);
+    next->results[i].prefetched = 0;
   }
+}
+
+static int open_reference(StrView ref, const NarinfoResult *parent) {
+  char hash[HASH_LEN + 1];
 
-  return loaded;
+  if (reference_hash(ref, hash) != 0 || strcmp(hash, lookup->hash) == 0)
+    return -1;
+  int i = find_prefetched(hash);
+  Lookup *next = i >= 0 ? take_prefetched(i) : start_reference(ref, parent, 0);
+  if (!next)
+    return -1;
+
+  if (history_count == HISTORY_MAX) {
+    lookup_free(history[0]);
+    memmove(history, history + 1, (HISTORY_MAX - 1) * sizeof(*history));
+    history_count--;
+  }
+  next->current = lookup->current;
+  history[history_count++] = lookup;
+  enter_lookup(next);
+  return 0;
 }
 
-void show_narinfo_viewer(NarinfoResult results[], int loaded) {
-  int current = 0;
-  int selected_line = 0;
+static int close_reference(void) {
+  if (history_count == 0)
+    return -1;
+  if (prefetched_count < PREFETCH_MAX)
+    prefetched[prefetched_count++] = lookup;
+  else
+    lookup_free(lookup);
+  enter_lookup(history[--history_count]);
+  return 0;
+}
 
-  nodelay(stdscr, 0);
-  keypad(stdscr, 1);
+static const char *result_badge(const NarinfoResult *res) {
+  switch (res->state) {
+  case RESULT_PENDING:
+    return "pending";
+  case RESULT_HIT:
+    return "hit";
+  case RESULT_MISS:
+    return "miss";
+  case RESULT_FAILED:
+    return "failed";
+  case RESULT_SKIPPED:
+    return "skipped";
+  }
+  return "";
+}
 
-  while (1) {
-    clear();
-    int maxy, maxx;
-    getmaxyx(stdscr, maxy, maxx);
-    show_main_borders();
+static int count_results(NarinfoResult results[], int loaded,
+                         ResultState state) {
+  int n = 0;
+  for (int i = 0; i < loaded; ++i)
+    n += results[i].state == state;
+  return n;
+}
 
-    NarinfoResult *res = &results[current];
-
-    char exec_name[64];
-    char path_short[128];
-    char hash_short[16];
-    char url_short[64];
-
-    snprintf(exec_name, sizeof(exec_name), "%.60s", res->name);
-    snprintf(path_short, sizeof(path_short), "%.120s", res->resolved_path);
-    snprintf(hash_short, sizeof(hash_short), "%.12s", res->hash);
-    snprintf(url_short, sizeof(url_short), "%.60s", res->url);
-
-    mvprintw(1, 1, "Exec: %s Path: %s Hash: %s Src: %s [%d/%d]", exec_name,
-             path_short, hash_short, url_short, current + 1, loaded);
-
-    int lines_avail = maxy - 6;
-    int top = selected_line - lines_avail / 2;
-    if (top < 0)
-      top = 0;
-    if (top > res->narinfo_lines - lines_avail)
-      top = res->narinfo_lines - lines_avail;
-    if (top < 0)
-      top = 0;
-
-    for (int l = 0; l < lines_avail && (l + top) < res->narinfo_lines; ++l) {
-      if (l + top == selected_line) {
-        attron(A_REVERSE);
-        mvprintw(3 + l, 2, "%.*s", maxx - 4, res->narinfo_view[l + top]);
-        attroff(A_REVERSE);
-      } else {
-        mvprintw(3 + l, 2, "%.*s", maxx - 4, res->narinfo_view[l + top]);
-      }
+static void cancel_pending(NarinfoResult results[], int loaded) {
+  for (int i = 0; i < loaded; ++i) {
+    NarinfoResult *res = &results[i];
+    if (res->state != RESULT_PENDING)
+      continue;
+    fetch_cancel(&res->req);
+    res->req.cancelled = 1;
+    narinfo_done(&res->req);
+  }
+}
+
+static void format_timing(const NarinfoResult *res, char *buf, size_t len) {
+  const FetchTiming *t = &res->req.timing;
+
+  if (res->req.cached)
+    snprintf(buf, len, "from local cache");
+  else if (t->http_version == 0)
+    snprintf(buf, len, "%s", res->state == RESULT_PENDING ? "in flight" : "");
+  else
+    snprintf(buf, len,
+             "%s %ld, %lld B, dns %.1f, connect %.1f, tls %.1f, "
+             "ttfb %.1f, total %.1f ms",
+             fetch_http_version_name(t->http_version), res->req.http_code,
+             (long long)t->bytes, t->namelookup_ms, t->connect_ms,
+             t->appconnect_ms, t->starttransfer_ms, t->total_ms);
+}
+
+static void draw_timing_details(WINDOW *win, NarinfoResult results[],
+                                int loaded, int current) {
+  int width = getmaxx(win) - 2;
+  mvwprintw(win, 0, 1, "%-*.*s", width, width,
+            "Cache                                 State    HTTP      DNS  "
+            "Connect      TLS     TTFB    Total    Bytes");
+
+  for (int i = 0; i < loaded && 2 + i < getmaxy(win); ++i) {
+    const NarinfoResult *res = &results[i];
+    const FetchTiming *t = &res->req.timing;
+    char row[256];
+
+    if (res->req.cached || t->http_version == 0)
+      snprintf(row, sizeof(row), "%-37.37s %-8s %s", res->url,
+               result_badge(res),
+               res->req.cached ? "from local cache" : "-");
+    else
+      snprintf(row, sizeof(row),
+               "%-37.37s %-8s %-8s %6.1f %8.1f %8.1f %8.1f %8.1f %8lld",
+               res->url, result_badge(res),
+               fetch_http_version_name(t->http_version), t->namelookup_ms,
+               t->connect_ms, t->appconnect_ms, t->starttransfer_ms,
+               t->total_ms, (long long)t->bytes);
+
+    if (i == current)
+      wattron(win, A_REVERSE);
+    mvwprintw(win, 2 + i, 1, "%.*s", width, row);
+    if (i == current)
+      wattroff(win, A_REVERSE);
+  }
+}
+
+typedef void (*RowDrawer)(WINDOW *win, int y, int row, int selected,
+                          const void *data);
+
+typedef struct {
+  WINDOW *win;
+  int top;
+  int cursor;
+  int rows;
+  int valid;
+} Viewport;
+
+static void viewport_open(Viewport *vp) {
+  int maxy, maxx;
+  getmaxyx(stdscr, maxy, maxx);
+  int height = maxy > 7 ? maxy - 6 : 1;
+  int width = maxx > 3 ? maxx - 2 : 1;
+
+  if (vp->win) {
+    wresize(vp->win, height, width);
+  } else {
+    vp->win = newwin(height, width, 3, 1);
+    scrollok(vp->win, TRUE);
+    idlok(vp->win, TRUE);
+  }
+  vp->valid = 0;
+}
+
+static void viewport_close(Viewport *vp) {
+  if (vp->win)
+    delwin(vp->win);
+  vp->win = NULL;
+}
+
+static int viewport_top(const Viewport *vp, int rows, int cursor) {
+  int height = getmaxy(vp->win);
+  int top = vp->top;
+
+  if (!vp->valid || cursor < top - height / 2 ||
+      cursor >= top + height + height / 2)
+    top = cursor - height / 2;
+  else if (cursor < top)
+    top = cursor;
+  else if (cursor >= top + height)
+    top = cursor - height + 1;
+
+  if (top > rows - height)
+    top = rows - height;
+  return top < 0 ? 0 : top;
+}
+
+static void viewport_row(Viewport *vp, int y, int row, int rows, int cursor,
+                         RowDrawer draw, const void *data) {
+  if (y < 0 || y >= getmaxy(vp->win))
+    return;
+  wmove(vp->win, y, 0);
+  wclrtoeol(vp->win);
+  if (row >= 0 && row < rows)
+    draw(vp->win, y, row, row == cursor, data);
+}
+
+static void viewport_draw(Viewport *vp, int rows, int cursor, RowDrawer draw,
+                          const void *data) {
+  int height = getmaxy(vp->win);
+  int top = viewport_top(vp, rows, cursor);
+  int shift = top - vp->top;
+
+  if (!vp->valid || rows != vp->rows || shift >= height || -shift >= height) {
+    werase(vp->win);
+    for (int y = 0; y < height && top + y < rows; ++y)
+      draw(vp->win, y, top + y, top + y == cursor, data);
+  } else {
+    if (shift != 0) {
+      wscrl(vp->win, shift);
+      int first = shift > 0 ? height - shift : 0;
+      int count = shift > 0 ? shift : -shift;
+      for (int y = first; y < first + count; ++y)
+        viewport_row(vp, y, top + y, rows, cursor, draw, data);
     }
+    if (vp->cursor != cursor)
+      viewport_row(vp, vp->cursor - top, vp->cursor, rows, cursor, draw,
+                   data);
+    viewport_row(vp, cursor - top, cursor, rows, cursor, draw, data);
+  }
+
+  vp->top = top;
+  vp->cursor = cursor;
+  vp->rows = rows;
+  vp->valid = 1;
+}
+
+typedef struct {
+  int current;
+  int cursor;
+  int details;
+  int filter;
+  int searching;
+  int origin;
+  int listing;
+  int chrome;
+  const char *notice;
+  Viewport view;
+  Search search;
+} ViewerState;
+
+typedef struct {
+  const NarinfoResult *res;
+  const ViewerState *v;
+} ViewRows;
+
+static int filtering(const ViewerState *v) {
+  return v->filter && v->search.query_len > 0;
+}
+
+static int view_rows(const NarinfoResult *res, const ViewerState *v) {
+  return filtering(v) ? v->search.match_count : res->view_count;
+}
+
+static int view_line(const ViewerState *v, int row) {
+  return filtering(v) ? v->search.matches[row] : row;
+}
+
+static void refresh_search(NarinfoResult *res, ViewerState *v) {
+  char query[sizeof(v->search.query)];
+  memcpy(query, v->search.query, sizeof(query));
+  search_update(&v->search, res->view, res->view_count, query);
+}
+
+static void jump_to_line(NarinfoResult *res, ViewerState *v, int line) {
+  if (line < 0)
+    return;
+  v->cursor = filtering(v) ? search_lower_bound(&v->search, line) : line;
+  int rows = view_rows(res, v);
+  if (v->cursor >= rows)
+    v->cursor = rows > 0 ? rows - 1 : 0;
+}
+
+static void draw_view_line(WINDOW *win, int y, const NarinfoResult *res,
+                           const ViewerState *v, int line, int selected) {
+  StrView text = res->view[line];
+  int indent = line >= res->ref_first && line < res->ref_first + res->ref_count
+                   ? 2
+                   : 0;
+  int width = getmaxx(win) - 2 - indent;
+  if ((int)text.len < width)
+    width = (int)text.len;
+  if (width < 0)
+    width = 0;
+
+  long hit = v->search.query_len > 0
+                 ? search_find(text, v->search.query, v->search.query_len)
+                 : -1;
+
+  if (selected)
+    wattron(win, A_REVERSE);
+  mvwprintw(win, y, 1 + indent, "%.*s", width, text.ptr);
+  if (hit >= 0 && hit < width) {
+    int len = (int)v->search.query_len;
+    if (hit + len > width)
+      len = width - (int)hit;
+    wattron(win, A_BOLD | A_UNDERLINE);
+    mvwprintw(win, y, 1 + indent + (int)hit, "%.*s", len, text.ptr + hit);
+    wattroff(win, A_BOLD | A_UNDERLINE);
+  }
+  if (selected)
+    wattroff(win, A_REVERSE);
+}
+
+static void draw_view_row(WINDOW *win, int y, int row, int selected,
+                          const void *data) {
+  const ViewRows *rows = data;
+  draw_view_line(win, y, rows->res, rows->v, view_line(rows->v, row),
+                 selected);
+}
 
+static void start_listing(NarinfoResult *res) {
+  res->listing = malloc(sizeof(*res->listing));
+  if (res->listing)
+    listing_start(res->listing, res->url, lookup->hash);
+}
+
+static void draw_listing_row(WINDOW *win, int y, const ListingNode *node,
+                             int selected) {
+  char line[1024];
+  char size[32] = "";
+  StrView name = node->parent ? node->name : (StrView){"/", 1};
+  const char *marker = node->type != LISTING_DIRECTORY ? "    "
+                       : node->expanded                ? "[-] "
+                                                       : "[+] ";
+  int width = getmaxx(win) - 2;
+
+  int n = snprintf(line, sizeof(line), "%*s%s%.*s", node->depth * 2, "",
+                   marker, (int)name.len, name.ptr);
+  if (n < 0 || n >= (int)sizeof(line))
+    n = sizeof(line) - 1;
+  if (node->type == LISTING_DIRECTORY && node->parent)
+    snprintf(line + n, sizeof(line) - n, "/");
+  else if (node->type == LISTING_SYMLINK)
+    snprintf(line + n, sizeof(line) - n, " -> %.*s", (int)node->target.len,
+             node->target.ptr);
+  else if (node->type == LISTING_REGULAR && node->executable)
+    snprintf(line + n, sizeof(line) - n, "*");
+
+  if (node->type == LISTING_REGULAR)
+    snprintf(size, sizeof(size), " %llu B", (unsigned long long)node->size);
+  int size_len = (int)strlen(size);
+
+  if (selected)
+    wattron(win, A_REVERSE);
+  mvwprintw(win, y, 1, "%-*.*s", width, width, line);
+  if (size_len > 0 && size_len < width)
+    mvwprintw(win, y, 1 + width - size_len, "%s", size);
+  if (selected)
+    wattroff(win, A_REVERSE);
+}
+
+static void draw_listing_entry(WINDOW *win, int y, int row, int selected,
+                               const void *data) {
+  const NarListing *ls = data;
+  draw_listing_row(win, y, ls->rows[row], selected);
+}
+
+static void draw_listing(const NarinfoResult *res, Viewport *vp) {
+  NarListing *ls = res->listing;
+  const char *message = NULL;
+
+  if (!ls)
+    message = res->state == RESULT_PENDING ? "Waiting for narinfo..."
+                                           : "No narinfo in this cache";
+  else if ((ls->state == LISTING_MISSING || ls->state == LISTING_FAILED) &&
+           ls->node_count == 1)
+    message = ls->error;
+
+  if (message) {
+    werase(vp->win);
+    mvwprintw(vp->win, 0, 1, "%.*s", getmaxx(vp->win) - 2, message);
+    vp->valid = 0;
+    return;
+  }
+
+  int rows = listing_rows(ls);
+  viewport_draw(vp, rows, ls->cursor, draw_listing_entry, ls);
+}
+
+static void draw_listing_status(const NarinfoResult *res) {
+  const NarListing *ls = res->listing;
+  char state[CURL_ERROR_SIZE + 32];
+
+  if (!ls)
+    snprintf(state, sizeof(state), "%s",
+             res->state == RESULT_PENDING ? "waiting" : "unavailable");
+  else if (ls->state == LISTING_LOADING)
+    snprintf(state, sizeof(state), "%d entries, loading", ls->node_count);
+  else if (ls->state == LISTING_DONE)
+    snprintf(state, sizeof(state), "%d entries", ls->node_count);
+  else
+    snprintf(state, sizeof(state), "%s", ls->error);
+
+  StatusItem status_items[] = {{"Files", state},
+                               {"Up/Down", "move cursor"},
+                               {"Enter", "expand/copy"},
+                               {"Tab/Shift-Tab", "switch result"},
+                               {"l", "narinfo"},
+                               {"q", "quit"}};
+  show_status_structured(status_items, 6);
+}
+
+static void draw_viewer_status(NarinfoResult results[], int loaded,
+                               const ViewerState *v) {
+  char matches[48];
+  int rows = view_rows(&results[v->current], v);
+  int line = rows > 0 ? view_line(v, v->cursor) : 0;
+  int index = search_lower_bound(&v->search, line);
+
+  if (v->notice) {
+    show_status(v->notice);
+    return;
+  }
+  if (v->listing) {
+    draw_listing_status(&results[v->current]);
+    return;
+  }
+
+  if (v->search.match_count == 0)
+    snprintf(matches, sizeof(matches), "no matches");
+  else if (index < v->search.match_count &&
+           v->search.matches[index] == line)
+    snprintf(matches, sizeof(matches), "%d/%d", index + 1,
+             v->search.match_count);
+  else
+    snprintf(matches, sizeof(matches), "%d matches", v->search.match_count);
+
+  if (v->searching) {
+    char query[sizeof(v->search.query) + 1];
+    snprintf(query, sizeof(query), "/%s", v->search.query);
+    StatusItem status_items[] = {{"Search", query},
+                                 {"Matches", matches},
+                                 {"Enter", "accept"},
+                                 {"Esc", "cancel"}};
+    show_status_structured(status_items, 4);
+    return;
+  }
+
+  if (v->search.query_len > 0) {
+    StatusItem status_items[] = {{"Search", (char *)v->search.query},
+                                 {"n/N", matches},
+                                 {"f", v->filter ? "show all" : "filter"},
+                                 {"/", "new search"},
+                                 {"Esc", "clear"},
+                                 {"q", "quit"}};
+    show_status_structured(status_items, 6);
+    return;
+  }
+
+  int pending = count_results(results, loaded, RESULT_PENDING);
+  if (pending > 0) {
+    char fetching[32];
+    snprintf(fetching, sizeof(fetching), "%d pending", pending);
+    StatusItem status_items[] = {{"Fetching", fetching},
+                                 {"Tab/Shift-Tab", "switch result"},
+                                 {"Up/Down", "move cursor"},
+                                 {"/", "search"},
+                                 {"d", "timings"},
+                                 {"c", "cancel"},
+                                 {"q", "quit"}};
+    show_status_structured(status_items, 7);
+  } else if (count_results(results, loaded, RESULT_HIT) == 0) {
+    StatusItem status_items[] = {{"Status", "Not found in any cache"},
+                                 {"d", "timings"},
+                                 {"r", "retry"},
+                                 {"q", "quit"}};
+    show_status_structured(status_items, 4);
+  } else {
     StatusItem status_items[] = {{"Tab/Shift-Tab", "switch result"},
                                  {"Up/Down", "move cursor"},
-                                 {"Enter", "copy"},
+                                 {"Enter", "open/copy"},
                                  {"PgUp/PgDn", "jump"},
+                                 {"/", "search"},
+                                 {"l", "files"},
+                                 {"d", "timings"},
                                  {"r", "retry"},
-                                 {"q", "quit"}};
-    show_status_structured(status_items, 6);
+                                 {"q", "quit"},
+                                 {"Backspace", "back"}};
+    show_status_structured(status_items, history_count > 0 ? 10 : 9);
+  }
+}
 
-    refresh();
-
-    int ch = getch();
-    if (ch == '\t' || ch == KEY_RIGHT) {
-      current = (current + 1) % loaded;
-      selected_line = 0;
-    } else if (ch == KEY_BTAB || ch == KEY_LEFT) {
-      current = (current + loaded - 1) % loaded;
-      selected_line = 0;
-    } else if (ch == KEY_NPAGE) {
-      selected_line += lines_avail;
-      if (selected_line > res->narinfo_lines - 1)
-        selected_line = res->narinfo_lines - 1;
-    } else if (ch == KEY_PPAGE) {
-      selected_line -= lines_avail;
-      if (selected_line < 0)
-        selected_line = 0;
-    } else if (ch == KEY_DOWN) {
-      if (selected_line < res->narinfo_lines - 1)
-        selected_line++;
-    } else if (ch == KEY_UP) {
-      if (selected_line > 0)
-        selected_line--;
-    } else if (ch == '\n' || ch == KEY_ENTER) {
-      clipboard_copy(res->narinfo_view[selected_line]);
-      show_status("Copied to clipboard!");
-      refresh();
-      napms(500);
-    } else if (ch == 'q') {
-      return;
-    } else if (ch == 'r') {
-      break;
+static void draw_narinfo_viewer(NarinfoResult results[], int loaded,
+                                ViewerState *v) {
+  int maxx = getmaxx(stdscr);
+  NarinfoResult *res = &results[v->current];
+
+  if (v->chrome) {
+    erase();
+    show_main_borders();
+    v->chrome = 0;
+    v->view.valid = 0;
+  }
+
+  char exec_name[64];
+  char path_short[128];
+  char hash_short[16];
+  char url_short[64];
+
+  snprintf(exec_name, sizeof(exec_name), "%.60s", lookup->name);
+  snprintf(path_short, sizeof(path_short), "%.120s", lookup->resolved_path);
+  snprintf(hash_short, sizeof(hash_short), "%.12s", lookup->hash);
+  snprintf(url_short, sizeof(url_short), "%.60s", res->url);
+
+  char header[512];
+  snprintf(header, sizeof(header),
+           "Exec: %s Path: %s Hash: %s Src: %s [%s%s%s] [%d/%d]", exec_name,
+           path_short, hash_short, url_short, result_badge(res),
+           res->sig != SIG_UNCHECKED ? ", signature " : "",
+           res->sig != SIG_UNCHECKED ? sigverify_status_name(res->sig) : "",
+           v->current + 1, loaded);
+  mvprintw(1, 1, "%-*.*s", maxx - 2, maxx - 2, header);
+
+  char timing[160];
+  format_timing(res, timing, sizeof(timing));
+  mvhline(2, 1, 0, maxx - 2);
+  if (timing[0])
+    mvprintw(2, 2, " %.*s ", maxx - 6, timing);
+
+  if (v->details) {
+    werase(v->view.win);
+    draw_timing_details(v->view.win, results, loaded, v->current);
+    v->view.valid = 0;
+  } else if (v->listing) {
+    draw_listing(res, &v->view);
+  } else {
+    ViewRows rows = {res, v};
+    viewport_draw(&v->view, view_rows(res, v), v->cursor, draw_view_row,
+                  &rows);
+  }
+
+  draw_viewer_status(results, loaded, v);
+  wnoutrefresh(stdscr);
+  wnoutrefresh(v->view.win);
+  doupdate();
+}
+
+static int handle_search_key(NarinfoResult *res, ViewerState *v, int ch) {
+  char query[sizeof(v->search.query)];
+  size_t len = v->search.query_len;
+  memcpy(query, v->search.query, len + 1);
+
+  if (ch == 27) {
+    v->searching = 0;
+    search_update(&v->search, res->view, res->view_count, "");
+    jump_to_line(res, v, v->origin);
+    return 1;
+  } else if (ch == '\n' || ch == KEY_ENTER) {
+    v->searching = 0;
+    return 1;
+  } else if (ch == KEY_BACKSPACE || ch == 127 || ch == 8) {
+    if (len == 0) {
+      v->searching = 0;
+      return 1;
+    }
+    query[--len] = '\0';
+  } else if (ch < 256 && isprint(ch) && len + 1 < sizeof(query)) {
+    query[len++] = ch;
+    query[len] = '\0';
+  } else {
+    return 0;
+  }
+
+  search_update(&v->search, res->view, res->view_count, query);
+  if (v->search.match_count > 0) {
+    int i = search_lower_bound(&v->search, v->origin);
+    jump_to_line(res, v,
+                 v->search.matches[i < v->search.match_count ? i : 0]);
+  } else {
+    jump_to_line(res, v, v->origin);
+  }
+  return 1;
+}
+
+static int handle_listing_key(NarinfoResult *res, ViewerState *v, int ch,
+                              int lines_avail) {
+  NarListing *ls = res->listing;
+
+  if (ch == KEY_DOWN || ch == KEY_UP || ch == KEY_NPAGE || ch == KEY_PPAGE) {
+    int step = ch == KEY_NPAGE || ch == KEY_PPAGE ? lines_avail : 1;
+    if (ls)
+      listing_move(ls, ch == KEY_DOWN || ch == KEY_NPAGE ? step : -step);
+  } else if (ch == ' ') {
+    if (ls)
+      listing_toggle(ls);
+  } else if (ch == '\n' || ch == KEY_ENTER) {
+    if (!ls || !ls->selected)
+      return 1;
+    if (ls->selected->type == LISTING_DIRECTORY) {
+      listing_toggle(ls);
+      return 1;
+    }
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%.*s",
+                     (int)res->info.store_path.len, res->info.store_path.ptr);
+    listing_path(ls->selected, path + n, sizeof(path) - n);
+    v->notice = clipboard_copy(path);
+  } else if (ch != '/' && ch != 'n' && ch != 'N' && ch != 'f' && ch != 27) {
+    return 0;
+  }
+  return 1;
+}
+
+static void show_lookup(ViewerState *v) {
+  NarinfoResult *res = &lookup->results[lookup->current];
+  v->current = lookup->current;
+  v->cursor = lookup->cursor;
+  v->listing = 0;
+  search_update(&v->search, res->view, res->view_count, "");
+}
+
+void show_narinfo_viewer(void) {
+  ViewerState v;
+  int dirty = 1;
+
+  memset(&v, 0, sizeof(v));
+  search_init(&v.search);
+  viewport_open(&v.view);
+  v.chrome = 1;
+  nodelay(stdscr, 1);
+  keypad(stdscr, 1);
+  set_escdelay(25);
+
+  while (1) {
+    NarinfoResult *results = lookup->results;
+    int loaded = lookup->loaded;
+    NarinfoResult *res = &results[v.current];
+
+    if (results_changed && v.search.query_len > 0 &&
+        v.search.lines != res->view)
+      refresh_search(res, &v);
+
+    if (v.listing && res->state == RESULT_HIT && !res->listing)
+      start_listing(res);
+
+    NarinfoResult *source = res;
+    for (int i = 0; source->state != RESULT_HIT && i < loaded; ++i)
+      source = &results[i];
+    if (source->state == RESULT_HIT && !source->prefetched)
+      prefetch_references(source);
+
+    if (dirty || results_changed || (res->listing && res->listing->changed)) {
+      if (results_changed)
+        v.view.valid = 0;
+      draw_narinfo_viewer(results, loaded, &v);
+      dirty = 0;
+      results_changed = 0;
+      if (res->listing)
+        res->listing->changed = 0;
+    }
+
+    struct curl_waitfd wfd = {STDIN_FILENO, CURL_WAIT_POLLIN, 0};
+    fetch_poll(&wfd, 1, 1000);
+
+    int ch;
+    while ((ch = getch()) != ERR) {
+      int maxy = getmaxy(stdscr);
+      int lines_avail = maxy - 6;
+
+      results = lookup->results;
+      loaded = lookup->loaded;
+      res = &results[v.current];
+      int rows = view_rows(res, &v);
+      int line = rows > 0 ? view_line(&v, v.cursor) : 0;
+
+      dirty = 1;
+      v.notice = NULL;
+      if (ch != KEY_UP && ch != KEY_DOWN && ch != KEY_NPAGE && ch != KEY_PPAGE)
+        v.view.valid = 0;
+      if (ch == KEY_RESIZE) {
+        viewport_open(&v.view);
+        v.chrome = 1;
+      } else if (v.searching) {
+        handle_search_key(res, &v, ch);
+      } else if (v.listing && handle_listing_key(res, &v, ch, lines_avail)) {
+        continue;
+      } else if (ch == 'l') {
+        v.listing = !v.listing;
+      } else if (ch == '\t' || ch == KEY_RIGHT || ch == KEY_BTAB ||
+                 ch == KEY_LEFT) {
+        int step = ch == '\t' || ch == KEY_RIGHT ? 1 : loaded - 1;
+        v.current = (v.current + step) % loaded;
+        v.cursor = 0;
+        if (v.search.query_len > 0)
+          refresh_search(&results[v.current], &v);
+      } else if (ch == KEY_NPAGE) {
+        v.cursor += lines_avail;
+        if (v.cursor > rows - 1)
+          v.cursor = rows - 1;
+        if (v.cursor < 0)
+          v.cursor = 0;
+      } else if (ch == KEY_PPAGE) {
+        v.cursor -= lines_avail;
+        if (v.cursor < 0)
+          v.cursor = 0;
+      } else if (ch == KEY_DOWN) {
+        if (v.cursor < rows - 1)
+          v.cursor++;
+      } else if (ch == KEY_UP) {
+        if (v.cursor > 0)
+          v.cursor--;
+      } else if (ch == '/') {
+        v.searching = 1;
+        v.origin = line;
+        search_update(&v.search, res->view, res->view_count, "");
+      } else if (ch == 'n' || ch == 'N') {
+        jump_to_line(res, &v, search_next(&v.search, line, ch == 'n' ? 1 : -1));
+      } else if (ch == 'f') {
+        v.filter = !v.filter;
+        jump_to_line(res, &v, line);
+      } else if (ch == 27) {
+        search_update(&v.search, res->view, res->view_count, "");
+        jump_to_line(res, &v, line);
+      } else if ((ch == '\n' || ch == KEY_ENTER) && rows > 0 &&
+                 line >= res->ref_first &&
+                 line < res->ref_first + res->ref_count) {
+        lookup->current = v.current;
+        lookup->cursor = v.cursor;
+        if (open_reference(res->view[line], res) == 0)
+          show_lookup(&v);
+        else
+          v.notice = "Cannot open this reference";
+      } else if ((ch == KEY_BACKSPACE || ch == 127 || ch == 8) &&
+                 history_count > 0) {
+        close_reference();
+        show_lookup(&v);
+      } else if (ch == '\n' || ch == KEY_ENTER || ch == 'y') {
+        if (rows > 0) {
+          StrView text = res->view[line];
+          char *copy = strndup(text.ptr, text.len);
+          v.notice = clipboard_copy(copy);
+          free(copy);
+        }
+      } else if (ch == 'd') {
+        v.details = !v.details;
+      } else if (ch == 'c') {
+        cancel_pending(results, loaded);
+      } else if (ch == 'q' || ch == 'r') {
+        cancel_pending(results, loaded);
+        search_free(&v.search);
+        viewport_close(&v.view);
+        nodelay(stdscr, 0);
+        return;
+      }
     }
   }
 }
 
 void tui_main(const char *initial_input) {
-  NarinfoResult results[MAX_RESULTS] = {0};
   char prompt[128] = "Executable name or path ('q' to quit): ";
   char input[256] = {0};
 
+  lookup = lookup_new();
+  if (!lookup)
+    return;
   if (initial_input) {
     strncpy(input, initial_input, sizeof(input) - 1);
-    int loaded = process_executable(input, results);
+    int loaded = process_executable(input);
     if (loaded > 0) {
-      show_narinfo_viewer(results, loaded);
+      show_narinfo_viewer();
     }
-    for (int i = 0; i < loaded; ++i)
-      free_narinfo(&results[i]);
+    release_lookup();
+    lookup_free(lookup);
     return;
   }
 
   while (1) {
     clear();
     show_main_borders();
-    show_centered_inputbox(prompt, input, sizeof(input));
+    input[0] = '\0';
+    show_centered_inputbox(prompt, input, sizeof(input), prefetch_executable);
 
     if (strcmp(input, "q") == 0)
       break;
 
-    int loaded = process_executable(input, results);
+    int loaded = process_executable(input);
     if (loaded > 0) {
-      show_narinfo_viewer(results, loaded);
+      show_narinfo_viewer();
     }
 
-    for (int i = 0; i < loaded; ++i)
-      free_narinfo(&results[i]);
+    release_lookup();
     strcpy(prompt, "Executable name or path ('q' to quit): ");
   }
+  release_lookup();
+  lookup_free(lookup);
+  pathindex_free();
 }
 
 void print_usage(const char *progname) {
   printf("Usage: %s [OPTIONS] [EXECUTABLE]\n", progname);
   printf("Options:\n");
   printf("  -c, --cache URL    Add cache URL (can be used multiple times)\n");
+  printf("  -b, --batch FILE   Look up inputs from FILE ('-' for stdin) "
+         "without the TUI\n");
+  printf("  -C, --closure      Walk the runtime closure of EXECUTABLE and "
+         "report coverage\n");
+  printf("  -N, --nar          Download EXECUTABLE's NAR from every cache and "
+         "verify it\n");
+  printf("  -o, --output FILE  With --nar, write the NAR from the first cache "
+         "to FILE\n");
+  printf("  --local            With --closure, read the closure from the local "
+         "Nix database\n");
+  printf("  --store-db PATH    Nix database for --local (default %s)\n",
+         LOCALSTORE_DEFAULT_DB);
+  printf("  --exists           Only report which caches hold each input\n");
+  printf("  -f, --format FMT   Batch output format: json (default) or tsv\n");
+  printf("  -j, --jobs N       Maximum concurrent requests in batch mode "
+         "(default 64)\n");
+  printf("  --race             Stop at the first cache that has the path\n");
+  printf("  --stagger MS       With --race, delay each lower-priority cache "
+         "by MS\n");
+  printf("  --verify           Check narinfo signatures against trusted "
+         "keys\n");
+  printf("  --trusted-key KEY  Trust NAME:BASE64 public key (implies "
+         "--verify)\n");
+  printf("  --connect-timeout [URL=]MS\n");
+  printf("                     Connect deadline for all caches or URL "
+         "(default %d)\n",
+         FETCH_CONNECT_TIMEOUT_MS);
+  printf("  --timeout [URL=]MS Request deadline for all caches or URL "
+         "(default %d)\n",
+         FETCH_TIMEOUT_MS);
+  printf("  --budget MS        Give up on a lookup MS after it started\n");
+  printf("  --hedge            Duplicate requests slower than the cache's "
+         "p95 latency\n");
+  printf("  --mirror URL=MIRROR\n");
+  printf("                     Send hedged requests for URL to MIRROR "
+         "(implies --hedge)\n");
+  printf("  --serve SOCKET     Answer queries on a Unix socket until "
+         "interrupted\n");
+  printf("  --connect SOCKET   Send the query to a --serve daemon instead\n");
+  printf("  --no-cache         Do not read or write the on-disk narinfo "
+         "cache\n");
+  printf("  --refresh          Ignore cached narinfo but store fresh "
+         "results\n");
+  printf("  --ttl SECS         Positive cache TTL (default %d)\n",
+         NARCACHE_POSITIVE_TTL);
+  printf("  --negative-ttl SECS\n");
+  printf("                     Negative cache TTL (default %d)\n",
+         NARCACHE_NEGATIVE_TTL);
   printf("  -h, --help         Show this help message\n");
   printf("\nArguments:\n");
   printf("  EXECUTABLE         Skip prompt and look up this executable "
@@ -419,16 +1372,251 @@ void print_usage(const char *progname) {
   printf("\nDefault cache: https://cache.nixos.org\n");
 }
 
+static int run_closure(const char *input, const BatchOptions *opts,
+                       int local, const char *store_db) {
+  char path[PATH_MAX];
+  char hash[HASH_LEN + 1];
+
+  if (!input) {
+    fprintf(stderr, "--closure requires an executable or store path\n");
+    return 1;
+  }
+  if (resolve_store_input(input, path, sizeof(path), hash) != RESOLVE_OK) {
+    fprintf(stderr, "Could not resolve %s to a store path\n", input);
+    return 1;
+  }
+
+  if (!local) {
+    int missing = closure_run(hash, stdout, cache_urls, cache_count, opts);
+    return missing != 0 ? 2 : 0;
+  }
+
+  if (localstore_open(store_db) != 0) {
+    fprintf(stderr, "Could not open local store: %s\n", localstore_error());
+    return 1;
+  }
+  int missing = closure_run_local(path, stdout, cache_urls, cache_count, opts);
+  if (missing < 0)
+    fprintf(stderr, "Local closure failed: %s\n", localstore_error());
+  localstore_close();
+  return missing < 0 ? 1 : missing != 0 ? 2 : 0;
+}
+
+static int run_nar(const char *input, const BatchOptions *opts,
+                   const char *output) {
+  char path[PATH_MAX];
+  char hash[HASH_LEN + 1];
+
+  if (!input) {
+    fprintf(stderr, "--nar requires an executable or store path\n");
+    return 1;
+  }
+  if (resolve_store_input(input, path, sizeof(path), hash) != RESOLVE_OK) {
+    fprintf(stderr, "Could not resolve %s to a store path\n", input);
+    return 1;
+  }
+
+  int failed =
+      narfetch_run(hash, stdout, cache_urls, cache_count, opts, output, NULL);
+  if (failed < 0)
+    fprintf(stderr, "%s was not found in any cache\n", input);
+  return failed != 0 ? 2 : 0;
+}
+
+static int open_input(const char *file, const char *input) {
+  if (file && strcmp(file, "-") == 0)
+    return STDIN_FILENO;
+  if (file) {
+    int fd = open(file, O_RDONLY);
+    if (fd < 0)
+      perror(file);
+    return fd;
+  }
+
+  int fds[2];
+  if (!input || pipe(fds) != 0)
+    return -1;
+  dprintf(fds[1], "%s\n", input);
+  close(fds[1]);
+  return fds[0];
+}
+
+static int run_batch(const char *file, const char *input,
+                     const BatchOptions *opts) {
+  if (!file && !input) {
+    fprintf(stderr, "--exists requires an executable, store path or -b\n");
+    return 1;
+  }
+
+  int fd = open_input(file, input);
+  if (fd < 0)
+    return 1;
+
+  int missing = batch_run(fd, stdout, cache_urls, cache_count, opts);
+
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return missing < 0 ? 1 : missing > 0 ? 2 : 0;
+}
+
+static int run_client(const char *socket_path, const char *file,
+                      const char *input, int closure_mode, int exists,
+                      const BatchOptions *opts) {
+  char path[PATH_MAX];
+  char hash[HASH_LEN + 1];
+
+  if (!file && !input) {
+    fprintf(stderr, "--connect requires an executable, store path or -b\n");
+    return 1;
+  }
+  if (input && !file &&
+      resolve_store_input(input, path, sizeof(path), hash) != RESOLVE_OK) {
+    fprintf(stderr, "Could not resolve %s to a store path\n", input);
+    return 1;
+  }
+
+  if (closure_mode) {
+    if (file) {
+      fprintf(stderr, "--closure takes a single executable or store path\n");
+      return 1;
+    }
+    return serve_query(socket_path, SERVE_CLOSURE, opts->format, hash, -1,
+                       stdout);
+  }
+
+  int fd = open_input(file, file ? NULL : hash);
+  if (fd < 0)
+    return 1;
+  int status = serve_query(socket_path, exists ? SERVE_EXISTS : SERVE_LOOKUP,
+                           opts->format, NULL, fd, stdout);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return status;
+}
+
+static int run_tui(const char *initial_input) {
+  setlocale(LC_ALL, "");
+
+  initscr();
+  cbreak();
+  noecho();
+  keypad(stdscr, TRUE);
+
+  tui_main(initial_input);
+
+  endwin();
+  clipboard_cleanup();
+  return 0;
+}
+
+static void start_verify(void) {
+  char conf[PATH_MAX];
+  const char *dir = getenv("NIX_CONF_DIR");
+
+  if (sigverify_key_count() == 0) {
+    snprintf(conf, sizeof(conf), "%s/nix.conf", dir ? dir : "/etc/nix");
+    sigverify_load_nix_conf(conf);
+  }
+  if (sigverify_key_count() == 0)
+    sigverify_add_key(SIGVERIFY_DEFAULT_KEY);
+
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  sigverify_start(cpus > 1 ? (int)cpus : 1);
+}
+
+static int apply_fetch_option(const FetchOption *opt, int apply) {
+  char url[512] = "";
+  const char *value = opt->arg;
+  const char *eq =
+      opt->option == OPT_MIRROR ? strchr(value, '=') : strrchr(value, '=');
+
+  if (eq) {
+    snprintf(url, sizeof(url), "%.*s", (int)(eq - value), value);
+    value = eq + 1;
+  }
+
+  if (opt->option == OPT_MIRROR) {
+    if (!url[0] || !*value)
+      return -1;
+    if (apply)
+      fetch_set_mirror(url, value);
+    return 0;
+  }
+
+  char *end;
+  long ms = strtol(value, &end, 10);
+  if (end == value || *end || ms < 0 || (opt->option == OPT_BUDGET && eq))
+    return -1;
+  if (!apply)
+    return 0;
+
+  if (opt->option == OPT_BUDGET)
+    fetch_set_budget(ms);
+  else
+    fetch_set_timeouts(url[0] ? url : NULL,
+                       opt->option == OPT_CONNECT_TIMEOUT ? ms : -1,
+                       opt->option == OPT_TIMEOUT ? ms : -1);
+  return 0;
+}
+
+static void free_cache_urls(void) {
+  for (int i = 0; i < cache_count; i++) {
+    free(cache_urls[i]);
+  }
+}
+
 int main(int argc, char *argv[]) {
   cache_urls[0] = strdup("https://cache.nixos.org");
   cache_count = 1;
 
-  static struct option long_options[] = {{"cache", required_argument, 0, 'c'},
-                                         {"help", no_argument, 0, 'h'},
-                                         {0, 0, 0, 0}};
+  static struct option long_options[] = {
+      {"cache", required_argument, 0, 'c'},
+      {"batch", required_argument, 0, 'b'},
+      {"closure", no_argument, 0, 'C'},
+      {"nar", no_argument, 0, 'N'},
+      {"output", required_argument, 0, 'o'},
+      {"format", required_argument, 0, 'f'},
+      {"jobs", required_argument, 0, 'j'},
+      {"race", no_argument, 0, OPT_RACE},
+      {"stagger", required_argument, 0, OPT_STAGGER},
+      {"no-cache", no_argument, 0, OPT_NO_CACHE},
+      {"refresh", no_argument, 0, OPT_REFRESH},
+      {"ttl", required_argument, 0, OPT_TTL},
+      {"negative-ttl", required_argument, 0, OPT_NEGATIVE_TTL},
+      {"local", no_argument, 0, OPT_LOCAL},
+      {"store-db", required_argument, 0, OPT_STORE_DB},
+      {"verify", no_argument, 0, OPT_VERIFY},
+      {"trusted-key", required_argument, 0, OPT_TRUSTED_KEY},
+      {"exists", no_argument, 0, OPT_EXISTS},
+      {"serve", required_argument, 0, OPT_SERVE},
+      {"connect", required_argument, 0, OPT_CONNECT},
+      {"connect-timeout", required_argument, 0, OPT_CONNECT_TIMEOUT},
+      {"timeout", required_argument, 0, OPT_TIMEOUT},
+      {"budget", required_argument, 0, OPT_BUDGET},
+      {"hedge", no_argument, 0, OPT_HEDGE},
+      {"mirror", required_argument, 0, OPT_MIRROR},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  const char *batch_file = NULL;
+  BatchOptions batch_opts = {OUTPUT_JSON, 64, 0};
+  int closure_mode = 0;
+  int nar_mode = 0;
+  const char *nar_output = NULL;
+  int local_store = 0;
+  const char *store_db = NULL;
+  int verify = 0;
+  int exists = 0;
+  const char *serve_path = NULL;
+  const char *connect_path = NULL;
+  FetchPolicy policy = FETCH_ALL;
+  int stagger_ms = 0;
+  int use_narcache = 1;
+  int hedge = 0;
 
   int c;
-  while ((c = getopt_long(argc, argv, "c:h", long_options, NULL)) != -1) {
+  while ((c = getopt_long(argc, argv, "c:b:CNo:f:j:h", long_options, NULL)) !=
+         -1) {
     switch (c) {
     case 'c':
       if (cache_count < MAX_RESULTS) {
@@ -440,6 +1628,115 @@ int main(int argc, char *argv[]) {
         return 1;
       }
       break;
+    case 'b':
+      batch_file = optarg;
+      break;
+    case 'C':
+      closure_mode = 1;
+      break;
+    case 'N':
+      nar_mode = 1;
+      break;
+    case 'o':
+      nar_output = optarg;
+      break;
+    case 'f':
+      if (strcmp(optarg, "json") == 0) {
+        batch_opts.format = OUTPUT_JSON;
+      } else if (strcmp(optarg, "tsv") == 0) {
+        batch_opts.format = OUTPUT_TSV;
+      } else {
+        fprintf(stderr, "Unknown output format: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case 'j':
+      batch_opts.jobs = atoi(optarg);
+      if (batch_opts.jobs < 1) {
+        fprintf(stderr, "Invalid number of jobs: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case OPT_RACE:
+      policy = FETCH_RACE;
+      break;
+    case OPT_STAGGER: {
+      char *end;
+      long ms = strtol(optarg, &end, 10);
+      if (end == optarg || *end || ms < 0 || ms > INT_MAX) {
+        fprintf(stderr, "Invalid stagger delay: %s\n", optarg);
+        return 1;
+      }
+      stagger_ms = (int)ms;
+      break;
+    }
+    case OPT_NO_CACHE:
+      use_narcache = 0;
+      break;
+    case OPT_REFRESH:
+      narcache_set_refresh(1);
+      break;
+    case OPT_TTL:
+    case OPT_NEGATIVE_TTL: {
+      char *end;
+      errno = 0;
+      long ttl = strtol(optarg, &end, 10);
+      if (end == optarg || *end || ttl < 0 || errno == ERANGE) {
+        fprintf(stderr, "Invalid cache TTL: %s\n", optarg);
+        return 1;
+      }
+      if (c == OPT_TTL)
+        narcache_set_ttl(ttl, -1);
+      else
+        narcache_set_ttl(-1, ttl);
+      break;
+    }
+    case OPT_LOCAL:
+      local_store = 1;
+      break;
+    case OPT_STORE_DB:
+      local_store = 1;
+      store_db = optarg;
+      break;
+    case OPT_VERIFY:
+      verify = 1;
+      break;
+    case OPT_TRUSTED_KEY:
+      verify = 1;
+      if (sigverify_add_key(optarg) != 0) {
+        fprintf(stderr, "Invalid public key: %s\n", optarg);
+        return 1;
+      }
+      break;
+    case OPT_EXISTS:
+      exists = 1;
+      break;
+    case OPT_SERVE:
+      serve_path = optarg;
+      break;
+    case OPT_CONNECT:
+      connect_path = optarg;
+      break;
+    case OPT_HEDGE:
+      hedge = 1;
+      break;
+    case OPT_CONNECT_TIMEOUT:
+    case OPT_TIMEOUT:
+    case OPT_BUDGET:
+    case OPT_MIRROR: {
+      FetchOption opt = {c, optarg};
+      if (apply_fetch_option(&opt, 0) != 0) {
+        fprintf(stderr, "Invalid %s: %s\n",
+                c == OPT_MIRROR ? "mirror" : "deadline", optarg);
+        return 1;
+      }
+      if (fetch_option_count >= 2 * MAX_RESULTS) {
+        fprintf(stderr, "Too many deadline and mirror options\n");
+        return 1;
+      }
+      fetch_options[fetch_option_count++] = opt;
+      break;
+    }
     case 'h':
       print_usage(argv[0]);
       return 0;
@@ -453,28 +1750,56 @@ int main(int argc, char *argv[]) {
   if (optind < argc) {
     initial_input = argv[optind];
   }
-
-  setlocale(LC_ALL, "");
-
-  if (clipboard_init() != 0) {
-    fprintf(stderr, "Warning: Could not initialize clipboard functionality\n");
+  if (exists)
+    batch_opts.exists = 1;
+
+  if (connect_path) {
+    int status = 1;
+    if (nar_mode || local_store || serve_path)
+      fprintf(stderr, "--nar, --local and --serve cannot be used with "
+                      "--connect\n");
+    else
+      status = run_client(connect_path, batch_file, initial_input,
+                          closure_mode, exists, &batch_opts);
+    free_cache_urls();
+    return status;
   }
 
-  initscr();
-  cbreak();
-  noecho();
-  keypad(stdscr, TRUE);
   curl_global_init(CURL_GLOBAL_DEFAULT);
-
-  tui_main(initial_input);
-
+  fetch_init();
+  if (use_narcache)
+    narcache_open(NULL);
+  fetch_set_policy(policy, stagger_ms);
+  fetch_set_hedging(hedge);
+  for (int i = 0; i < fetch_option_count; i++)
+    apply_fetch_option(&fetch_options[i], 1);
+  if (verify)
+    start_verify();
+
+  CacheInfo infos[MAX_RESULTS];
+  int interactive =
+      !serve_path && !nar_mode && !closure_mode && !batch_file && !exists;
+  cacheinfo_load(cache_urls, cache_count, infos, use_narcache, !interactive);
+  cacheinfo_sort(cache_urls, infos, cache_count);
+  cacheinfo_apply(cache_urls, infos, cache_count);
+
+  int status;
+  if (serve_path)
+    status = serve_run(serve_path, cache_urls, cache_count, &batch_opts);
+  else if (nar_mode)
+    status = run_nar(initial_input, &batch_opts, nar_output);
+  else if (closure_mode)
+    status = run_closure(initial_input, &batch_opts, local_store, store_db);
+  else if (batch_file || exists)
+    status = run_batch(batch_file, initial_input, &batch_opts);
+  else
+    status = run_tui(initial_input);
+
+  narcache_close();
+  sigverify_stop();
+  fetch_cleanup();
   curl_global_cleanup();
-  endwin();
-  clipboard_cleanup();
-
-  for (int i = 0; i < cache_count; i++) {
-    free(cache_urls[i]);
-  }
+  free_cache_urls();
 
-  return 0;
+  return status;
 }